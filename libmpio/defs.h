@@ -30,7 +30,11 @@
 extern "C" {
 #endif
 
+/* the libusb-1.0 build keeps its handles in transport_data */
+#ifndef MPIO_LIBUSB1
 #include "usb.h"
+#endif
+#include <iconv.h>
 
 typedef unsigned char  BYTE;
 typedef char CHAR;
@@ -101,6 +105,12 @@ typedef BYTE (*mpio_callback_init_t)(mpio_mem_t, int, int) ;
 #define MPIO_ZONE_PBLOCKS 1024 /* physical blocks per zone */
 #define MPIO_ZONE_LBLOCKS 1000 /* logical blocks per zone */
 typedef DWORD mpio_zonetable_t[MPIO_ZONE_MAX][MPIO_ZONE_PBLOCKS];
+/* reverse lookup log.->phys. block, the last slot is used for the CIS */
+#define MPIO_ZONE_CIS_SLOT MPIO_ZONE_PBLOCKS
+#define MPIO_ZONE_NONE     0xffff
+typedef WORD  mpio_zonelookup_t[MPIO_ZONE_MAX][MPIO_ZONE_PBLOCKS + 1];
+/* bitmap of the free physical blocks */
+typedef DWORD mpio_zonefree_t[MPIO_ZONE_MAX][MPIO_ZONE_PBLOCKS / 32];
 
 #define MPIO_BLOCK_FREE      0xffff
 #define MPIO_BLOCK_DEFECT    0xffee
@@ -133,6 +143,12 @@ typedef CHAR mpio_filename_t[MPIO_FILENAME_LEN];
 #define MEGABLOCK_READ    (MEGABLOCK_SIZE + (SECTOR_ECC * MEGABLOCK_SECTORS))
 #define MEGABLOCK_WRITE   (MEGABLOCK_SIZE + (0x10 * MEGABLOCK_SECTORS))
 #define MEGABLOCK_TRANS_WRITE (BLOCK_SIZE + (0x10 * BLOCK_SECTORS))
+/* largest prepared block transfer, see mpio_io_block_frame */
+#define MPIO_FRAME_SIZE   (8 * MEGABLOCK_TRANS_WRITE)
+
+/* shortest run of sectors in one block worth a GET_BLOCK,
+ * one block transfer takes about as long as 8 GET_SECTOR round trips */
+#define MPIO_SECTOR_BATCH 8
 
 #define DIR_NUM          0x10
 #define DIR_SIZE         (SECTOR_SIZE*DIR_NUM)
@@ -144,6 +160,14 @@ typedef CHAR mpio_filename_t[MPIO_FILENAME_LEN];
 
 #define INFO_LINE        129
 
+/* blocks buffered between the transfer thread and local I/O */
+#define MPIO_PIPELINE_DEPTH 4
+#define MPIO_PIPELINE_MAX   32
+
+/* blocks kept for mpio_file_read */
+#define MPIO_CACHE_BLOCKS   4
+#define MPIO_CACHE_MAX      16
+
 /* error codes */
 typedef struct {
   int	id;
@@ -210,11 +234,41 @@ typedef struct {
 
 /* */
 
+/* parsed directory entry */
+typedef struct {
+  CHAR  name[INFO_LINE];         /* long filename */
+  CHAR  name_8_3[13];            /* 8.3 alias */
+  WORD  year;
+  BYTE  month;
+  BYTE  day;
+  BYTE  hour;
+  BYTE  minute;
+  DWORD fsize;
+  BYTE  type;
+  int   offset;                  /* offset of the dentry in the directory */
+  int   size;                    /* offset of the 8.3 dentry behind the VFAT
+				    slots, see mpio_dentry_get_real */
+  WORD  start;                   /* start cluster from that 8.3 dentry */
+  int   next_name;               /* hash chains, -1 terminates */
+  int   next_8_3;
+} mpio_dentry_cache_t;
+
+#define MPIO_DENTRY_HASH 64      /* must be a power of two */
+
 struct mpio_directory_tx {
   CHAR name[INFO_LINE];
   BYTE dir[MEGABLOCK_SIZE];
   
   BYTE *dentry;
+
+  /* parsed entries of dir, built on demand */
+  mpio_dentry_cache_t *cache;
+  int cache_num;                 /* -1 if the cache is invalid */
+  int cache_max;                 /* allocated entries */
+  int hash_name[MPIO_DENTRY_HASH];
+  int hash_8_3[MPIO_DENTRY_HASH];
+
+  BYTE dirty;                    /* dir differs from the copy on the card */
     
   struct mpio_directory_tx *prev;
   struct mpio_directory_tx *next;
@@ -248,6 +302,21 @@ typedef struct {
   DWORD  fat_size;               /* # sectors for FAT */  
   DWORD  fat_nums;               /* # of FATs */
   BYTE * fat;                    /* *real FAT (like in block allocation :-) */
+  WORD * fat_table;              /* external FAT, one WORD per entry */
+  DWORD  fat_table_size;         /* # entries in fat_table */
+  DWORD *fat_free_map;           /* one bit per FAT entry, set if free */
+  DWORD  fat_free_count;         /* # of free FAT entries */
+  DWORD  fat_cursor;             /* next-fit cursor for allocation */
+  BYTE * fat_dirty;              /* one flag per FAT sector, set if changed */
+  BYTE   boot_dirty;             /* MBR and PBR have to be written */
+  int    fat_index_start[256];   /* internal: first entry of a file index */
+  WORD   fat_index_used[256];    /* internal: # entries with a file index */
+  BYTE   fat_index_starts[256];  /* internal: # start entries of an index */
+  BYTE   fat_index_valid;        /* the three tables above are built */
+  BYTE   fat_loaded;             /* internal: one bit per chip whose spare
+				    area has been read, external: FAT
+				    and root directory have been read */
+  BYTE   fat_loading;            /* external: mpio_fat_load is running */
 
   /* needed for directory support */
   mpio_directory_t *root; /* root directory */
@@ -261,6 +330,10 @@ typedef struct {
 
   /* lookup table for phys.<->log. block mapping */
   mpio_zonetable_t zonetable;
+  mpio_zonelookup_t zonelookup;
+  mpio_zonefree_t zonefree;
+  BYTE zonedups[MPIO_ZONE_MAX];  /* zone has duplicate logical blocks */
+  BYTE zone_loaded;              /* spare area has been read */
 
   /* version of chips used */
   BYTE version;
@@ -291,17 +364,114 @@ typedef struct {
   mpio_health_single_t data[8];
 } mpio_health_t;  
 
-/* view of the MPIO-* */
+/* commands counted by the transfer statistics */
+typedef enum { MPIO_STATS_GET_BLOCK,
+	       MPIO_STATS_PUT_BLOCK,
+	       MPIO_STATS_PUT_MEGABLOCK,
+	       MPIO_STATS_DEL_BLOCK,
+	       MPIO_STATS_GET_SECTOR,
+	       MPIO_STATS_PUT_SECTOR,
+	       MPIO_STATS_GET_SPARE_AREA,
+	       MPIO_STATS_OTHER,
+	       MPIO_STATS_OPS } mpio_stats_op_t;
+
+/* bucket i counts commands taking 2^i to 2^(i+1) usec,
+ * the last one everything longer */
+#define MPIO_STATS_BUCKETS 24
+
+typedef struct {
+  DWORD commands;
+  unsigned long long bytes_out;    /* including the command packets */
+  unsigned long long bytes_in;
+  unsigned long long usec;         /* from command to its last transfer */
+  DWORD latency[MPIO_STATS_BUCKETS];
+} mpio_stats_single_t;
+
+typedef struct {
+  mpio_stats_single_t op[MPIO_STATS_OPS];
+  DWORD short_reads;               /* transfers returning less than asked */
+  DWORD short_writes;
+  DWORD ecc_corrected;             /* single bit errors fixed on read */
+  DWORD ecc_failed;
+} mpio_stats_t;
+
+struct mpio_tx;
+struct mpio_put_job_tx;
+
+/* files read ahead by mpio_file_put_prefetch: the one put next and
+ * the one after it */
+#define MPIO_PREFETCH 2
+struct mpio_cache_block_tx;
+struct mpio_trace_tx;
+
+/* identity of a player, see mpio_enumerate */
+#define MPIO_DEVICE_ID  256
+#define MPIO_DEVICE_MAX 16
+
 typedef struct {
+  CHAR bus[MPIO_DEVICE_ID];        /* libusb bus or name of the transport */
+  CHAR device[MPIO_DEVICE_ID];     /* libusb device or image/trace file */
+  WORD product;                    /* USB product ID, 0 if unknown */
+} mpio_device_t;
+
+/* transport used to talk to the player:
+ * the real device via libusb or the NAND emulator */
+typedef struct {
+  CHAR *name;
+  int (*enumerate)(mpio_device_t *, int);
+  int (*open) (struct mpio_tx *);
+  int (*close)(struct mpio_tx *);
+  int (*write)(struct mpio_tx *, CHAR *, int);
+  int (*read) (struct mpio_tx *, CHAR *, int);
+} mpio_transport_t;
+
+/* environment variables of the NAND emulator */
+#define MPIO_EMULATOR_ENV           "MPIO_EMULATOR"           /* image file(s) */
+#define MPIO_EMULATOR_LATENCY_ENV   "MPIO_EMULATOR_LATENCY"   /* usec/command */
+#define MPIO_EMULATOR_BANDWIDTH_ENV "MPIO_EMULATOR_BANDWIDTH" /* KB/sec */
+#define MPIO_EMULATOR_MEMORY_ENV    "MPIO_EMULATOR_MEMORY"    /* new images */
+
+/* environment variables of the trace recorder and replay */
+#define MPIO_TRACE_ENV              "MPIO_TRACE"              /* record */
+#define MPIO_REPLAY_ENV             "MPIO_REPLAY"             /* replay */
+
+/* view of the MPIO-* */
+typedef struct mpio_tx {
   CHAR version[CMD_SIZE];
   
   int fd;
+  int error;                       /* last error of this player, see
+				      mpio_context_errno */
+  mpio_device_t device;            /* the player we are talking to */
+  BYTE device_set;                 /* device was selected by the caller */
+  mpio_transport_t *transport;     /* how we talk to the player */
+  void *transport_data;            /* private data of the transport */
+  struct mpio_trace_tx *trace;     /* recorder, see trace.c */
   struct usb_bus *usb_busses;
   struct usb_bus *usb_bus;
   struct usb_dev_handle *usb_handle;
   int usb_out_ep;
   int usb_in_ep;
   CHAR *charset;                   /* charset used for filename conversion */
+  iconv_t ic_to_unicode;           /* charset -> UNICODE */
+  iconv_t ic_from_unicode;         /* UNICODE -> charset */
+  BYTE charset_ascii;              /* charset is a superset of 7-bit ASCII */
+
+  BYTE pipeline;                   /* # of blocks buffered while streaming
+				      files, 0 disables the transfer thread */
+  struct mpio_put_job_tx *prefetch[MPIO_PREFETCH]; 
+                                   /* see mpio_file_put_prefetch */
+  BYTE mount_valid;                /* mount cache matches the card */
+
+  mpio_stats_t stats;              /* see mpio_stats_get */
+  int stats_op;                    /* command in progress, -1 if none */
+  unsigned long long stats_start;  /* usec */
+  unsigned long long stats_end;
+
+  BYTE cache;                      /* # of blocks cached for mpio_file_read,
+				      0 disables the cache */
+  struct mpio_cache_block_tx *cache_block;
+  DWORD cache_clock;
 
   BYTE id3;                        /* enable/disable ID3 rewriting support */
   CHAR id3_format[INFO_LINE];
@@ -333,6 +503,20 @@ typedef struct {
   
 } mpio_fatentry_t;
 
+/* one cluster of a FAT chain */
+typedef struct {
+  DWORD entry;
+  DWORD hw_address;
+} mpio_chainlink_t;
+
+/* a file's FAT chain resolved into an array */
+typedef struct {
+  mpio_chainlink_t *link;
+  DWORD count;
+  DWORD size;                      /* number of allocated links */
+  BYTE  defect;                    /* chain ends at a defective block */
+} mpio_chain_t;
+
 
 /* these are copied from:
  * http://www.linuxhq.com/kernel/v2.4/doc/filesystems/vfat.txt.html
@@ -48,6 +48,25 @@ extern "C" {
 mpio_t *mpio_init(mpio_callback_init_t);
 void	mpio_close(mpio_t *);
 
+/* fill in up to <max> connected players, returns the number found */
+int	mpio_enumerate(mpio_device_t *, int max);
+/* like mpio_init, but opens the given player (NULL for the first one),
+ * every context may be used by a thread of its own */
+mpio_t *mpio_init_device(mpio_device_t *, mpio_callback_init_t);
+
+/* 
+ * The following two settings are process-wide and not locked: set them
+ * before the first mpio_init or mpio_init_device and before starting
+ * any thread that uses libmpio.
+ */
+
+/* directory for a cache of the spare areas and FATs, speeds up opening
+ * the player, NULL disables it */
+void	mpio_mount_cache_set(CHAR *);
+/* read all spare areas in mpio_init (reporting progress) instead of
+ * on first use */
+void	mpio_preload_set(BYTE);
+
 /*
  * request information
  */
@@ -107,6 +126,13 @@ int	mpio_file_put_as(mpio_t *, mpio_mem_t, mpio_filename_t,
 			 mpio_filename_t, mpio_filetype_t,
 			 mpio_callback_t); 
 
+/* context, memory bank, filename */
+/* start reading the next file of a batch while the current one is still */
+/* transferred, the following mpio_file_put* of this file picks it up.   */
+/* It may be called before the put of the current file, whose prefetch   */
+/* is kept. NULL drops everything read ahead.                            */
+int	mpio_file_put_prefetch(mpio_t *, mpio_mem_t, mpio_filename_t);
+
 /* context, memory bank, filename, callback */
 int	mpio_file_del(mpio_t *, mpio_mem_t, mpio_filename_t, mpio_callback_t); 
 
@@ -121,6 +147,13 @@ int	mpio_file_del(mpio_t *, mpio_mem_t, mpio_filename_t, mpio_callback_t);
 int	mpio_file_get_to_memory(mpio_t *, mpio_mem_t, mpio_filename_t, 
 				mpio_callback_t, CHAR **); 
 
+/* context, memory bank, filename, offset, length, buffer     */
+/* reads part of a file, only the blocks needed are fetched   */
+/* returns the number of bytes read, which is less than the   */
+/* length at the end of the file                              */
+int	mpio_file_read(mpio_t *, mpio_mem_t, mpio_filename_t,
+		       DWORD, DWORD, BYTE *);
+
 /* context, memory bank, filename, filetype, callback ... */
 /* ... memory pointer, size of file                       */
 int	mpio_file_put_from_memory(mpio_t *, mpio_mem_t, mpio_filename_t, 
@@ -167,6 +200,26 @@ int	mpio_memory_format(mpio_t *, mpio_mem_t, mpio_callback_t);
 /* context, memory bank */
 int	mpio_sync(mpio_t *, mpio_mem_t);
 
+/*
+ * streaming of file transfers
+ */
+
+/* # of blocks buffered by the transfer thread, 0 disables it */
+BYTE   mpio_pipeline_set(mpio_t *, BYTE);
+BYTE   mpio_pipeline_get(mpio_t *);
+/* # of blocks cached for mpio_file_read, 0 disables the cache */
+BYTE   mpio_cache_set(mpio_t *, BYTE);
+BYTE   mpio_cache_get(mpio_t *);
+
+/*
+ * transfer statistics, counted per command since mpio_init
+ */
+
+void   mpio_stats_get(mpio_t *, mpio_stats_t *);
+void   mpio_stats_reset(mpio_t *);
+/* printable name of a command counted in mpio_stats_t.op */
+CHAR  *mpio_stats_name(mpio_stats_op_t);
+
 /*
  * ID3 rewriting support
  */
@@ -204,6 +257,10 @@ void	mpio_perror(char *prefix);
 /* set error code to given value */
 int	mpio_error_set(int err);
 
+/* the error codes above are kept per thread, these are per context */
+int	mpio_context_errno(mpio_t *);
+int	mpio_context_error_set(mpio_t *, int err);
+
 
 /* 
  * debugging
@@ -0,0 +1,139 @@
+/*
+ *  libmpio - a library for accessing Digit@lways MPIO players
+ *  Copyright (C) 2002-2004 Markus Germeier
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc.,g 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/*
+ * 
+ * small block cache for mpio_file_read
+ *
+ * Reading a tag or a part of a file usually touches the same blocks
+ * again, so the last few blocks are kept around. They are found by
+ * their FAT entry (external) or block address (internal) and the
+ * least recently used one is replaced on a miss.
+ *
+ * Every write and delete flushes the whole cache.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "debug.h"
+#include "io.h"
+#include "mpio.h"
+
+struct mpio_cache_block_tx {
+  BYTE   valid;
+  BYTE   mem;
+  DWORD  key;
+  DWORD  used;                     /* cache_clock at the last hit */
+  BYTE  *data;
+  int    size;
+};
+
+typedef struct mpio_cache_block_tx mpio_cache_block_t;
+
+BYTE *
+mpio_cache_block_read(mpio_t *m, mpio_mem_t mem, mpio_fatentry_t *f)
+{
+  mpio_cache_block_t *c, *victim = NULL;
+  DWORD key;
+  int i, size;
+
+  if (!m->cache)
+    return NULL;
+
+  if (!m->cache_block)
+    {
+      m->cache_block = calloc(MPIO_CACHE_MAX, sizeof(mpio_cache_block_t));
+      if (!m->cache_block)
+	return NULL;
+    }
+
+  if (mem == MPIO_INTERNAL_MEM) 
+    key = f->hw_address;
+  if (mem == MPIO_EXTERNAL_MEM) 
+    key = f->entry;
+  
+  for (i = 0; i < m->cache; i++)
+    {
+      c = &m->cache_block[i];
+      if ((c->valid) && (c->mem == mem) && (c->key == key))
+	{
+	  c->used = ++m->cache_clock;
+	  return c->data;
+	}
+      if ((!victim) || (!c->valid) || 
+	  ((victim->valid) && (c->used < victim->used)))
+	victim = c;
+    }
+
+  size = mpio_block_get_blocksize(m, mem);
+  if (victim->size < size)
+    {
+      free(victim->data);
+      victim->size = 0;
+      victim->data = malloc(size);
+      if (!victim->data)
+	{
+	  victim->valid = 0;
+	  return NULL;
+	}
+      victim->size = size;
+    }
+
+  debugn(3, "cache miss: mem=%02x key=%08x\n", mem, key);
+  victim->valid = 0;
+  if (mpio_io_block_read(m, mem, f, victim->data))
+    return NULL;
+
+  victim->valid = 1;
+  victim->mem   = mem;
+  victim->key   = key;
+  victim->used  = ++m->cache_clock;
+
+  return victim->data;
+}
+
+void
+mpio_cache_flush(mpio_t *m)
+{
+  int i;
+
+  if (!m->cache_block)
+    return;
+
+  for (i = 0; i < MPIO_CACHE_MAX; i++)
+    m->cache_block[i].valid = 0;
+}
+
+void
+mpio_cache_free(mpio_t *m)
+{
+  int i;
+
+  if (!m->cache_block)
+    return;
+
+  for (i = 0; i < MPIO_CACHE_MAX; i++)
+    free(m->cache_block[i].data);
+  free(m->cache_block);
+  m->cache_block = NULL;
+}
@@ -0,0 +1,41 @@
+/*
+ *  libmpio - a library for accessing Digit@lways MPIO players
+ *  Copyright (C) 2002-2004 Markus Germeier
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc.,g 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#ifndef _MPIO_CACHE_H_
+#define _MPIO_CACHE_H_
+
+#include "defs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* the cached copy of the block f points to, it is read on a miss
+ * returns NULL if the cache is disabled */
+BYTE   *mpio_cache_block_read(mpio_t *, mpio_mem_t, mpio_fatentry_t *);
+/* forget all cached blocks, called before anything is written */
+void	mpio_cache_flush(mpio_t *);
+void	mpio_cache_free(mpio_t *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _MPIO_CACHE_H_ */
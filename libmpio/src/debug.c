@@ -145,6 +145,8 @@ _hexdump (const char *package, const char* file, int line,
   CHECK_FD;
 
   if (_use_debug(LEVEL_HEXDUMP)) {
+    /* keep the lines of one dump together */
+    flockfile(__debug_fd);
     fprintf (__debug_fd, "%s%s:\033[m %s(%d): %s: data=%p len=%d\n", 
 	    __debug_color, package, file, line, function, data, len);
     for (i = 0; data != NULL && i < len; i++) {
@@ -161,6 +163,7 @@ _hexdump (const char *package, const char* file, int line,
 	fprintf (__debug_fd, (i % 4 == 3) ? "    " : "   ");
       fprintf(__debug_fd, "%s\n", buf);
     }
+    funlockfile(__debug_fd);
   }
 }
 
@@ -174,6 +177,8 @@ _hexdump_n (const char *package, const int n, const char* file, int line,
   CHECK_FD;
   
   if (_use_debug(n)) {
+    /* keep the lines of one dump together */
+    flockfile(__debug_fd);
     fprintf (__debug_fd, "%s%s:\033[m %s(%d): %s: data=%p len=%d\n", 
 	    __debug_color, package, file, line, function, data, len);
     for (i = 0; data != NULL && i < len; i++) {
@@ -190,6 +195,7 @@ _hexdump_n (const char *package, const int n, const char* file, int line,
 	fprintf (__debug_fd, (i % 4 == 3) ? "    " : "   ");
       fprintf(__debug_fd, "%s\n", buf);
     }
+    funlockfile(__debug_fd);
   }
 }
 
@@ -293,6 +299,7 @@ _octetstr(const char *package, const char *file, int line,
   if (_use_debug(LEVEL_HEXDUMP)) {
     unsigned int i;
     
+    flockfile(__debug_fd);
     fprintf(__debug_fd, "%s%s: %s(%d): %s: ", 
 	    package, file, function, line, (what?what:""));
     for (i = 0; i < len; i++) {
@@ -301,6 +308,7 @@ _octetstr(const char *package, const char *file, int line,
       else
 	fprintf(__debug_fd, "%03d", str [i]);
     }
+    funlockfile(__debug_fd);
   }
 }
 
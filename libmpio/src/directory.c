@@ -73,32 +73,127 @@ mpio_charset_get(mpio_t *m)
   return strdup(m->charset);
 }
   
+/* check if the 7-bit ASCII range passes through ic unchanged */
+static BYTE
+mpio_charset_check_ascii(iconv_t ic)
+{
+  CHAR in[0x80 * 2], out[0x80 * 2];
+  char *pin = in, *pout = out;
+  size_t fin = sizeof(in), fout = sizeof(out);
+  int i;
+
+  for (i = 0; i < 0x80; i++)
+    {
+      in[i * 2]     = i;
+      in[i * 2 + 1] = 0;
+    }
+
+  if (iconv(ic, &pin, &fin, &pout, &fout) == (size_t)(-1))
+    return 0;
+  iconv(ic, NULL, NULL, NULL, NULL);
+  
+  if (fout != 0x80)
+    return 0;
+  for (i = 0; i < 0x80; i++)
+    if (out[i] != i)
+      return 0;
+
+  return 1;
+}
+
 BYTE   
 mpio_charset_set(mpio_t *m, CHAR *charset)
 {
-  iconv_t ic;
-  int     r = 1;
+  iconv_t to, from;
   
-  ic = iconv_open(UNICODE, charset);
-  if (ic == ((iconv_t)(-1)))
-    r=0;
-  iconv_close(ic);
+  to = iconv_open(UNICODE, charset);
+  if (to == ((iconv_t)(-1)))
+    {
+      debugn(2, "could not set charset to: \"%s\"\n", charset);
+      return 0;
+    }
   
-  ic = iconv_open(charset, UNICODE);
-  if (ic == ((iconv_t)(-1)))
-    r=0;
-  iconv_close(ic);
-
-  if (r)
+  from = iconv_open(charset, UNICODE);
+  if (from == ((iconv_t)(-1)))
     {
-      debugn(2, "setting new charset to: \"%s\"\n", charset);
-      free(m->charset);
-      m->charset=strdup(charset);
-    } else {
+      iconv_close(to);
       debugn(2, "could not set charset to: \"%s\"\n", charset);
+      return 0;
     }
+
+  debugn(2, "setting new charset to: \"%s\"\n", charset);
+  if (m->charset)
+    free(m->charset);
+  m->charset=strdup(charset);
+
+  /* keep the descriptors around, opening them is expensive */
+  if (m->ic_to_unicode != ((iconv_t)(-1)))
+    iconv_close(m->ic_to_unicode);
+  if (m->ic_from_unicode != ((iconv_t)(-1)))
+    iconv_close(m->ic_from_unicode);
+  m->ic_to_unicode   = to;
+  m->ic_from_unicode = from;
+  m->charset_ascii   = mpio_charset_check_ascii(from);
   
-  return r;
+  return 1;
+}
+
+/* 
+ * fast path for pure 7-bit names, this is what almost all filenames
+ * look like and saves us the trip through iconv
+ */
+static int
+mpio_charset_ascii_to_unicode(mpio_t *m, CHAR *in, size_t size, CHAR *out)
+{
+  BYTE acc = 0;
+  size_t i;
+
+  if (!m->charset_ascii)
+    return 0;
+  
+  for (i = 0; i < size; i++)
+    acc |= in[i];
+  if (acc & 0x80)
+    return 0;
+
+  for (i = 0; i < size; i++)
+    {
+      out[i * 2]     = in[i];
+      out[i * 2 + 1] = 0;
+    }
+  
+  return 1;
+}
+
+/* size is in bytes of UNICODE input, out the size of the output buffer */
+static int
+mpio_charset_ascii_from_unicode(mpio_t *m, CHAR *in, size_t size, 
+				CHAR *out, size_t osize)
+{
+  WORD acc = 0;
+  size_t i, len;
+
+  if (!m->charset_ascii)
+    return 0;
+
+  /* the name ends with the first NUL character */
+  len = 0;
+  while ((len < size / 2) && (in[len * 2] || in[len * 2 + 1]))
+    len++;
+  if (len > osize)
+    return 0;
+  
+  for (i = 0; i < len; i++)
+    acc |= (BYTE)in[i * 2] | ((BYTE)in[i * 2 + 1] << 8);
+  if (acc & 0xff80)
+    return 0;
+
+  for (i = 0; i < len; i++)
+    out[i] = in[i * 2];
+  if (len < osize)
+    out[len] = 0;
+  
+  return 1;
 }
 
 int     
@@ -110,6 +205,7 @@ mpio_directory_init(mpio_t *m, mpio_mem_t mem, mpio_directory_t *dir,
   UNUSED(m);
   UNUSED(mem);
   
+  mpio_directory_cache_invalidate(dir);
   memset(dir->dir,         0, BLOCK_SIZE);
   memset(dir->dir,      0x20, 11);
   memset(dir->dir+0x20, 0x20, 11);
@@ -149,6 +245,8 @@ mpio_directory_read(mpio_t *m, mpio_mem_t mem, mpio_directory_t *dir)
     }
 
   mpio_io_block_read(m, mem, f, dir->dir);
+  mpio_directory_cache_invalidate(dir);
+  dir->dirty = 0;
 
   hexdumpn(5, (CHAR *)dir->dir, DIR_SIZE);	
 
@@ -213,6 +311,7 @@ mpio_directory_write(mpio_t *m, mpio_mem_t mem, mpio_directory_t *dir)
   
   mpio_io_block_delete(m, mem, f);
   mpio_io_block_write(m, mem, f, dir->dir);
+  dir->dirty = 0;
 
   return 0;
 }
@@ -224,6 +323,9 @@ mpio_directory_open(mpio_t *m, mpio_mem_t mem)
   BYTE *out;  
   if (mem == MPIO_EXTERNAL_MEM) {
     if (m->external.id)  { 
+      /* the root directory is read together with the FAT */
+      if (mpio_fat_load(m, mem, NULL))
+	return NULL;
       out = m->external.cdir->dir;
     } else {
       return NULL;
@@ -267,14 +369,14 @@ mpio_directory_make(mpio_t *m, mpio_mem_t mem, CHAR *dir)
   if (p) 
     {
       debugn(2, "filename already exists\n");
-      return mpio_error_set(MPIO_ERR_FILE_EXISTS);
+      return mpio_context_error_set(m, MPIO_ERR_FILE_EXISTS);
     }
 
   if ((strcmp(dir, "..") == 0) ||
       (strcmp(dir, ".") == 0))
     {
       debugn(2, "directory name not allowed: %s\n", dir);
-      return mpio_error_set(MPIO_ERR_DIR_NAME_ERROR);    
+      return mpio_context_error_set(m, MPIO_ERR_DIR_NAME_ERROR);    
     }
 
   /* find free sector */
@@ -282,7 +384,7 @@ mpio_directory_make(mpio_t *m, mpio_mem_t mem, CHAR *dir)
   if (!f) 
     {
       debug("could not free cluster for file!\n");
-      return mpio_error_set(MPIO_ERR_FAT_ERROR);
+      return mpio_context_error_set(m, MPIO_ERR_FAT_ERROR);
     } else {
       self=f->entry;
     }  
@@ -310,7 +412,7 @@ mpio_directory_make(mpio_t *m, mpio_mem_t mem, CHAR *dir)
       current = mpio_dentry_get_startcluster(m, mem, sm->cdir->dentry);
       if (!current) {
 	debugn(2, "error creating directory");
-	return mpio_error_set(MPIO_ERR_FAT_ERROR);
+	return mpio_context_error_set(m, MPIO_ERR_FAT_ERROR);
       }
 
       if (mem==MPIO_INTERNAL_MEM)
@@ -323,11 +425,12 @@ mpio_directory_make(mpio_t *m, mpio_mem_t mem, CHAR *dir)
 
 
   new = malloc(sizeof(mpio_directory_t));
+  mpio_directory_cache_init(new);
   mpio_directory_init(m, mem, new, self, parent);
 
   mpio_fatentry_set_eof(m ,mem, f);
   time(&curr);
-  tt = * localtime(&curr);
+  localtime_r(&curr, &tt);
   mpio_dentry_put(m, mem,
                   dir, strlen(dir),
                       mktime(&tt),
@@ -342,6 +445,7 @@ mpio_directory_make(mpio_t *m, mpio_mem_t mem, CHAR *dir)
   }  
   mpio_io_block_write(m, mem, f, new->dir);
   
+  mpio_directory_cache_free(new);
   free(new);
   
   return MPIO_OK;
@@ -376,6 +480,7 @@ mpio_directory_cd(mpio_t *m, mpio_mem_t mem, CHAR *dir)
 	  old            = sm->cdir;
 	  sm->cdir       = sm->cdir->prev;
 	  sm->cdir->next = NULL;
+	  mpio_directory_cache_free(old);
 	  free(old);
 	}
 
@@ -387,7 +492,7 @@ mpio_directory_cd(mpio_t *m, mpio_mem_t mem, CHAR *dir)
   if ((strlen(pwd) + strlen(dir) + 2) > INFO_LINE)
   {
       debugn(2, "directory name gets to long!\n");
-      return mpio_error_set(MPIO_ERR_DIR_TOO_LONG);    
+      return mpio_context_error_set(m, MPIO_ERR_DIR_TOO_LONG);    
   }
 
   p = mpio_dentry_find_name(m, mem, dir);
@@ -399,7 +504,7 @@ mpio_directory_cd(mpio_t *m, mpio_mem_t mem, CHAR *dir)
   if (!p) 
     {
       debugn(2, "could not find directory: %s\n", dir);
-      return mpio_error_set(MPIO_ERR_DIR_NOT_FOUND);
+      return mpio_context_error_set(m, MPIO_ERR_DIR_NOT_FOUND);
     }
   
   mpio_dentry_get(m, mem, p,
@@ -411,7 +516,7 @@ mpio_directory_cd(mpio_t *m, mpio_mem_t mem, CHAR *dir)
   if (type != FTYPE_DIR)
     {
       debugn(2, "this is not a directory: %s\n", dir);
-      return mpio_error_set(MPIO_ERR_DIR_NOT_A_DIR);    
+      return mpio_context_error_set(m, MPIO_ERR_DIR_NOT_A_DIR);    
     }
 
   if (sm->cdir->dentry) {    
@@ -423,11 +528,12 @@ mpio_directory_cd(mpio_t *m, mpio_mem_t mem, CHAR *dir)
     if (ret) 
       {
 	debugn(2, "this is a recursive direcotry entry: %s\n", dir);
-	return mpio_error_set(MPIO_ERR_DIR_RECURSION);    
+	return mpio_context_error_set(m, MPIO_ERR_DIR_RECURSION);    
       }
   }
 
   new             = malloc(sizeof(mpio_directory_t));
+  mpio_directory_cache_init(new);
   strcpy(new->name, dir);		   
   new->next       = NULL;
   new->prev       = sm->cdir;
@@ -481,7 +587,6 @@ mpio_dentry_filename_write(mpio_t *m, mpio_mem_t mem, BYTE *p,
   CHAR *unicode = 0;
   CHAR *back, *fback;
   CHAR *fname = 0;
-  iconv_t ic;
   int in = 0, out = 0;
   size_t fin = 0, fout = 0;
   int count = 0;
@@ -494,7 +599,6 @@ mpio_dentry_filename_write(mpio_t *m, mpio_mem_t mem, BYTE *p,
   int points;
   
   /* generate vfat filename in UNICODE */
-  ic = iconv_open(UNICODE, m->charset);
   fin = in = filename_size + 1;
   fout = out = filename_size * 2 + 2 + 26;
   fname = malloc(in);
@@ -505,8 +609,11 @@ mpio_dentry_filename_write(mpio_t *m, mpio_mem_t mem, BYTE *p,
   memset(fname, 0, in);
   snprintf(fname, in, "%s", filename);
   memset(unicode, 0xff, out);
-  iconv(ic, (char **)&fback, &fin, (char **)&back, &fout);
-  iconv_close(ic);
+  if (!mpio_charset_ascii_to_unicode(m, fname, in, unicode))
+    {
+      iconv(m->ic_to_unicode, NULL, NULL, NULL, NULL);
+      iconv(m->ic_to_unicode, (char **)&fback, &fin, (char **)&back, &fout);
+    }
   hexdump(fname, in);
   hexdump(unicode, out);
 
@@ -710,6 +817,164 @@ mpio_dentry_copy_to_slot(CHAR *buffer, mpio_dir_slot_t *slot)
   memcpy(slot->name11_12, buffer + 22, 4);
 }
 
+/*
+ * cache of parsed directory entries, every name lookup would otherwise
+ * decode all VFAT slot chains of the directory again
+ */
+void
+mpio_directory_cache_init(mpio_directory_t *dir)
+{
+  dir->cache     = NULL;
+  dir->cache_num = -1;
+  dir->cache_max = 0;
+  dir->dirty     = 0;
+}
+
+void
+mpio_directory_cache_invalidate(mpio_directory_t *dir)
+{
+  dir->cache_num = -1;
+}
+
+void
+mpio_directory_cache_free(mpio_directory_t *dir)
+{
+  if (dir->cache)
+    free(dir->cache);
+  mpio_directory_cache_init(dir);
+}
+
+static DWORD
+mpio_directory_cache_hash(CHAR *name)
+{
+  DWORD h = 2166136261U;
+  
+  while (*name)
+    h = (h ^ (BYTE)*name++) * 16777619U;
+
+  return (h & (MPIO_DENTRY_HASH - 1));
+}
+
+/* parse the dentry at p and append it to the cache of dir */
+static int
+mpio_directory_cache_add(mpio_t *m, mpio_mem_t mem, mpio_directory_t *dir,
+			 BYTE *p)
+{
+  mpio_dentry_cache_t *c;
+  mpio_dir_slot_t *dentry;
+  /* iconv output is only limited by the number of VFAT slots */
+  CHAR fname[(DIR_SIZE / DIR_ENTRY_SIZE) * 13 + 1];
+  DWORD h;
+  
+  if (dir->cache_num == dir->cache_max)
+    {
+      c = realloc(dir->cache, (dir->cache_max + 32) * 
+		  sizeof(mpio_dentry_cache_t));
+      if (!c)
+	return -1;
+      dir->cache      = c;
+      dir->cache_max += 32;
+    }
+  c = &dir->cache[dir->cache_num];
+
+  c->fsize = 0;
+  c->size  = mpio_dentry_get_real(m, mem, p, fname, 128, c->name_8_3,
+				  &c->year, &c->month, &c->day,
+				  &c->hour, &c->minute, &c->fsize, &c->type);
+  fname[INFO_LINE - 1] = 0;
+  strcpy(c->name, fname);
+  c->offset = p - dir->dir;
+  dentry = (mpio_dir_slot_t *)(p + c->size);
+  c->start = dentry->start[1] * 0x100 + dentry->start[0];
+
+  h = mpio_directory_cache_hash(c->name);
+  c->next_name = dir->hash_name[h];
+  dir->hash_name[h] = dir->cache_num;
+  h = mpio_directory_cache_hash(c->name_8_3);
+  c->next_8_3 = dir->hash_8_3[h];
+  dir->hash_8_3[h] = dir->cache_num;
+
+  dir->cache_num++;
+  
+  return 0;
+}
+
+/* (re)parse the current directory if needed */
+static mpio_directory_t *
+mpio_directory_cache_get(mpio_t *m, mpio_mem_t mem)
+{
+  mpio_directory_t *dir;
+  BYTE *p;
+  int i;
+
+  p = mpio_directory_open(m, mem);
+  if (!p)
+    return NULL;
+
+  if (mem == MPIO_INTERNAL_MEM) dir = m->internal.cdir;
+  if (mem == MPIO_EXTERNAL_MEM) dir = m->external.cdir;
+  
+  if (dir->cache_num >= 0)
+    return dir;
+
+  dir->cache_num = 0;
+  for (i = 0; i < MPIO_DENTRY_HASH; i++)
+    dir->hash_name[i] = dir->hash_8_3[i] = -1;
+
+  while (p) 
+    {
+      if (mpio_directory_cache_add(m, mem, dir, p))
+	{
+	  mpio_directory_cache_invalidate(dir);
+	  return NULL;
+	}
+      p = mpio_dentry_next(m, mem, p);
+    }
+
+  debugn(3, "parsed %d directory entries\n", dir->cache_num);
+  
+  return dir;
+}
+
+/* lookup the parsed entry for the dentry at p in the cache of dir,
+ * which is not (re)built */
+static mpio_dentry_cache_t *
+mpio_directory_cache_search(mpio_directory_t *dir, BYTE *p)
+{
+  int lo, hi, mid, offset;
+
+  if ((!dir) || (dir->cache_num < 0))
+    return NULL;
+  if ((p < dir->dir) || (p >= (dir->dir + DIR_SIZE)))
+    return NULL;
+
+  /* entries are stored in directory order */
+  offset = p - dir->dir;
+  lo = 0;
+  hi = dir->cache_num - 1;
+  while (lo <= hi) 
+    {
+      mid = (lo + hi) / 2;
+      if (dir->cache[mid].offset == offset)
+	return &dir->cache[mid];
+      if (dir->cache[mid].offset < offset) 
+	{
+	  lo = mid + 1;
+	} else {
+	  hi = mid - 1;
+	}
+    }
+
+  return NULL;
+}
+
+/* lookup the parsed entry for the dentry at p */
+static mpio_dentry_cache_t *
+mpio_directory_cache_find(mpio_t *m, mpio_mem_t mem, BYTE *p)
+{
+  return mpio_directory_cache_search(mpio_directory_cache_get(m, mem), p);
+}
+
 int
 mpio_dentry_get(mpio_t *m, mpio_mem_t mem, BYTE *buffer,                   
 		CHAR *filename, int filename_size,
@@ -717,6 +982,21 @@ mpio_dentry_get(mpio_t *m, mpio_mem_t mem, BYTE *buffer,
 		BYTE *hour, BYTE *minute, DWORD *fsize, BYTE *type)
 {
   CHAR filename_8_3[13];
+  mpio_dentry_cache_t *c;
+
+  c = mpio_directory_cache_find(m, mem, buffer);
+  if (c) 
+    {
+      snprintf(filename, filename_size, "%s", c->name);
+      *year   = c->year;
+      *month  = c->month;
+      *day    = c->day;
+      *hour   = c->hour;
+      *minute = c->minute;
+      *fsize  = c->fsize;
+      *type   = c->type;
+      return c->size;
+    }
   
   return mpio_dentry_get_real(m, mem, buffer, filename, filename_size, 
 			      filename_8_3,
@@ -738,12 +1018,11 @@ mpio_dentry_get_real(mpio_t *m, mpio_mem_t mem, BYTE *buffer,
   int slots = 0;
   size_t in = 0, out = 0, iconv_return;
   mpio_dir_entry_t *dentry;
-  mpio_fatentry_t  *f;
+  mpio_fatentry_t  f;
   mpio_dir_slot_t  *slot;
   CHAR *unicode = 0;
   CHAR *uc;
   CHAR *fname = 0;
-  iconv_t ic;
   int dsize, i;
   
   if (buffer == NULL)
@@ -787,15 +1066,18 @@ mpio_dentry_get_real(mpio_t *m, mpio_mem_t mem, BYTE *buffer,
   
   if (vfat) 
     {
-      ic = iconv_open(m->charset, UNICODE);
       memset(fname, 0, filename_size);
       hexdumpn(4, unicode, in+2);
-      debugn(4, "before iconv: in: %2d - out: %2d\n", in, out);
-      iconv_return = iconv(ic, (char **)&uc, &in, (char **)&fname, &out);
-      debugn(4, "after  iconv: in: %2d - out: %2d (return: %d)\n", in, out,
-	     iconv_return);
-      hexdumpn(4, filename, (num_slots*13)-out);
-      iconv_close(ic);
+      if (!mpio_charset_ascii_from_unicode(m, uc, in, fname, out))
+	{
+	  debugn(4, "before iconv: in: %2d - out: %2d\n", in, out);
+	  iconv(m->ic_from_unicode, NULL, NULL, NULL, NULL);
+	  iconv_return = iconv(m->ic_from_unicode, (char **)&uc, &in, 
+			       (char **)&fname, &out);
+	  debugn(4, "after  iconv: in: %2d - out: %2d (return: %d)\n", 
+		 in, out, iconv_return);
+	  hexdumpn(4, filename, (num_slots*13)-out);
+	}
     } 
   free(unicode);
 
@@ -854,9 +1136,8 @@ mpio_dentry_get_real(mpio_t *m, mpio_mem_t mem, BYTE *buffer,
   } else {
     *type = FTYPE_PLAIN;
     if (mem == MPIO_INTERNAL_MEM) {
-      f = mpio_dentry_get_startcluster(m, mem, buffer);
-      if (f) {	
-	*type = m->internal.fat[f->entry * 0x10 + 0x06];
+      if (!mpio_dentry_startcluster_init(m, mem, buffer, &f)) {	
+	*type = m->internal.fat[f.entry * 0x10 + 0x06];
       } else {
 	/* we did not find the startcluster, thus the internal 
 	   FAT is broken for this file */
@@ -873,27 +1154,23 @@ int
 mpio_rootdir_read (mpio_t *m, mpio_mem_t mem)
 {
   mpio_smartmedia_t *sm;  
-  mpio_fatentry_t   *f;
-  CHAR recvbuff[SECTOR_SIZE];
-  int i;
+  mpio_fatentry_t   f;
 
   if (mem == MPIO_INTERNAL_MEM) sm = &m->internal;
   if (mem == MPIO_EXTERNAL_MEM) sm = &m->external;
+
+  mpio_directory_cache_invalidate(sm->root);
+  sm->root->dirty = 0;
   
   if (sm->version) {
     /* new chip */
-    f = mpio_fatentry_new(m, mem, 0x00, FTYPE_MUSIC);  
-    if (!f)
-      return 1;
-    mpio_io_block_read(m, mem, f, sm->root->dir);
-    free (f);	
+    mpio_fatentry_init(m, mem, &f, 0x00, FTYPE_MUSIC);  
+    mpio_io_block_read(m, mem, &f, sm->root->dir);
   } else {
     /* old chip */
-    for (i = 0; i < DIR_NUM; i++) {
-      if (mpio_io_sector_read(m, mem, (sm->dir_offset + i), recvbuff))
-	return 1;
-      memcpy(sm->root->dir + (i * SECTOR_SIZE), recvbuff, SECTOR_SIZE);
-    }
+    if (mpio_io_sector_range_read(m, mem, sm->dir_offset, DIR_NUM, 
+				  (CHAR *)sm->root->dir))
+      return 1;
   }
 
   return (0);
@@ -908,6 +1185,8 @@ mpio_rootdir_clear (mpio_t *m, mpio_mem_t mem)
   if (mem == MPIO_EXTERNAL_MEM) sm=&m->external;
 
   memset(sm->root->dir, 0x00, DIR_SIZE);
+  mpio_directory_cache_invalidate(sm->root);
+  sm->root->dirty = 1;
 
   return 0;
 }
@@ -1015,34 +1294,66 @@ mpio_dentry_get_time(mpio_t *m, mpio_mem_t mem, BYTE *p)
 
 mpio_fatentry_t *
 mpio_dentry_get_startcluster(mpio_t *m, mpio_mem_t mem, BYTE *p)
+{
+  mpio_fatentry_t *new;
+
+  new = malloc(sizeof(mpio_fatentry_t));
+  if (!new)
+    return NULL;
+
+  if (mpio_dentry_startcluster_init(m, mem, p, new))
+    {
+      free(new);
+      return NULL;
+    }
+
+  return new;
+}
+
+/* fill in the first FAT entry of a file, returns 1 if there is none */
+int
+mpio_dentry_startcluster_init(mpio_t *m, mpio_mem_t mem, BYTE *p, 
+			      mpio_fatentry_t *new)
 {
   int s;
   int cluster;
   BYTE i_index;
   mpio_dir_slot_t *dentry;
-  mpio_fatentry_t *new;
+  mpio_dentry_cache_t *c = NULL;
 
-  s  = mpio_dentry_get_size(m, mem, p);
-  s -= DIR_ENTRY_SIZE ;
+  /* only a cache that is already there, p may be outside of the
+   * current directory or the directory may just be read */
+  if (mem == MPIO_INTERNAL_MEM) 
+    c = mpio_directory_cache_search(m->internal.cdir, p);
+  if (mem == MPIO_EXTERNAL_MEM) 
+    c = mpio_directory_cache_search(m->external.cdir, p);
 
-  dentry = (mpio_dir_slot_t *)p;
+  if (c)
+    {
+      cluster = c->start;
+    } else {
+      s  = mpio_dentry_get_size(m, mem, p);
+      s -= DIR_ENTRY_SIZE ;
 
-  while (s != 0) {
-    dentry++;
-    s -= DIR_ENTRY_SIZE ;
-  }
+      dentry = (mpio_dir_slot_t *)p;
 
-  cluster = dentry->start[1] * 0x100 + dentry->start[0];
+      while (s != 0) {
+	dentry++;
+	s -= DIR_ENTRY_SIZE ;
+      }
+
+      cluster = dentry->start[1] * 0x100 + dentry->start[0];
+    }
 
   if (mem == MPIO_INTERNAL_MEM) 
     {
-      i_index=dentry->start[0];
+      i_index = cluster & 0xff;
       cluster = mpio_fat_internal_find_startsector(m, cluster);
       if (cluster < 0)
-	return NULL;
+	return 1;
     }
 
-  new = mpio_fatentry_new(m, mem, cluster, FTYPE_MUSIC);
+  mpio_fatentry_init(m, mem, new, cluster, FTYPE_MUSIC);
 
   if (mem == MPIO_INTERNAL_MEM) 
     { 
@@ -1053,7 +1364,7 @@ mpio_dentry_get_startcluster(mpio_t *m, mpio_mem_t mem, BYTE *p)
 
   debugn(2,"i_index=0x%02x\n", new->i_index);
   
-  return new; 
+  return 0; 
 }
 
 int
@@ -1061,17 +1372,20 @@ mpio_dentry_put(mpio_t *m, mpio_mem_t mem,
 		CHAR *filename, int filename_size,
 		time_t date, DWORD fsize, WORD ssector, BYTE attr)
 {
+  mpio_smartmedia_t *sm;
   BYTE *p;
   mpio_dir_entry_t *dentry;
   
   /* read and copied code from mtools-3.9.8/directory.c 
    * to make this one right 
    */
-  struct tm *now;
+  struct tm *now, now_tm;
   time_t date2 = date;
   unsigned char hour, min_hi, min_low, sec;
   unsigned char year, month_hi, month_low, day;
 
+  if (mem == MPIO_INTERNAL_MEM) sm = &m->internal;
+  if (mem == MPIO_EXTERNAL_MEM) sm = &m->external;
 
   p = mpio_directory_open(m, mem);
   if (p) {
@@ -1092,7 +1406,7 @@ mpio_dentry_put(mpio_t *m, mpio_mem_t mem,
   /* read and copied code from mtools-3.9.8/directory.c 
    * to make this one right 
    */
-  now = localtime(&date2);
+  now = localtime_r(&date2, &now_tm);
   dentry->ctime_ms = 0;
   hour = now->tm_hour << 3;
   min_hi = now->tm_min >> 3;
@@ -1113,6 +1427,12 @@ mpio_dentry_put(mpio_t *m, mpio_mem_t mem,
   dentry->size[3] = (fsize / 0x1000000) & 0xff;
   dentry->start[0] = ssector & 0xff;
   dentry->start[1] = ssector / 0x100;
+  sm->cdir->dirty  = 1;
+
+  /* the new dentry is the last one, so just add it to the cache */
+  if (sm->cdir->cache_num >= 0)
+    if (mpio_directory_cache_add(m, mem, sm->cdir, p))
+      mpio_directory_cache_invalidate(sm->cdir);
 
   /* what do we want to return? */
   return 0;
@@ -1121,58 +1441,48 @@ mpio_dentry_put(mpio_t *m, mpio_mem_t mem,
 BYTE *
 mpio_dentry_find_name_8_3(mpio_t *m, BYTE mem, CHAR *filename)
 {
-  BYTE *p;
-  BYTE bdummy;
-  WORD wdummy;
-  CHAR fname[129];
-  CHAR fname_8_3[13];
-  DWORD ddummy;
-  BYTE *found = 0;
+  mpio_directory_t *dir;
+  int i, found = -1;
 
-  p = mpio_directory_open(m, mem);
-  while ((p) && (!found)) {
-    mpio_dentry_get_real (m, mem, p,
-			  fname, 128,
-			  fname_8_3,
-			  &wdummy, &bdummy, &bdummy,
-			  &bdummy, &bdummy, &ddummy, &bdummy);
-    if ((strcmp(fname_8_3, filename) == 0) &&
-	(strcmp(filename,fname_8_3) == 0)) {
-      found = p;
-      p = NULL;
-    }
-    
-    p = mpio_dentry_next(m, mem, p);
+  dir = mpio_directory_cache_get(m, mem);
+  if (!dir)
+    return NULL;
+
+  /* chains are in reverse directory order, return the first match */
+  i = dir->hash_8_3[mpio_directory_cache_hash(filename)];
+  while (i >= 0) {
+    if (strcmp(dir->cache[i].name_8_3, filename) == 0)
+      found = i;
+    i = dir->cache[i].next_8_3;
   }
+
+  if (found < 0)
+    return NULL;
 	 
-  return found;
+  return dir->dir + dir->cache[found].offset;
 }
 
 BYTE *
 mpio_dentry_find_name(mpio_t *m, BYTE mem, CHAR *filename)
 {
-  BYTE *p;
-  BYTE bdummy;
-  WORD wdummy;
-  CHAR fname[129];
-  DWORD ddummy;
-  BYTE *found = 0;
-  
-  p = mpio_directory_open(m, mem);
-  while ((p) && (!found)) {
-    mpio_dentry_get (m, mem, p,
-		     fname, 128,
-		     &wdummy, &bdummy, &bdummy,
-		     &bdummy, &bdummy, &ddummy, &bdummy);
-    if ((strcmp(fname,filename) == 0) && (strcmp(filename,fname) == 0)) {
-      found = p;
-      p = NULL;
-    }
-    
-    p = mpio_dentry_next(m, mem, p);
+  mpio_directory_t *dir;
+  int i, found = -1;
+
+  dir = mpio_directory_cache_get(m, mem);
+  if (!dir)
+    return NULL;
+
+  i = dir->hash_name[mpio_directory_cache_hash(filename)];
+  while (i >= 0) {
+    if (strcmp(dir->cache[i].name, filename) == 0)
+      found = i;
+    i = dir->cache[i].next_name;
   }
+
+  if (found < 0)
+    return NULL;
 	 
-  return found;
+  return dir->dir + dir->cache[found].offset;
 }
 
 
@@ -1217,6 +1527,8 @@ mpio_dentry_delete(mpio_t *m, BYTE mem, CHAR *filename)
 	 (sm->cdir->dir + DIR_SIZE - (start + size)));
 
   memcpy(sm->cdir->dir, tmp, DIR_SIZE);
+  mpio_directory_cache_invalidate(sm->cdir);
+  sm->cdir->dirty = 1;
   
   return 0;
 }
@@ -1310,6 +1622,8 @@ mpio_dentry_move(mpio_t *m,mpio_mem_t mem,BYTE *m_file,BYTE *a_file) {
 	  (long)t0,s0,(long)t1,s1,(long)t2,s2,(long)t3,s3,s0+s1+s2+s3,DIR_SIZE);
 
   memcpy(sm->cdir->dir, tmp, DIR_SIZE);
+  mpio_directory_cache_invalidate(sm->cdir);
+  sm->cdir->dirty = 1;
 }
 
 void    
@@ -1360,6 +1674,8 @@ mpio_dentry_switch(mpio_t *m, mpio_mem_t mem, BYTE *file1, BYTE *file2)
 
   /* really update the directory */
   memcpy(sm->cdir->dir, tmp, DIR_SIZE);
+  mpio_directory_cache_invalidate(sm->cdir);
+  sm->cdir->dirty = 1;
 
   return;
 }
@@ -1407,6 +1723,8 @@ mpio_dentry_rename(mpio_t *m, mpio_mem_t mem, BYTE *p, CHAR *newfilename)
   }
     
   mpio_dentry_filename_write(m, mem, p, newfilename, strlen(newfilename));
+  mpio_directory_cache_invalidate(sm->cdir);
+  sm->cdir->dirty = 1;
 
   return ;  
 }
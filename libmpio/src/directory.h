@@ -40,6 +40,11 @@ int     mpio_directory_read(mpio_t *, mpio_mem_t, mpio_directory_t *);
 int     mpio_directory_write(mpio_t *, mpio_mem_t, mpio_directory_t *);
 BYTE    mpio_directory_is_empty(mpio_t *, mpio_mem_t, mpio_directory_t *);
 
+/* cache of parsed directory entries */
+void    mpio_directory_cache_init(mpio_directory_t *);
+void    mpio_directory_cache_invalidate(mpio_directory_t *);
+void    mpio_directory_cache_free(mpio_directory_t *);
+
 /* operations on a single directory entry */
 int	mpio_dentry_get_size(mpio_t *, mpio_mem_t, BYTE *);
 int	mpio_dentry_get_raw(mpio_t *, mpio_mem_t, BYTE *, BYTE *, int);
@@ -52,6 +57,8 @@ int     mpio_dentry_get_filesize(mpio_t *, mpio_mem_t, BYTE *);
 BYTE    mpio_dentry_get_attrib(mpio_t *, mpio_mem_t, BYTE *);
 long    mpio_dentry_get_time(mpio_t *, mpio_mem_t, BYTE *);
 mpio_fatentry_t    *mpio_dentry_get_startcluster(mpio_t *, mpio_mem_t, BYTE *);
+int     mpio_dentry_startcluster_init(mpio_t *, mpio_mem_t, BYTE *,
+				      mpio_fatentry_t *);
 BYTE    mpio_dentry_is_dir(mpio_t *, mpio_mem_t, BYTE *);
 
 /* switch two directory entries */
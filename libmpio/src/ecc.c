@@ -18,108 +18,250 @@
  *
  */
 
+#include <pthread.h>
+
 #include "ecc.h"
 #include "debug.h"
 
 #define GET_BIT(d, o) (((d) >> (o)) & 0x01 )
-#define XOR_BITS(d, x1, x2, x3, x4) (GET_BIT((d), (x1)) ^ \
-                                     GET_BIT((d), (x2)) ^ \
-                                     GET_BIT((d), (x3)) ^ \
-                                     GET_BIT((d), (x4)))
-#define ADD_BITS(c, d1, d2, v) if ((c)) d1 ^= (v); else d2 ^= (v)
 
-int 
-mpio_ecc_256_gen(CHAR *data, CHAR *ecc)
+/* 
+ * column parities of a byte, already in the layout of ecc[2]
+ * (p4 p4_ p2 p2_ p1 p1_), bit 0 is the parity of the whole byte
+ */
+static const BYTE mpio_ecc_table[256] = {
+  0x00, 0x55, 0x59, 0x0c, 0x65, 0x30, 0x3c, 0x69,
+  0x69, 0x3c, 0x30, 0x65, 0x0c, 0x59, 0x55, 0x00,
+  0x95, 0xc0, 0xcc, 0x99, 0xf0, 0xa5, 0xa9, 0xfc,
+  0xfc, 0xa9, 0xa5, 0xf0, 0x99, 0xcc, 0xc0, 0x95,
+  0x99, 0xcc, 0xc0, 0x95, 0xfc, 0xa9, 0xa5, 0xf0,
+  0xf0, 0xa5, 0xa9, 0xfc, 0x95, 0xc0, 0xcc, 0x99,
+  0x0c, 0x59, 0x55, 0x00, 0x69, 0x3c, 0x30, 0x65,
+  0x65, 0x30, 0x3c, 0x69, 0x00, 0x55, 0x59, 0x0c,
+  0xa5, 0xf0, 0xfc, 0xa9, 0xc0, 0x95, 0x99, 0xcc,
+  0xcc, 0x99, 0x95, 0xc0, 0xa9, 0xfc, 0xf0, 0xa5,
+  0x30, 0x65, 0x69, 0x3c, 0x55, 0x00, 0x0c, 0x59,
+  0x59, 0x0c, 0x00, 0x55, 0x3c, 0x69, 0x65, 0x30,
+  0x3c, 0x69, 0x65, 0x30, 0x59, 0x0c, 0x00, 0x55,
+  0x55, 0x00, 0x0c, 0x59, 0x30, 0x65, 0x69, 0x3c,
+  0xa9, 0xfc, 0xf0, 0xa5, 0xcc, 0x99, 0x95, 0xc0,
+  0xc0, 0x95, 0x99, 0xcc, 0xa5, 0xf0, 0xfc, 0xa9,
+  0xa9, 0xfc, 0xf0, 0xa5, 0xcc, 0x99, 0x95, 0xc0,
+  0xc0, 0x95, 0x99, 0xcc, 0xa5, 0xf0, 0xfc, 0xa9,
+  0x3c, 0x69, 0x65, 0x30, 0x59, 0x0c, 0x00, 0x55,
+  0x55, 0x00, 0x0c, 0x59, 0x30, 0x65, 0x69, 0x3c,
+  0x30, 0x65, 0x69, 0x3c, 0x55, 0x00, 0x0c, 0x59,
+  0x59, 0x0c, 0x00, 0x55, 0x3c, 0x69, 0x65, 0x30,
+  0xa5, 0xf0, 0xfc, 0xa9, 0xc0, 0x95, 0x99, 0xcc,
+  0xcc, 0x99, 0x95, 0xc0, 0xa9, 0xfc, 0xf0, 0xa5,
+  0x0c, 0x59, 0x55, 0x00, 0x69, 0x3c, 0x30, 0x65,
+  0x65, 0x30, 0x3c, 0x69, 0x00, 0x55, 0x59, 0x0c,
+  0x99, 0xcc, 0xc0, 0x95, 0xfc, 0xa9, 0xa5, 0xf0,
+  0xf0, 0xa5, 0xa9, 0xfc, 0x95, 0xc0, 0xcc, 0x99,
+  0x95, 0xc0, 0xcc, 0x99, 0xf0, 0xa5, 0xa9, 0xfc,
+  0xfc, 0xa9, 0xa5, 0xf0, 0x99, 0xcc, 0xc0, 0x95,
+  0x00, 0x55, 0x59, 0x0c, 0x65, 0x30, 0x3c, 0x69,
+  0x69, 0x3c, 0x30, 0x65, 0x0c, 0x59, 0x55, 0x00
+};
+
+/* spreads a nibble to the odd bits of a byte: abcd -> a0b0c0d0 */
+static const BYTE mpio_ecc_spread[16] = {
+  0x00, 0x02, 0x08, 0x0a, 0x20, 0x22, 0x28, 0x2a,
+  0x80, 0x82, 0x88, 0x8a, 0xa0, 0xa2, 0xa8, 0xaa
+};
+
+/* 
+ * The line parity p08 ... p1024 is the parity of all bytes with the
+ * corresponding bit of the byte index set. Every kernel returns these
+ * eight bits in lp and the XOR of all 256 bytes in x.
+ */
+typedef void (*mpio_ecc_kernel_t)(BYTE *, BYTE *, BYTE *);
+
+static void mpio_ecc_256_table(BYTE *, BYTE *, BYTE *);
+static mpio_ecc_kernel_t mpio_ecc_256_kernel = mpio_ecc_256_table;
+static pthread_once_t mpio_ecc_256_once = PTHREAD_ONCE_INIT;
+
+static void
+mpio_ecc_256_table(BYTE *data, BYTE *lp, BYTE *x)
 {
-  CHAR p1, p1_;
-  CHAR p2, p2_;
-  CHAR p4, p4_;
-
-  CHAR p08, p08_;
-  CHAR p16, p16_;
-  CHAR p32, p32_;
-  CHAR p64, p64_;
-
-  CHAR p0128, p0128_;
-  CHAR p0256, p0256_;
-  CHAR p0512, p0512_;
-  CHAR p1024, p1024_;
-
-  int i, j;
-
-  /* init */
-  p1=p1_=0;
-  p2=p2_=0;
-  p4=p4_=0;
-
-  p08=p08_=0;
-  p16=p16_=0;
-  p32=p32_=0;
-  p64=p64_=0;
-
-  p0128=p0128_=0;
-  p0256=p0256_=0;
-  p0512=p0512_=0;
-  p1024=p1024_=0;
-
-  /* vertical */
-  for (i=0; i<256; i++) {    
-    /* p1, p1_ */
-    p1 ^= XOR_BITS(data[i], 7, 5, 3, 1);
-    p1_^= XOR_BITS(data[i], 6, 4, 2, 0);
-
-    /* p2, p2_ */
-    p2 ^= XOR_BITS(data[i], 7, 6, 3, 2);
-    p2_^= XOR_BITS(data[i], 5, 4, 1, 0);
-
-    /* p4, p4_ */
-    p4 ^= XOR_BITS(data[i], 7, 6, 5, 4);
-    p4_^= XOR_BITS(data[i], 3, 2, 1, 0);
-  }
+  BYTE l = 0, c = 0;
+  int j;
 
-  /* horizontal */
-  for (i=0; i<8; i++) {
-    for (j=0; j<256; j++) {  
-      /* p08, p08_ */
-      ADD_BITS(GET_BIT(j, 0), p08, p08_, GET_BIT(data[j], i));      
-      
-      /* p16, p16_ */
-      ADD_BITS(GET_BIT(j, 1), p16, p16_, GET_BIT(data[j], i));      
+  for (j = 0; j < 256; j++)
+    {
+      c ^= data[j];
+      l ^= j & -(mpio_ecc_table[data[j]] & 0x01);
+    }
 
-      /* p32, p32_ */
-      ADD_BITS(GET_BIT(j, 2), p32, p32_, GET_BIT(data[j], i));
+  *lp = l;
+  *x  = c;
+}
 
-      /* p64, p64_ */
-      ADD_BITS(GET_BIT(j, 3), p64, p64_, GET_BIT(data[j], i));
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
 
-      /* p0128, p0128_ */
-      ADD_BITS(GET_BIT(j, 4), p0128, p0128_, GET_BIT(data[j], i));
-      
-      /* p0256, p0256_ */
-      ADD_BITS(GET_BIT(j, 5), p0256, p0256_, GET_BIT(data[j], i));
+#define MPIO_ECC_SIMD
 
-      /* p0512, p0512_ */
-      ADD_BITS(GET_BIT(j, 6), p0512, p0512_, GET_BIT(data[j], i));
+/* parity of the XOR of all bytes of v */
+__attribute__((target("sse2")))
+static inline BYTE
+mpio_ecc_fold(__m128i v)
+{
+  v = _mm_xor_si128(v, _mm_srli_si128(v, 8));
+  v = _mm_xor_si128(v, _mm_srli_si128(v, 4));
+  v = _mm_xor_si128(v, _mm_srli_si128(v, 2));
+  v = _mm_xor_si128(v, _mm_srli_si128(v, 1));
 
-      /* p1024, p1024_ */
-      ADD_BITS(GET_BIT(j, 7), p1024, p1024_, GET_BIT(data[j], i));
+  return mpio_ecc_table[_mm_cvtsi128_si32(v) & 0xff] & 0x01;
+}
+
+/* bits 0-3 of the byte index are the positions inside a vector */
+__attribute__((target("sse2")))
+static inline BYTE
+mpio_ecc_fold_lines(__m128i t)
+{
+  const __m128i m0 = _mm_set_epi8(-1,0,-1,0,-1,0,-1,0,-1,0,-1,0,-1,0,-1,0);
+  const __m128i m1 = _mm_set_epi8(-1,-1,0,0,-1,-1,0,0,-1,-1,0,0,-1,-1,0,0);
+  const __m128i m2 = _mm_set_epi8(-1,-1,-1,-1,0,0,0,0,-1,-1,-1,-1,0,0,0,0);
+  const __m128i m3 = _mm_set_epi8(-1,-1,-1,-1,-1,-1,-1,-1,0,0,0,0,0,0,0,0);
+
+  return ((mpio_ecc_fold(_mm_and_si128(t, m0)) << 0) |
+	  (mpio_ecc_fold(_mm_and_si128(t, m1)) << 1) |
+	  (mpio_ecc_fold(_mm_and_si128(t, m2)) << 2) |
+	  (mpio_ecc_fold(_mm_and_si128(t, m3)) << 3));
+}
+
+__attribute__((target("sse2")))
+static inline BYTE
+mpio_ecc_fold_all(__m128i v)
+{
+  v = _mm_xor_si128(v, _mm_srli_si128(v, 8));
+  v = _mm_xor_si128(v, _mm_srli_si128(v, 4));
+  v = _mm_xor_si128(v, _mm_srli_si128(v, 2));
+  v = _mm_xor_si128(v, _mm_srli_si128(v, 1));
+
+  return _mm_cvtsi128_si32(v) & 0xff;
+}
+
+/* 16 vectors of 16 bytes: bits 4-7 of the index select the vector */
+__attribute__((target("sse2")))
+static void
+mpio_ecc_256_sse2(BYTE *data, BYTE *lp, BYTE *x)
+{
+  __m128i v, t, h[4];
+  int c, k;
+
+  t = h[0] = h[1] = h[2] = h[3] = _mm_setzero_si128();
+
+  for (c = 0; c < 16; c++)
+    {
+      v = _mm_loadu_si128((__m128i *)(data + (c * 16)));
+      t = _mm_xor_si128(t, v);
+      for (k = 0; k < 4; k++)
+	if (c & (1 << k))
+	  h[k] = _mm_xor_si128(h[k], v);
     }
-  }  
 
-  /* calculate actual ECC */
-  ecc[0]=~((p64 << 7) | (p64_ << 6) | 
-	   (p32 << 5) | (p32_ << 4) |
-	   (p16 << 3) | (p16_ << 2) |
-	   (p08 << 1) | (p08_ << 0));  
+  *lp = (mpio_ecc_fold_lines(t) |
+	 (mpio_ecc_fold(h[0]) << 4) | (mpio_ecc_fold(h[1]) << 5) |
+	 (mpio_ecc_fold(h[2]) << 6) | (mpio_ecc_fold(h[3]) << 7));
+  *x  = mpio_ecc_fold_all(t);
+}
+
+/* 8 vectors of 32 bytes: bit 4 is the lane, bits 5-7 select the vector */
+__attribute__((target("avx2")))
+static void
+mpio_ecc_256_avx2(BYTE *data, BYTE *lp, BYTE *x)
+{
+  __m256i v, t, h[3];
+  __m128i lo, hi;
+  int c, k;
+
+  t = h[0] = h[1] = h[2] = _mm256_setzero_si256();
+
+  for (c = 0; c < 8; c++)
+    {
+      v = _mm256_loadu_si256((__m256i *)(data + (c * 32)));
+      t = _mm256_xor_si256(t, v);
+      for (k = 0; k < 3; k++)
+	if (c & (1 << k))
+	  h[k] = _mm256_xor_si256(h[k], v);
+    }
+
+  lo = _mm256_castsi256_si128(t);
+  hi = _mm256_extracti128_si256(t, 1);
 
-  ecc[1]=~((p1024 << 7) | (p1024_ << 6) | 
-	   (p0512 << 5) | (p0512_ << 4) |
-	   (p0256 << 3) | (p0256_ << 2) |
-	   (p0128 << 1) | (p0128_ << 0));  
+  *lp = mpio_ecc_fold_lines(_mm_xor_si128(lo, hi)) | (mpio_ecc_fold(hi) << 4);
+  for (k = 0; k < 3; k++)
+    *lp |= mpio_ecc_fold(_mm_xor_si128(_mm256_castsi256_si128(h[k]),
+				       _mm256_extracti128_si256(h[k], 1)))
+      << (5 + k);
+  *x  = mpio_ecc_fold_all(_mm_xor_si128(lo, hi));
+}
+#endif /* x86 */
+
+/* pick the best kernel for this CPU, run once before the first use */
+static void
+mpio_ecc_256_select(void)
+{
+  mpio_ecc_kernel_t k = mpio_ecc_256_table;
+
+#ifdef MPIO_ECC_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2"))
+    k = mpio_ecc_256_sse2;
+  if (__builtin_cpu_supports("avx2"))
+    k = mpio_ecc_256_avx2;
+#endif
 
-  ecc[2]=~((p4 << 7) | (p4_ << 6) | 
-	   (p2 << 5) | (p2_ << 4) |
-	   (p1 << 3) | (p1_ << 2));  
+  mpio_ecc_256_kernel = k;
+}
+
+int
+mpio_ecc_256_kernel_set(int kernel)
+{
+  /* otherwise the first mpio_ecc_256_gen would override the choice */
+  pthread_once(&mpio_ecc_256_once, mpio_ecc_256_select);
+
+  switch (kernel)
+    {
+    case MPIO_ECC_KERNEL_TABLE:
+      mpio_ecc_256_kernel = mpio_ecc_256_table;
+      return 0;
+#ifdef MPIO_ECC_SIMD
+    case MPIO_ECC_KERNEL_SSE2:
+      __builtin_cpu_init();
+      if (!__builtin_cpu_supports("sse2"))
+	return -1;
+      mpio_ecc_256_kernel = mpio_ecc_256_sse2;
+      return 0;
+    case MPIO_ECC_KERNEL_AVX2:
+      __builtin_cpu_init();
+      if (!__builtin_cpu_supports("avx2"))
+	return -1;
+      mpio_ecc_256_kernel = mpio_ecc_256_avx2;
+      return 0;
+#endif
+    }
+
+  return -1;
+}
+
+int 
+mpio_ecc_256_gen(CHAR *data, CHAR *ecc)
+{
+  BYTE lp, lp_, x;
+
+  pthread_once(&mpio_ecc_256_once, mpio_ecc_256_select);
+  (*mpio_ecc_256_kernel)((BYTE *)data, &lp, &x);
+
+  /* the inverted line parities, over all bytes with the bit cleared */
+  lp_ = lp ^ -(mpio_ecc_table[x] & 0x01);
+
+  /* calculate actual ECC */
+  ecc[0] = ~(mpio_ecc_spread[lp & 0x0f] | (mpio_ecc_spread[lp_ & 0x0f] >> 1));
+  ecc[1] = ~(mpio_ecc_spread[lp >> 4]   | (mpio_ecc_spread[lp_ >> 4] >> 1));
+  ecc[2] = ~(mpio_ecc_table[x] & 0xfc);
 
   return 0;
 }
@@ -181,13 +323,14 @@ mpio_ecc_256_check(CHAR *data, CHAR *ecc)
 	     line, col, data[line]);
       data[line] ^= ( 1 << col);
       debugn(3, "fixed byte is: %02x\n", data[line]);
+      return MPIO_ECC_CORRECTED;
     } else {				       
       debugn(2, "uncorrectable error detected. Sorry, you lose!\n");
-      return 1;
+      return MPIO_ECC_FAILED;
     }
   }
   
-  return 0;  
+  return MPIO_ECC_OK;  
 }
 
 
@@ -32,6 +32,21 @@ int	mpio_ecc_256_gen(CHAR *, CHAR *);
 /* 256 Bytes Data, 3 Bytes ECC to check and possibly correct */
 int	mpio_ecc_256_check(CHAR *, CHAR*);
 
+/* kernels used by mpio_ecc_256_gen, the best one is picked once on
+ * the first call, tools/ecctest forces each of them in turn */
+#define MPIO_ECC_KERNEL_TABLE 0
+#define MPIO_ECC_KERNEL_SSE2  1
+#define MPIO_ECC_KERNEL_AVX2  2
+
+/* returns -1 if the kernel is not available on this CPU, must not
+ * race with mpio_ecc_256_gen in other threads */
+int	mpio_ecc_256_kernel_set(int);
+
+/* results of mpio_ecc_256_check */
+#define MPIO_ECC_OK        0
+#define MPIO_ECC_FAILED    1
+#define MPIO_ECC_CORRECTED 2
+
 #ifdef __cplusplus
 }
 #endif 
@@ -0,0 +1,620 @@
+/*
+ *  libmpio - a library for accessing Digit@lways MPIO players
+ *  Copyright (C) 2002-2004 Markus Germeier
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc.,g 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/*
+ *
+ * NAND emulator
+ *
+ * Speaks the USB protocol of the players on top of a mmap'ed image
+ * file, so the library can be tested and benchmarked without a device.
+ *
+ * MPIO_EMULATOR=<file>[:<file>] images to use, created if missing,
+ *                              every image is a player of its own
+ * MPIO_EMULATOR_MEMORY=<spec>  geometry of new images:
+ *                              <chips>x<internal id>[,<external id>]
+ *                              with hex chip ids, default "1x75,75"
+ *                              (32MB internal, 32MB SmartMedia)
+ * MPIO_EMULATOR_LATENCY=<n>    delay per command in usec
+ * MPIO_EMULATOR_BANDWIDTH=<n>  transfer rate in KB/sec
+ *
+ * Every sector is stored as SECTOR_SIZE bytes of data followed by
+ * its 16 bytes of spare area. Programming only clears bits, just
+ * like real flash, so blocks have to be deleted before rewriting.
+ *
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "emulator.h"
+#include "smartmedia.h"
+#include "io.h"
+#include "debug.h"
+
+#define EMU_MAGIC        "MPIOEMU1"
+#define EMU_HEADER       SECTOR_SIZE
+#define EMU_SPARE        0x10
+#define EMU_SECTOR       (SECTOR_SIZE + EMU_SPARE)
+#define EMU_CHIPS        4      /* max. internal chips */
+#define EMU_EXTERNAL     EMU_CHIPS
+#define EMU_DEFAULT      "1x75,75"
+
+/* layout of the image header */
+#define EMU_H_CHIPS      0x08
+#define EMU_H_INTERNAL   0x09
+#define EMU_H_EXTERNAL   0x0a
+#define EMU_H_VERSION    0x40
+
+typedef struct {
+  BYTE  *base;                     /* first sector in the image */
+  DWORD  sectors;
+  DWORD  block_sectors;
+  BYTE   version;
+} mpio_emulator_chip_t;
+
+typedef struct {
+  int    fd;
+  BYTE  *image;
+  size_t image_size;
+
+  /* internal chips + SmartMedia card */
+  mpio_emulator_chip_t chip[EMU_CHIPS + 1];
+
+  /* answer to the last command, consumed by read */
+  BYTE  *resp;
+  int    resp_size;
+  int    resp_len;
+  int    resp_pos;
+
+  /* command waiting for its data */
+  BYTE   cmd[CMD_SIZE];
+  BYTE  *data;
+  int    data_len;
+  int    data_want;
+
+  long   latency;                  /* usec per command */
+  long   bandwidth;                /* KB/sec, 0 == unlimited */
+} mpio_emulator_t;
+
+static void
+mpio_emulator_delay(mpio_emulator_t *e, long usec, int bytes)
+{
+  struct timespec ts;
+
+  if (e->bandwidth > 0)
+    usec += (long)(((double)bytes * 1000000) / (e->bandwidth * 1024));
+
+  if (usec <= 0)
+    return;
+
+  ts.tv_sec  = usec / 1000000;
+  ts.tv_nsec = (usec % 1000000) * 1000;
+  nanosleep(&ts, NULL);
+}
+
+static mpio_emulator_chip_t *
+mpio_emulator_chip(mpio_emulator_t *e, BYTE memory)
+{
+  mpio_emulator_chip_t *c = NULL;
+
+  switch (memory)
+    {
+    case 0x01:
+      c = &e->chip[0];
+      break;
+    case 0x02:
+      c = &e->chip[1];
+      break;
+    case 0x04:
+      c = &e->chip[2];
+      break;
+    case 0x08:
+      c = &e->chip[3];
+      break;
+    case 0x10:
+    case 0x80:
+      c = &e->chip[EMU_EXTERNAL];
+      break;
+    default:
+      ;
+    }
+
+  if ((c) && (!c->sectors))
+    c = NULL;
+
+  if (!c)
+    debugn(2, "emulator: no memory selected (0x%02x)\n", memory);
+
+  return c;
+}
+
+/* see mpio_io_set_cmdpacket */
+static DWORD
+mpio_emulator_index(BYTE *cmd)
+{
+  DWORD index;
+
+  index = cmd[3] + (cmd[4] * 0x100);
+  if (cmd[5] != 0xff)
+    index += cmd[5] * 0x10000;
+
+  return index;
+}
+
+static BYTE *
+mpio_emulator_sector(mpio_emulator_chip_t *c, DWORD sector)
+{
+  if ((!c) || (sector >= c->sectors))
+    return NULL;
+
+  return c->base + (sector * EMU_SECTOR);
+}
+
+static BYTE *
+mpio_emulator_resp(mpio_emulator_t *e, int size)
+{
+  if (size > e->resp_size)
+    {
+      e->resp = realloc(e->resp, size);
+      e->resp_size = size;
+    }
+  e->resp_len = size;
+  e->resp_pos = 0;
+
+  return e->resp;
+}
+
+/* data and spare of one sector, padded to SECTOR_TRANS */
+static void
+mpio_emulator_sector_get(mpio_emulator_chip_t *c, DWORD sector, BYTE *out)
+{
+  BYTE *s = mpio_emulator_sector(c, sector);
+
+  memset(out, 0xff, SECTOR_TRANS);
+  if (s)
+    memcpy(out, s, EMU_SECTOR);
+}
+
+/* flash programming: bits can only be cleared */
+static void
+mpio_emulator_sector_put(mpio_emulator_chip_t *c, DWORD sector,
+			 BYTE *data, BYTE *spare)
+{
+  BYTE *s = mpio_emulator_sector(c, sector);
+  int i;
+
+  if (!s)
+    {
+      debug("emulator: write beyond end of memory (sector=0x%06x)\n", sector);
+      return;
+    }
+
+  for (i = 0; i < SECTOR_SIZE; i++)
+    s[i] &= data[i];
+  for (i = 0; i < EMU_SPARE; i++)
+    s[SECTOR_SIZE + i] &= spare[i];
+}
+
+static void
+mpio_emulator_data(mpio_emulator_t *e)
+{
+  mpio_emulator_chip_t *c;
+  DWORD index;
+  BYTE *p;
+  int i, j, k;
+
+  c     = mpio_emulator_chip(e, e->cmd[1]);
+  index = mpio_emulator_index(e->cmd);
+
+  if (!c)
+    return;
+
+  switch (e->cmd[0])
+    {
+    case PUT_SECTOR:
+      mpio_emulator_sector_put(c, index, e->data, e->data + SECTOR_SIZE);
+      break;
+    case PUT_BLOCK:
+      for (i = 0; i < BLOCK_SECTORS; i++)
+	{
+	  p = e->data + (i * SECTOR_TRANS);
+	  mpio_emulator_sector_put(c, index + i, p, p + SECTOR_SIZE);
+	}
+      break;
+    case PUT_MEGABLOCK:
+      /* 8 transfers of 8 pages, each page is 4 sectors + 4 spare areas */
+      for (i = 0; i < 8; i++)
+	for (j = 0; j < 8; j++)
+	  {
+	    p = e->data + (i * MEGABLOCK_TRANS_WRITE) + (j * 0x840);
+	    for (k = 0; k < 4; k++)
+	      mpio_emulator_sector_put(c, index + (((i * 8) + j) * 4) + k,
+				       p + (k * SECTOR_SIZE),
+				       p + 0x800 + (k * EMU_SPARE));
+	  }
+      break;
+    default:
+      ;
+    }
+}
+
+static void
+mpio_emulator_command(mpio_emulator_t *e, BYTE *cmd)
+{
+  mpio_emulator_chip_t *c;
+  DWORD index, start, blocks;
+  BYTE *p, *s;
+  DWORD i;
+
+  memcpy(e->cmd, cmd, CMD_SIZE);
+  c     = mpio_emulator_chip(e, cmd[1]);
+  index = mpio_emulator_index(cmd);
+
+  debugn(3, "emulator: cmd=0x%02x mem=0x%02x index=0x%06x\n",
+	 cmd[0], cmd[1], index);
+
+  e->resp_len  = 0;
+  e->resp_pos  = 0;
+  e->data_len  = 0;
+  e->data_want = 0;
+
+  switch (cmd[0])
+    {
+    case GET_VERSION:
+      p = mpio_emulator_resp(e, CMD_SIZE);
+      memcpy(p, e->image + EMU_H_VERSION, CMD_SIZE);
+      break;
+    case GET_SECTOR:
+      p = mpio_emulator_resp(e, SECTOR_TRANS);
+      mpio_emulator_sector_get(c, index, p);
+      break;
+    case GET_BLOCK:
+      if (!c)
+	break;
+      start = index - (index % c->block_sectors);
+      p = mpio_emulator_resp(e, c->block_sectors * SECTOR_TRANS);
+      for (i = 0; i < c->block_sectors; i++)
+	mpio_emulator_sector_get(c, start + i, p + (i * SECTOR_TRANS));
+      break;
+    case GET_SPARE_AREA:
+      /* spare area of the first sector of every block */
+      if (!c)
+	break;
+      blocks = c->sectors / c->block_sectors;
+      p = mpio_emulator_resp(e, blocks * EMU_SPARE);
+      for (i = 0; i < blocks; i++)
+	memcpy(p + (i * EMU_SPARE),
+	       mpio_emulator_sector(c, i * c->block_sectors) + SECTOR_SIZE,
+	       EMU_SPARE);
+      break;
+    case DEL_BLOCK:
+      p = mpio_emulator_resp(e, CMD_SIZE);
+      memset(p, 0, CMD_SIZE);
+      if (!c)
+	{
+	  p[0] = 0xc1;
+	  break;
+	}
+      start = index - (index % c->block_sectors);
+      s = mpio_emulator_sector(c, start);
+      if (s)
+	memset(s, 0xff, c->block_sectors * EMU_SECTOR);
+      p[0] = (c->version ? 0xe0 : 0xc0);
+      if (!s)
+	p[0]++;
+      break;
+    case PUT_SECTOR:
+      e->data_want = SECTOR_TRANS;
+      break;
+    case PUT_BLOCK:
+      e->data_want = BLOCK_TRANS;
+      break;
+    case PUT_MEGABLOCK:
+      e->data_want = 8 * MEGABLOCK_TRANS_WRITE;
+      break;
+    default:
+      debug("emulator: unsupported command 0x%02x\n", cmd[0]);
+    }
+
+  if ((e->data_want) && (!e->data))
+    e->data = malloc(8 * MEGABLOCK_TRANS_WRITE);
+}
+
+static int
+mpio_emulator_geometry(mpio_emulator_t *e)
+{
+  mpio_emulator_chip_t *c;
+  BYTE *h = e->image;
+  BYTE *base;
+  int i;
+
+  memset(e->chip, 0, sizeof(e->chip));
+  base = e->image + EMU_HEADER;
+
+  for (i = 0; i <= EMU_CHIPS; i++)
+    {
+      c = &e->chip[i];
+      if (i < EMU_CHIPS)
+	{
+	  if ((i >= h[EMU_H_CHIPS]) || !(h[EMU_H_INTERNAL]))
+	    continue;
+	  c->version = mpio_id2version(h[EMU_H_INTERNAL]);
+	  c->sectors = mpio_id2mem(h[EMU_H_INTERNAL]) * 2048;
+	} else {
+	  if (!(h[EMU_H_EXTERNAL]))
+	    continue;
+	  c->version = mpio_id2version(h[EMU_H_EXTERNAL]);
+	  c->sectors = mpio_id2mem(h[EMU_H_EXTERNAL]) * 2048;
+	}
+      c->block_sectors = (c->version ? MEGABLOCK_SECTORS : BLOCK_SECTORS);
+      c->base = base;
+      base += c->sectors * EMU_SECTOR;
+    }
+
+  return (base - e->image);
+}
+
+static int
+mpio_emulator_create(mpio_emulator_t *e)
+{
+  CHAR *spec;
+  BYTE *h, *v;
+  unsigned int chips, i_id, e_id;
+  size_t size;
+  int i;
+
+  if (!(spec = getenv(MPIO_EMULATOR_MEMORY_ENV)))
+    spec = EMU_DEFAULT;
+
+  e_id = 0;
+  if ((sscanf(spec, "%ux%x,%x", &chips, &i_id, &e_id) < 2) ||
+      ((chips != 1) && (chips != 2) && (chips != 4)) ||
+      (i_id > 0xff) || (e_id > 0xff))
+    {
+      debug("emulator: invalid memory description: \"%s\"\n", spec);
+      return 0;
+    }
+
+  /* the header alone is enough to compute the size */
+  h = malloc(EMU_HEADER);
+  memset(h, 0, EMU_HEADER);
+  memcpy(h, EMU_MAGIC, 8);
+  h[EMU_H_CHIPS]    = chips;
+  h[EMU_H_INTERNAL] = i_id;
+  h[EMU_H_EXTERNAL] = e_id;
+
+  /* the answer to GET_VERSION, see mpio_init */
+  v = h + EMU_H_VERSION;
+  if (mpio_id2version(i_id))
+    memcpy(v, "FD100", 5);
+  else
+    memcpy(v, "MPIO-G", 6);
+  memcpy(v + 0x0c, "1.00", 4);
+  memcpy(v + 0x10, "2004", 4);
+  memcpy(v + 0x14, "0101", 4);
+  for (i = 0; i < (int)chips; i++)
+    {
+      v[0x18 + (2 * i)] = 0xec;
+      v[0x19 + (2 * i)] = i_id;
+    }
+  if (e_id)
+    {
+      v[0x20] = 0xec;
+      v[0x21] = e_id;
+    }
+
+  e->image = h;
+  size = mpio_emulator_geometry(e);
+  e->image = NULL;
+
+  if (ftruncate(e->fd, size) != 0)
+    {
+      debug("emulator: could not resize image\n");
+      free(h);
+      return 0;
+    }
+
+  e->image = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, e->fd, 0);
+  if (e->image == MAP_FAILED)
+    {
+      debug("emulator: could not map image\n");
+      e->image = NULL;
+      free(h);
+      return 0;
+    }
+  e->image_size = size;
+
+  /* erased flash, with an empty root directory on the internal memory */
+  memcpy(e->image, h, EMU_HEADER);
+  memset(e->image + EMU_HEADER, 0xff, size - EMU_HEADER);
+  free(h);
+  mpio_emulator_geometry(e);
+  for (i = 0; i < (int)e->chip[0].block_sectors; i++)
+    memset(mpio_emulator_sector(&e->chip[0], i), 0, SECTOR_SIZE);
+
+  debugn(2, "emulator: created new image (%s)\n", spec);
+
+  return 1;
+}
+
+static int
+mpio_emulator_enumerate(mpio_device_t *devices, int max)
+{
+  return mpio_device_list("emulator", getenv(MPIO_EMULATOR_ENV), 
+			  devices, max);
+}
+
+static int
+mpio_emulator_open(mpio_t *m)
+{
+  mpio_emulator_t *e;
+  struct stat st;
+  CHAR *file, *env;
+
+  /* without a selection the first image is used */
+  if ((!m->device_set) && 
+      (mpio_emulator_enumerate(&m->device, 1) < 1))
+    return MPIO_ERR_DEVICE_NOT_READY;
+  file = m->device.device;
+
+  e = malloc(sizeof(mpio_emulator_t));
+  if (!e)
+    return MPIO_ERR_OUT_OF_MEMORY;
+  memset(e, 0, sizeof(mpio_emulator_t));
+
+  if ((env = getenv(MPIO_EMULATOR_LATENCY_ENV)))
+    e->latency = strtol(env, NULL, 10);
+  if ((env = getenv(MPIO_EMULATOR_BANDWIDTH_ENV)))
+    e->bandwidth = strtol(env, NULL, 10);
+
+  e->fd = open(file, (O_RDWR | O_CREAT), 0644);
+  if ((e->fd < 0) || (fstat(e->fd, &st) != 0))
+    {
+      debug("emulator: could not open image: %s\n", file);
+      free(e);
+      return MPIO_ERR_DEVICE_NOT_READY;
+    }
+
+  if (st.st_size == 0)
+    {
+      if (!mpio_emulator_create(e))
+	{
+	  close(e->fd);
+	  free(e);
+	  return MPIO_ERR_DEVICE_NOT_READY;
+	}
+    } else {
+      e->image = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		      e->fd, 0);
+      if (e->image == MAP_FAILED)
+	e->image = NULL;
+      e->image_size = st.st_size;
+      if ((!e->image) || (st.st_size < EMU_HEADER) ||
+	  (memcmp(e->image, EMU_MAGIC, 8) != 0) ||
+	  (mpio_emulator_geometry(e) != st.st_size))
+	{
+	  debug("emulator: not a valid image: %s\n", file);
+	  if (e->image)
+	    munmap(e->image, e->image_size);
+	  close(e->fd);
+	  free(e);
+	  return MPIO_ERR_DEVICE_NOT_READY;
+	}
+    }
+
+  debugn(2, "emulator: using image %s (latency=%ldusec bandwidth=%ldKB/sec)\n",
+	 file, e->latency, e->bandwidth);
+
+  m->transport_data = e;
+  m->fd = 1;
+
+  return MPIO_OK;
+}
+
+static int
+mpio_emulator_close(mpio_t *m)
+{
+  mpio_emulator_t *e = m->transport_data;
+
+  msync(e->image, e->image_size, MS_SYNC);
+  munmap(e->image, e->image_size);
+  close(e->fd);
+
+  if (e->resp)
+    free(e->resp);
+  if (e->data)
+    free(e->data);
+  free(e);
+  m->transport_data = NULL;
+
+  return MPIO_OK;
+}
+
+static int
+mpio_emulator_write(mpio_t *m, CHAR *block, int num_bytes)
+{
+  mpio_emulator_t *e = m->transport_data;
+  int n;
+
+  if (e->data_want)
+    {
+      n = num_bytes;
+      if (n > (e->data_want - e->data_len))
+	n = e->data_want - e->data_len;
+      memcpy(e->data + e->data_len, block, n);
+      e->data_len += n;
+      mpio_emulator_delay(e, 0, n);
+
+      if (e->data_len == e->data_want)
+	{
+	  mpio_emulator_data(e);
+	  e->data_want = 0;
+	}
+      return n;
+    }
+
+  if (num_bytes != CMD_SIZE)
+    {
+      debug("emulator: expected command packet (size=0x%x)\n", num_bytes);
+      return -1;
+    }
+
+  mpio_emulator_delay(e, e->latency, num_bytes);
+  mpio_emulator_command(e, (BYTE *)block);
+
+  return num_bytes;
+}
+
+static int
+mpio_emulator_read(mpio_t *m, CHAR *block, int num_bytes)
+{
+  mpio_emulator_t *e = m->transport_data;
+  int n;
+
+  n = e->resp_len - e->resp_pos;
+  if (n <= 0)
+    {
+      debug("emulator: no data available\n");
+      return -1;
+    }
+  if (n > num_bytes)
+    n = num_bytes;
+
+  memcpy(block, e->resp + e->resp_pos, n);
+  e->resp_pos += n;
+  mpio_emulator_delay(e, 0, n);
+
+  return n;
+}
+
+mpio_transport_t mpio_emulator_transport = {
+  "emulator",
+  mpio_emulator_enumerate,
+  mpio_emulator_open,
+  mpio_emulator_close,
+  mpio_emulator_write,
+  mpio_emulator_read
+};
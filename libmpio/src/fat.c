@@ -22,8 +22,10 @@
 #include "io.h"
 #include "debug.h"
 #include "directory.h"
+#include "mount.h"
 
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
 
 /* I'm lazy so I hard code all the values */
@@ -358,6 +360,35 @@ mpio_bootblocks_read (mpio_t *m, mpio_mem_t mem)
   return 0;  
 }
 
+/* set up a FAT entry in storage provided by the caller */
+void
+mpio_fatentry_init(mpio_t *m, mpio_mem_t mem, mpio_fatentry_t *f, 
+		   DWORD sector, BYTE ftype)
+{
+  memset(f, 0, sizeof(mpio_fatentry_t));
+  f->m      = m;
+  f->mem    = mem;
+  f->entry  = sector;      
+
+  /* init FAT entry */
+  memset(f->i_fat, 0xff, 0x10);
+  f->i_fat[0x00] = 0xaa;  /* start of file */
+  f->i_fat[0x06] = ftype;
+  f->i_fat[0x0b] = 0x00;  
+  f->i_fat[0x0c] = 0x00;  
+  f->i_fat[0x0d] = 0x00;  
+  if (m->model >= MPIO_MODEL_FD100) {      
+    /* 0x0e is a copy of the file index number */
+    f->i_fat[0x0f] = 0x00;
+  } else {
+    f->i_fat[0x0e] = 'P';
+    f->i_fat[0x0f] = 'C';
+  }
+
+  if (mem == MPIO_INTERNAL_MEM) 
+    mpio_fatentry_entry2hw(m, f);
+}
+
 mpio_fatentry_t *
 mpio_fatentry_new(mpio_t *m, mpio_mem_t mem, DWORD sector, BYTE ftype)
 {
@@ -366,29 +397,7 @@ mpio_fatentry_new(mpio_t *m, mpio_mem_t mem, DWORD sector, BYTE ftype)
   new = malloc (sizeof(mpio_fatentry_t));
   
   if (new) 
-    {
-      new->m      = m;
-      new->mem    = mem;
-      new->entry  = sector;      
-
-      /* init FAT entry */
-      memset(new->i_fat, 0xff, 0x10);
-      new->i_fat[0x00] = 0xaa;  /* start of file */
-      new->i_fat[0x06] = ftype;
-      new->i_fat[0x0b] = 0x00;  
-      new->i_fat[0x0c] = 0x00;  
-      new->i_fat[0x0d] = 0x00;  
-      if (m->model >= MPIO_MODEL_FD100) {      
-	/* 0x0e is a copy of the file index number */
-	new->i_fat[0x0f] = 0x00;
-      } else {
-	new->i_fat[0x0e] = 'P';
-	new->i_fat[0x0f] = 'C';
-      }
-    }  
-
-  if (mem == MPIO_INTERNAL_MEM) 
-    mpio_fatentry_entry2hw(m, new);
+    mpio_fatentry_init(m, mem, new, sector, ftype);
   
   return new;
 }
@@ -421,36 +430,471 @@ mpio_fatentry_plus_plus(mpio_fatentry_t *f)
 
 
 /* read "fat_size" sectors of fat into the provided buffer */
+static int
+mpio_fat_read (mpio_t *m, mpio_mem_t mem)
+{
+  mpio_smartmedia_t *sm = &m->external;
+
+  if (mpio_io_sector_range_read(m, mem, sm->fat_offset, sm->fat_size, 
+				(CHAR *)sm->fat))
+    return 1;
+
+  if (mpio_fat_unpack(m, mem))
+    return 1;
+  if (mpio_fat_free_build(m, mem))
+    return 1;
+  mpio_fat_dirty_reset(m, mem, 0);
+
+  return (0);
+}
+
+/* the internal FAT lives in the spare area, which is read chip by chip */
+static int
+mpio_fat_chip_load(mpio_t *m, BYTE chip, 
+		   mpio_callback_init_t progress_callback)
+{
+  mpio_smartmedia_t *sm = &m->internal;
+
+  if (sm->fat_loaded & (1 << (chip - 1)))
+    return 0;
+
+  debugn(2, "reading spare area of internal chip %d\n", chip);
+  if (mpio_io_spare_read_chip(m, MPIO_INTERNAL_MEM, chip, 0, sm->size, 0, 
+			      (CHAR *)sm->fat, (sm->fat_size * SECTOR_SIZE),
+			      progress_callback))
+    return 1;
+  sm->fat_loaded |= (1 << (chip - 1));
+
+  /* the free accounting needs all of them */
+  if (sm->fat_loaded == MPIO_FAT_CHIPS(sm))
+    {
+      mpio_fat_free_build(m, MPIO_INTERNAL_MEM);
+      mpio_mount_save(m);
+    }
+
+  return 0;
+}
+
+/* everything on an external card hangs off the boot blocks */
+static int
+mpio_fat_card_read(mpio_t *m, mpio_callback_init_t progress_callback)
+{
+  mpio_smartmedia_t *sm = &m->external;
+
+  if (mpio_zone_load(m, MPIO_EXTERNAL_MEM, progress_callback))
+    return 1;
+
+  /* card might be defect */
+  if (mpio_bootblocks_read(m, MPIO_EXTERNAL_MEM))
+    return 1;
+
+  if (!sm->fat)
+    sm->fat = malloc(SECTOR_SIZE * sm->fat_size);
+  if (!sm->fat)
+    return 1;
+  if (mpio_fat_read(m, MPIO_EXTERNAL_MEM))
+    return 1;
+  if (mpio_rootdir_read(m, MPIO_EXTERNAL_MEM))
+    return 1;
+
+  return 0;
+}
+
+/* a failed load is tried again on the next use */
+static int
+mpio_fat_card_load(mpio_t *m, mpio_callback_init_t progress_callback)
+{
+  mpio_smartmedia_t *sm = &m->external;
+  int r;
+
+  /* mpio_fat_free_build comes back here through mpio_fatentry_read */
+  if ((sm->fat_loaded) || (sm->fat_loading))
+    return 0;
+
+  sm->fat_loading = 1;
+  r = mpio_fat_card_read(m, progress_callback);
+  sm->fat_loading = 0;
+
+  if (r)
+    {
+      debug("could not read the FAT of the external memory\n");
+      /* nothing must be allocated from or looked up in a partial FAT */
+      sm->fat_table_size = 0;
+      sm->fat_free_count = 0;
+      return r;
+    }
+
+  sm->fat_loaded = 1;
+  mpio_mount_save(m);
+
+  return 0;
+}
+
+/* 
+ * nothing is read from the spare areas by mpio_init, the FAT (and for
+ * external memory the boot blocks and root directory) is loaded here
+ * on first use
+ */
 int
-mpio_fat_read (mpio_t *m, mpio_mem_t mem, 
-	       mpio_callback_init_t progress_callback)
+mpio_fat_load(mpio_t *m, mpio_mem_t mem, 
+	      mpio_callback_init_t progress_callback)
 {
   mpio_smartmedia_t *sm;
-  CHAR recvbuff[SECTOR_SIZE];
-  DWORD i;
+  BYTE chip;
 
-  if (mem == MPIO_INTERNAL_MEM) 
-    {    
-      sm = &m->internal;
-      if (mpio_io_spare_read(m, mem, 0, sm->size, 0, (CHAR *)sm->fat,
-			     (sm->fat_size * SECTOR_SIZE), progress_callback))
-	return 1;
-      return 0;
+  if (mem == MPIO_EXTERNAL_MEM) 
+    {
+      if (!m->external.size)
+	return 0;
+      return mpio_fat_card_load(m, progress_callback);
     }
-  
+
+  sm = &m->internal;
+  if ((!sm->size) || (sm->fat_loaded == MPIO_FAT_CHIPS(sm)))
+    return 0;
+
+  for (chip = 1; chip <= sm->chips; chip++)
+    if (mpio_fat_chip_load(m, chip, progress_callback))
+      return 1;
+
+  if (progress_callback)
+    (*progress_callback)(mem, (sm->fat_size * SECTOR_SIZE),
+			 (sm->fat_size * SECTOR_SIZE));
+
+  return 0;
+}
+
+/* only the chip holding entry e has to be read */
+int
+mpio_fat_load_entry(mpio_t *m, mpio_mem_t mem, DWORD e)
+{
+  mpio_smartmedia_t *sm = &m->internal;
+  BYTE chip;
+
+  if (mem == MPIO_EXTERNAL_MEM)
+    return mpio_fat_load(m, mem, NULL);
+
+  if ((!sm->size) || (sm->fat_loaded == MPIO_FAT_CHIPS(sm)))
+    return 0;
+
+  chip = (e / (sm->max_cluster / sm->chips)) + 1;
+  if (chip > sm->chips)
+    chip = sm->chips;
+
+  return mpio_fat_chip_load(m, chip, NULL);
+}
+
+/* number of entries in the FAT, see mpio_fatentry_plus_plus */
+static DWORD
+mpio_fat_entries(mpio_t *m, mpio_mem_t mem)
+{
+  if (mem == MPIO_INTERNAL_MEM)
+    return m->internal.max_cluster;
+
+  return m->external.max_cluster + 1;
+}
+
+/* update the free accounting after a FAT entry was changed */
+static void
+mpio_fat_free_track(mpio_t *m, mpio_mem_t mem, mpio_fatentry_t *f)
+{
+  mpio_smartmedia_t *sm;
+  DWORD bit;
+  int isfree;
+
+  if (mem == MPIO_INTERNAL_MEM) sm = &m->internal;
   if (mem == MPIO_EXTERNAL_MEM) sm = &m->external;
 
-  if (!sm)
+  if ((!sm->fat_free_map) || (f->entry >= mpio_fat_entries(m, mem)))
+    return;
+
+  bit    = 1U << (f->entry % 32);
+  isfree = mpio_fatentry_free(m, mem, f);
+
+  if ((isfree) && !(sm->fat_free_map[f->entry / 32] & bit))
+    {
+      sm->fat_free_map[f->entry / 32] |= bit;
+      sm->fat_free_count++;
+    }
+  if ((!isfree) && (sm->fat_free_map[f->entry / 32] & bit))
+    {
+      sm->fat_free_map[f->entry / 32] &= ~bit;
+      sm->fat_free_count--;
+    }
+}
+
+/* last start entry of file index i, leaving out entry skip */
+static int
+mpio_fat_index_scan(mpio_smartmedia_t *sm, BYTE i, DWORD skip)
+{
+  DWORD e;
+  int found = -1;
+
+  for (e = 1; e < sm->max_cluster; e++)
+    if ((e != skip) && 
+	(sm->fat[e * 0x10] == 0xaa) && (sm->fat[e * 0x10 + 1] == i))
+      found = e;
+
+  return found;
+}
+
+/* add (delta 1) or remove (delta -1) entry e of the internal FAT 
+ * from the file index tables, see mpio_fat_internal_find_startsector */
+static void
+mpio_fat_index_track(mpio_smartmedia_t *sm, DWORD e, int delta)
+{
+  BYTE *p;
+
+  if ((!sm->fat_index_valid) || (e < 1) || (e >= sm->max_cluster))
+    return;
+
+  p = sm->fat + (e * 0x10);
+
+  if (p[1] != 0xff)
+    sm->fat_index_used[p[1]] += delta;
+
+  if (p[0] != 0xaa)
+    return;
+
+  sm->fat_index_starts[p[1]] += delta;
+  if (delta > 0) 
+    {
+      if (sm->fat_index_start[p[1]] < (int)e)
+	sm->fat_index_start[p[1]] = e;
+    } else {
+      if (!sm->fat_index_starts[p[1]])
+	sm->fat_index_start[p[1]] = -1;
+      else if (sm->fat_index_start[p[1]] == (int)e)
+	sm->fat_index_start[p[1]] = mpio_fat_index_scan(sm, p[1], e);
+    }
+}
+
+static void
+mpio_fat_index_build(mpio_t *m)
+{
+  mpio_smartmedia_t *sm = &m->internal;
+  DWORD e;
+  int i;
+
+  for (i = 0; i < 256; i++)
+    {
+      sm->fat_index_start[i]  = -1;
+      sm->fat_index_used[i]   = 0;
+      sm->fat_index_starts[i] = 0;
+    }
+  sm->fat_index_valid = 1;
+
+  for (e = 1; e < sm->max_cluster; e++)
+    mpio_fat_index_track(sm, e, 1);
+}
+
+/* (re)build the free accounting from the FAT in memory, for internal
+ * memory also the file index tables */
+int
+mpio_fat_free_build(mpio_t *m, mpio_mem_t mem)
+{
+  mpio_smartmedia_t *sm;
+  mpio_fatentry_t f;
+  DWORD words;
+
+  if (mem == MPIO_INTERNAL_MEM) sm = &m->internal;
+  if (mem == MPIO_EXTERNAL_MEM) sm = &m->external;
+
+  if (!sm->fat)
     return 1;
-  
-  for (i = 0; i < sm->fat_size; i++) {
-    if (mpio_io_sector_read(m, mem, (sm->fat_offset + i), recvbuff))
-      return 1;
 
-    memcpy(sm->fat + (i * SECTOR_SIZE), recvbuff, SECTOR_SIZE);
+  words = (mpio_fat_entries(m, mem) + 31) / 32;
+  sm->fat_free_map = realloc(sm->fat_free_map, words * sizeof(DWORD));
+  if (!sm->fat_free_map)
+    return 1;
+  memset(sm->fat_free_map, 0, words * sizeof(DWORD));
+  sm->fat_free_count = 0;
+  sm->fat_cursor     = 1;
+
+  if (mem == MPIO_INTERNAL_MEM)
+    mpio_fat_index_build(m);
+
+  mpio_fatentry_init(m, mem, &f, 0, FTYPE_MUSIC);
+  do 
+    {
+      mpio_fat_free_track(m, mem, &f);
+    } while (mpio_fatentry_plus_plus(&f));
+
+  return 0;
+}
+
+int
+mpio_fat_dirty_reset(mpio_t *m, mpio_mem_t mem, BYTE dirty)
+{
+  mpio_smartmedia_t *sm;
+
+  if (mem == MPIO_INTERNAL_MEM) sm = &m->internal;
+  if (mem == MPIO_EXTERNAL_MEM) sm = &m->external;
+
+  sm->fat_dirty = realloc(sm->fat_dirty, sm->fat_size);
+  if (!sm->fat_dirty)
+    return 1;
+  memset(sm->fat_dirty, dirty, sm->fat_size);
+
+  return 0;
+}
+
+/* remember that the FAT sector holding byte e has to be written */
+static void
+mpio_fat_dirty_mark(mpio_smartmedia_t *sm, int e)
+{
+  if (sm->fat_dirty)
+    sm->fat_dirty[e / SECTOR_SIZE] = 1;
+}
+
+/* does the block starting at logical sector first hold changed sectors? */
+static BYTE
+mpio_fat_block_dirty(mpio_smartmedia_t *sm, int first)
+{
+  int i;
+
+  for (i = first; i < (first + BLOCK_SECTORS); i++)
+    {
+      if ((i <= sm->pbr_offset) && (sm->boot_dirty))
+	return 1;
+
+      if ((i >= sm->fat_offset) && 
+	  (i < (sm->fat_offset + (int)(2 * sm->fat_size))) &&
+	  ((!sm->fat_dirty) || 
+	   (sm->fat_dirty[(i - sm->fat_offset) % sm->fat_size])))
+	return 1;
+
+      if ((i >= sm->dir_offset) && (i < (sm->dir_offset + DIR_NUM)) &&
+	  (sm->root->dirty))
+	return 1;
+    }
+
+  return 0;
+}
+
+/* decode entry e of the packed external FAT */
+static WORD
+mpio_fat_entry_get(mpio_smartmedia_t *sm, DWORD entry)
+{
+  int e;
+  WORD v;
+
+  if (sm->size >= 128) {
+    /* 2 Byte per entry */
+    e = entry * 2;
+    v = sm->fat[e + 1] * 0x100 + sm->fat[e];
+  } else {
+    /* 1.5 Byte per entry */
+    /* Nibble order: x321 */
+    e = (entry * 3 / 2);
+    if ((entry & 0x01) == 0) {
+      /* LLxH */
+      /* 21x3 */
+      v = (sm->fat[e + 1] & 0x0f) * 0x100 + sm->fat[e];
+    } else {
+      /* 1x32 */
+      v = (sm->fat[e + 1] * 0x10) + (sm->fat[e] >> 4);
+    }    
   }
 
-  return (0);
+  return v;
+}
+
+/* encode entry e into the packed external FAT */
+static void
+mpio_fat_entry_put(mpio_smartmedia_t *sm, DWORD entry, WORD value)
+{
+  int e;
+  BYTE backup;
+
+  if (sm->size >= 128) 
+    {
+      /* 2 Byte per entry */
+      e = entry * 2;
+      sm->fat[e]     = value & 0xff;
+      sm->fat[e + 1] = (value >> 8 ) & 0xff;      
+    } else {
+      /* 1.5 Byte per entry */
+      e = (entry * 3 / 2);
+      if ((entry & 0x01) == 0) {
+	/* 21x3 */
+	sm->fat[e]     = value & 0xff;
+	backup         = sm->fat[e + 1] & 0xf0;
+	sm->fat[e + 1] = backup | (( value / 0x100  ) & 0x0f);
+      } else {
+	/* 1x32 */
+	sm->fat[e + 1] = (value / 0x10) & 0xff;
+	backup         = sm->fat[e] & 0x0f;
+	sm->fat[e]     = backup | ( (value * 0x10) & 0xf0 );
+      }      
+    }  
+}
+
+/* expand the packed external FAT into fat_table */
+int
+mpio_fat_unpack(mpio_t *m, mpio_mem_t mem)
+{
+  mpio_smartmedia_t *sm;
+  DWORD i, n;
+
+  if (mem != MPIO_EXTERNAL_MEM)
+    return 1;
+  sm = &m->external;
+
+  if (!sm->fat)
+    return 1;
+
+  if (sm->size >= 128)
+    n = (sm->fat_size * SECTOR_SIZE) / 2;
+  else
+    n = (sm->fat_size * SECTOR_SIZE * 2) / 3;
+
+  sm->fat_table = realloc(sm->fat_table, n * sizeof(WORD));
+  if (!sm->fat_table)
+    {
+      sm->fat_table_size = 0;
+      return 1;
+    }
+  sm->fat_table_size = n;
+
+  for (i = 0; i < n; i++)
+    sm->fat_table[i] = mpio_fat_entry_get(sm, i);
+
+  return 0;
+}
+
+/* write the entries of all changed sectors back into the packed FAT */
+static void
+mpio_fat_pack(mpio_smartmedia_t *sm)
+{
+  DWORD i, first, last;
+  DWORD s;
+
+  if ((!sm->fat) || (!sm->fat_table))
+    return;
+
+  for (s = 0; s < sm->fat_size; s++)
+    {
+      if ((sm->fat_dirty) && (!sm->fat_dirty[s]))
+	continue;
+
+      if (sm->size >= 128)
+	{
+	  first = (s * SECTOR_SIZE) / 2;
+	  last  = ((s + 1) * SECTOR_SIZE) / 2;
+	} else {
+	  /* include the 12 bit entries crossing the sector boundaries */
+	  first = (s * SECTOR_SIZE * 2) / 3;
+	  if (first)
+	    first--;
+	  last  = (((s + 1) * SECTOR_SIZE * 2) / 3) + 1;
+	}
+      if (last > sm->fat_table_size)
+	last = sm->fat_table_size;
+
+      for (i = first; i < last; i++)
+	mpio_fat_entry_put(sm, i, sm->fat_table[i]);
+    }
 }
 
 int
@@ -462,6 +906,7 @@ mpio_fatentry_free(mpio_t *m, mpio_mem_t mem, mpio_fatentry_t *f )
   if (mem == MPIO_INTERNAL_MEM) {    
     sm = &m->internal;
     e  = f->entry * 0x10;
+    mpio_fat_load_entry(m, mem, f->entry);
 
     /* be more strict to avoid writing
      * to defective blocks!
@@ -495,6 +940,7 @@ mpio_fatentry_read(mpio_t *m, mpio_mem_t mem, mpio_fatentry_t *f )
   if (mem == MPIO_INTERNAL_MEM) {    
     sm = &m->internal;
     e  = f->entry * 0x10;    
+    mpio_fat_load_entry(m, mem, f->entry);
     if (mpio_fatentry_is_defect(m, mem, f))
 	return 0xffffffff;
 
@@ -531,34 +977,21 @@ mpio_fatentry_read(mpio_t *m, mpio_mem_t mem, mpio_fatentry_t *f )
   }
   
   if (mem == MPIO_EXTERNAL_MEM) sm = &m->external;
+  mpio_fat_load(m, mem, NULL);
 
-  if (!sm->fat) 
+  if (!sm->fat_table) 
     {
       debug ("error, no space for FAT allocated!\n");
       return 0;
     }
     
+  if (f->entry >= sm->fat_table_size) 
+    {
+      debug ("FAT entry out of range: %d\n", f->entry);
+      return 0;
+    }
 
-  if (sm->size >= 128) {
-    /* 2 Byte per entry */
-    e = f->entry * 2;
-    v = sm->fat[e + 1] * 0x100 + sm->fat[e];
-  } else {
-    /* 1.5 Byte per entry */
-    /* Nibble order: x321 */
-    e = (f->entry * 3 / 2);
-/*     printf("mager: byte (%d/%d)\n", e, e+1); */
-    if ((f->entry & 0x01) == 0) {
-      /* LLxH */
-      /* 21x3 */
-      v = (sm->fat[e + 1] & 0x0f) * 0x100 + sm->fat[e];
-    } else {
-      /* 1x32 */
-      v = (sm->fat[e + 1] * 0x10) + (sm->fat[e] >> 4);
-    }    
-  }
-
-  return v;  
+  return sm->fat_table[f->entry];  
 }
 
 int 
@@ -566,7 +999,6 @@ mpio_fatentry_write(mpio_t *m, mpio_mem_t mem, mpio_fatentry_t *f, WORD value)
 {
   mpio_smartmedia_t *sm;  
   int e;
-  BYTE backup;
 
   if (mem == MPIO_INTERNAL_MEM) 
     {
@@ -575,27 +1007,28 @@ mpio_fatentry_write(mpio_t *m, mpio_mem_t mem, mpio_fatentry_t *f, WORD value)
     }
       
   if (mem == MPIO_EXTERNAL_MEM) sm = &m->external;
+  mpio_fat_load(m, mem, NULL);
 
+  if ((!sm->fat_table) || (f->entry >= sm->fat_table_size))
+    {
+      debug ("FAT entry out of range: %d\n", f->entry);
+      return 1;
+    }
+
+  sm->fat_table[f->entry] = value;
+
+  /* the packed FAT is brought up to date by mpio_fat_write */
   if (sm->size >= 128) 
     {
       /* 2 Byte per entry */
       e = f->entry * 2;
-      sm->fat[e]     = value & 0xff;
-      sm->fat[e + 1] = (value >> 8 ) & 0xff;      
+      mpio_fat_dirty_mark(sm, e);
     } else {
       /* 1.5 Byte per entry */
       e = (f->entry * 3 / 2);
-      if ((f->entry & 0x01) == 0) {
-	/* 21x3 */
-	sm->fat[e]     = value & 0xff;
-	backup         = sm->fat[e + 1] & 0xf0;
-	sm->fat[e + 1] = backup | (( value / 0x100  ) & 0x0f);
-      } else {
-	/* 1x32 */
-	sm->fat[e + 1] = (value / 0x10) & 0xff;
-	backup         = sm->fat[e] & 0x0f;
-	sm->fat[e]     = backup | ( (value * 0x10) & 0xf0 );
-      }      
+      /* 12 bit entries may cross a sector boundary */
+      mpio_fat_dirty_mark(sm, e);
+      mpio_fat_dirty_mark(sm, e + 1);
     }  
 
   return 0;
@@ -604,44 +1037,27 @@ mpio_fatentry_write(mpio_t *m, mpio_mem_t mem, mpio_fatentry_t *f, WORD value)
 int 
 mpio_fat_internal_find_startsector(mpio_t *m, BYTE start)
 {
-  mpio_fatentry_t *f;
   mpio_smartmedia_t *sm = &m->internal;
-  int found=-1;
 
-  f = mpio_fatentry_new(m, MPIO_INTERNAL_MEM, 0, FTYPE_MUSIC);
-
-  while(mpio_fatentry_plus_plus(f))
-    {
-      if ((sm->fat[f->entry * 0x10]     == 0xaa) &&
-	  (sm->fat[f->entry * 0x10 + 1] == start)) 
-	found=f->entry;
-    }
+  mpio_fat_load(m, MPIO_INTERNAL_MEM, NULL);
 
-  free(f);
+  if (!sm->fat_index_valid)
+    return -1;
 
-  return found;
+  /* the last entry marked 0xaa with this file index */
+  return sm->fat_index_start[start];
 }
 
 BYTE
 mpio_fat_internal_find_fileindex(mpio_t *m)
 {
-  mpio_fatentry_t *f;
   mpio_smartmedia_t *sm = &m->internal;
-  BYTE index[256];
   WORD found; /* hmm, ... */
 
-  memset(index, 1, 256);
+  mpio_fat_load(m, MPIO_INTERNAL_MEM, NULL);
 
-  f = mpio_fatentry_new(m, MPIO_INTERNAL_MEM, 0, FTYPE_MUSIC);
-  while(mpio_fatentry_plus_plus(f))
-    {
-      if (sm->fat[f->entry * 0x10 + 1] != 0xff)
-	  index[sm->fat[f->entry * 0x10 + 1]] = 0;      
-    }
-  free(f);
-  
   found=6;  
-  while((found<256) && (!index[found]))
+  while((found<256) && (sm->fat_index_used[found]))
     found++;
 
   if (found>=256) 
@@ -659,68 +1075,162 @@ int
 mpio_fat_free_clusters(mpio_t *m, mpio_mem_t mem)
 {
   mpio_smartmedia_t *sm;  
-  mpio_fatentry_t *f;
-  int e = 0;
 
   if (mem == MPIO_INTERNAL_MEM) sm = &m->internal;
   if (mem == MPIO_EXTERNAL_MEM) sm = &m->external;
+  mpio_fat_load(m, mem, NULL);
 
-  if (sm->fat) 
-    {    
-      f = mpio_fatentry_new(m, mem, 0, FTYPE_MUSIC);
-      do 
-	{
-	  if (mpio_fatentry_free(m, mem, f)) 
-	    e++;      
-	} while (mpio_fatentry_plus_plus(f));
-      free(f);
-    } else {
-      f = 0;
-    }  
-  
+  if ((!sm->fat) || (!sm->fat_free_map))
+    return 0;
     
-  return (e * 16);
+  return (sm->fat_free_count * 16);
 }
 
-mpio_fatentry_t *
-mpio_fatentry_find_free(mpio_t *m, mpio_mem_t mem, BYTE ftype)
+/* first entry in [from, to) whose free bit equals want, or to */
+static DWORD
+mpio_fat_free_scan(mpio_smartmedia_t *sm, DWORD from, DWORD to, int want)
 {
-  mpio_fatentry_t *f;
+  DWORD i, word;
 
-  f = mpio_fatentry_new(m, mem, 0, ftype);
-
-  while(mpio_fatentry_plus_plus(f))
+  i = from;
+  while (i < to)
     {
-      if (mpio_fatentry_free(m, mem, f))
-	return f;
+      word = sm->fat_free_map[i / 32];
+      if (!want)
+	word = ~word;
+      word &= ~0U << (i % 32);
+      if (word)
+	{
+	  i = (i & ~31U) + (ffs(word) - 1);
+	  return (i < to ? i : to);
+	}
+      i = (i & ~31U) + 32;
     }
 
-  free(f);
+  return to;
+}
+
+/* find the first run of count free entries in [from, to), 
+ * returns the start of the run or to */
+static DWORD
+mpio_fat_free_run(mpio_smartmedia_t *sm, DWORD from, DWORD to, DWORD count)
+{
+  DWORD start, end;
 
-  return NULL;
+  start = mpio_fat_free_scan(sm, from, to, 1);
+  while (start < to)
+    {
+      end = mpio_fat_free_scan(sm, start, to, 0);
+      if ((end - start) >= count)
+	return start;
+      start = mpio_fat_free_scan(sm, end, to, 1);
+    }
+
+  return to;
 }
 
-int              
-mpio_fatentry_next_free(mpio_t *m, mpio_mem_t mem, mpio_fatentry_t *f)
+/* next-fit search for count contiguous free entries, starting at
+ * from and wrapping around to entry 1. entry 0 and skip are never
+ * returned. if no run of the requested length exists, the first 
+ * single free entry is used.
+ * returns 0 if the FAT is full
+ */
+static DWORD
+mpio_fat_alloc(mpio_t *m, mpio_mem_t mem, DWORD from, DWORD count, 
+	       DWORD skip)
 {
-  mpio_fatentry_t backup;
+  mpio_smartmedia_t *sm;
+  DWORD n, e;
 
-  memcpy(&backup, f, sizeof(mpio_fatentry_t));
+  if (mem == MPIO_INTERNAL_MEM) sm = &m->internal;
+  if (mem == MPIO_EXTERNAL_MEM) sm = &m->external;
+  mpio_fat_load(m, mem, NULL);
 
-  while(mpio_fatentry_plus_plus(f))
+  if ((!sm->fat_free_map) || (!sm->fat_free_count))
+    return 0;
+
+  n = mpio_fat_entries(m, mem);
+  if ((from < 1) || (from >= n))
+    from = 1;
+
+  if (count > 1)
     {
-      if (mpio_fatentry_free(m, mem, f)) 
+      e = mpio_fat_free_run(sm, from, n, count);
+      if (e == n)
 	{
-	  if (mem == MPIO_INTERNAL_MEM)
-	    f->i_fat[0x00] = 0xee;	  
-	  return 1;
+	  /* the second search ends at from, that is what it returns
+	   * if it finds nothing */
+	  e = mpio_fat_free_run(sm, 1, from, count);
+	  if (e >= from)
+	    e = n;
 	}
+      if (e != n)
+	{
+	  sm->fat_cursor = e + 1;
+	  return e;
+	}
+      debugn(2, "no contiguous run of %d entries, fragmenting\n", count);
     }
 
-  /* no free entry found, restore entry */
-  memcpy(f, &backup, sizeof(mpio_fatentry_t));
+  e = mpio_fat_free_scan(sm, from, n, 1);
+  if (e == skip)
+    e = mpio_fat_free_scan(sm, e + 1, n, 1);
+  if (e == n) 
+    {
+      e = mpio_fat_free_scan(sm, 1, from, 1);
+      if (e == skip)
+	e = mpio_fat_free_scan(sm, e + 1, from, 1);
+      if (e >= from)
+	return 0;
+    }
 
-  return 0;
+  sm->fat_cursor = e + 1;
+
+  return e;
+}
+
+mpio_fatentry_t *
+mpio_fatentry_find_free(mpio_t *m, mpio_mem_t mem, BYTE ftype)
+{
+  return mpio_fatentry_find_free_run(m, mem, ftype, 1);
+}
+
+mpio_fatentry_t *
+mpio_fatentry_find_free_run(mpio_t *m, mpio_mem_t mem, BYTE ftype,
+			    DWORD count)
+{
+  mpio_smartmedia_t *sm;
+  DWORD e;
+
+  if (mem == MPIO_INTERNAL_MEM) sm = &m->internal;
+  if (mem == MPIO_EXTERNAL_MEM) sm = &m->external;
+
+  e = mpio_fat_alloc(m, mem, sm->fat_cursor, count, 0);
+  if (!e)
+    return NULL;
+  
+  return mpio_fatentry_new(m, mem, e, ftype);
+}
+
+int
+mpio_fatentry_next_free(mpio_t *m, mpio_mem_t mem, mpio_fatentry_t *f)
+{
+  DWORD e;
+
+  /* prefer the entry directly following the current one, this
+   * keeps runs found by mpio_fatentry_find_free_run contiguous */
+  e = mpio_fat_alloc(m, mem, f->entry + 1, 1, f->entry);
+  if (!e)
+    return 0;
+
+  f->entry = e;
+  if (mem == MPIO_INTERNAL_MEM)
+    {
+      mpio_fatentry_entry2hw(m, f);
+      f->i_fat[0x00] = 0xee;
+    }
+
+  return 1;
 }
 
 int              
@@ -765,21 +1275,97 @@ mpio_fatentry_next_entry(mpio_t *m, mpio_mem_t mem, mpio_fatentry_t *f)
   return 1;
 }
 
+/* follows the chain starting at f and stores every cluster in c,
+ * a chain running into a defective block is cut there and flagged */
+int
+mpio_fat_chain_get(mpio_t *m, mpio_mem_t mem, mpio_fatentry_t *f, 
+		   mpio_chain_t *c)
+{
+  mpio_smartmedia_t *sm;
+  mpio_chainlink_t *link;
+  mpio_fatentry_t e;
+  int ret;
+
+  if (mem == MPIO_INTERNAL_MEM) sm = &m->internal;
+  if (mem == MPIO_EXTERNAL_MEM) sm = &m->external;
+
+  memset(c, 0, sizeof(mpio_chain_t));
+  memcpy(&e, f, sizeof(mpio_fatentry_t));
+
+  do 
+    {
+      /* a chain can't be longer than the FAT, anything else is a loop */
+      if (c->count >= sm->max_cluster) 
+	{
+	  debug("FAT chain does not end (%4x)\n", f->entry);
+	  mpio_fat_chain_free(c);
+	  return MPIO_ERR_FAT_ERROR;
+	}
+      
+      if (c->count == c->size) 
+	{
+	  c->size = (c->size ? c->size * 2 : 64);
+	  link = realloc(c->link, c->size * sizeof(mpio_chainlink_t));
+	  if (!link) 
+	    {
+	      mpio_fat_chain_free(c);
+	      return MPIO_ERR_OUT_OF_MEMORY;
+	    }
+	  c->link = link;
+	}
+
+      c->link[c->count].entry      = e.entry;
+      c->link[c->count].hw_address = e.hw_address;
+      c->count++;
+      
+    } while ((ret = mpio_fatentry_next_entry(m, mem, &e)) > 0);
+
+  if (ret < 0) 
+    {
+      debugn(2, "defective block in chain (%4x)\n", f->entry);
+      c->defect = 1;
+    }
+
+  return MPIO_OK;
+}
+
+/* point f at the i-th cluster of the chain */
+void
+mpio_fat_chain_entry(mpio_chain_t *c, DWORD i, mpio_fatentry_t *f)
+{
+  f->entry      = c->link[i].entry;
+  f->hw_address = c->link[i].hw_address;
+}
+
+void
+mpio_fat_chain_free(mpio_chain_t *c)
+{
+  free(c->link);
+  memset(c, 0, sizeof(mpio_chain_t));
+}
+
 
 int
 mpio_fat_clear(mpio_t *m, mpio_mem_t mem)
 {
   mpio_smartmedia_t *sm;
-  mpio_fatentry_t   *f;
+  mpio_fatentry_t   f;
   
   if (mem == MPIO_INTERNAL_MEM) {
     sm = &m->internal;
+
+    /* everything but entry 0 is overwritten, so the other chips
+     * don't have to be read */
+    mpio_fat_load_entry(m, mem, 0);
+    sm->fat_loaded = MPIO_FAT_CHIPS(sm);
     
-    f = mpio_fatentry_new(m, mem, 1, FTYPE_MUSIC);
+    mpio_fatentry_init(m, mem, &f, 1, FTYPE_MUSIC);
     do {      
-      mpio_fatentry_set_free(m, mem, f) ;
-    } while(mpio_fatentry_plus_plus(f));
-    free(f);
+      mpio_fatentry_set_free(m, mem, &f) ;
+    } while(mpio_fatentry_plus_plus(&f));
+
+    if (!sm->fat_free_map)
+      mpio_fat_free_build(m, mem);
   }
   
   if (mem == MPIO_EXTERNAL_MEM) {
@@ -791,6 +1377,10 @@ mpio_fat_clear(mpio_t *m, mpio_mem_t mem)
     /* for FAT 16 */
     if (sm->size >= 128)      
       sm->fat[3] = 0xff;
+    /* the size of the FAT might have changed (formatting) */
+    mpio_fat_unpack(m, mem);
+    mpio_fat_free_build(m, mem);
+    mpio_fat_dirty_reset(m, mem, 1);
   }
   
   return 0;
@@ -800,6 +1390,7 @@ mpio_fat_clear(mpio_t *m, mpio_mem_t mem)
  * This function acutally writes both,
  * the FAT _and_ the root directory
  *
+ * only blocks holding changed sectors are erased and written again
  */
 
 int 
@@ -807,14 +1398,16 @@ mpio_fat_write(mpio_t *m, mpio_mem_t mem)
 {
   mpio_smartmedia_t *sm;
   mpio_fatentry_t   *f;
+  mpio_directory_t  *d;
   BYTE dummy[MEGABLOCK_SIZE];
-  WORD i;
+  BYTE *p;
+  WORD i, j;
   DWORD block;
   
   if (mem == MPIO_INTERNAL_MEM) {    
     sm = &m->internal;
 
-    if (sm->cdir == sm->root) 
+    if (sm->root->dirty) 
       {	
 	f=mpio_fatentry_new(m, mem, 0, FTYPE_MUSIC);
 	mpio_io_block_delete(m, mem, f);
@@ -848,60 +1441,72 @@ mpio_fat_write(mpio_t *m, mpio_mem_t mem)
 		}	
 	    }    
 	}
-	
-      } else {
-	mpio_directory_write(m, mem, sm->cdir);
+	sm->root->dirty = 0;	
       }
-    
   }
   
   if (mem == MPIO_EXTERNAL_MEM) 
     {      
       sm=&m->external;
 
-      memset(dummy, 0xff, BLOCK_SIZE);
-      
-      for (i = 0; i < (sm->dir_offset + DIR_NUM) ; i++) {
+      /* nothing can have changed */
+      if (!sm->fat_loaded)
+	return 0;
+
+      mpio_fat_pack(sm);
+
+      for (i = 0; i < (sm->dir_offset + DIR_NUM) ; i += BLOCK_SECTORS) {
+	/* leave unchanged blocks alone */
+	if (!mpio_fat_block_dirty(sm, i)) 
+	  continue;
+
 	/* before writing to a new block delete it! */
-	if (((i / 0x20) * 0x20) == i) {
-	  block = mpio_zone_block_find_seq(m, mem, (i/0x20));
-	  if (block == MPIO_BLOCK_NOT_FOUND) 
-	    {
-	      block = mpio_zone_block_find_free_seq(m, mem, (i/0x20));
-	    }
-	  if (block == MPIO_BLOCK_NOT_FOUND) 
-	    {
-	      debug("This should never happen!");
-	      exit(-1);
-	    }
+	block = mpio_zone_block_find_seq(m, mem, (i/0x20));
+	if (block == MPIO_BLOCK_NOT_FOUND) 
+	  {
+	    block = mpio_zone_block_find_free_seq(m, mem, (i/0x20));
+	  }
+	if (block == MPIO_BLOCK_NOT_FOUND) 
+	  {
+	    debug("This should never happen!");
+	    exit(-1);
+	  }
+	
+	mpio_io_block_delete_phys(m, mem, block);
+
+	/* assemble the block, everything not covered stays erased */
+	memset(dummy, 0xff, BLOCK_SIZE);
+	for (j = i; j < (i + BLOCK_SECTORS); j++) {
+	  p = dummy + (j - i) * SECTOR_SIZE;
+
+	  /* remeber: logical sector 0 is the MBR! */
+	  if (j == 0)
+	    memcpy(p, sm->mbr, SECTOR_SIZE);
+	  
+	  if (j == sm->pbr_offset)
+	    memcpy(p, sm->pbr, SECTOR_SIZE);
+	  
+	  if ((j >= sm->fat_offset) && (j < (sm->fat_offset + (2*sm->fat_size)))) 
+	    memcpy(p, sm->fat + SECTOR_SIZE * ((j - sm->fat_offset) % sm->fat_size),
+		   SECTOR_SIZE);
 	  
-	  mpio_io_block_delete_phys(m, mem, block);
+	  if ((j >= sm->dir_offset) && (j < (sm->dir_offset + DIR_NUM)))
+	    memcpy(p, sm->root->dir + (j - sm->dir_offset) * SECTOR_SIZE,
+		   SECTOR_SIZE);
 	}
 
-	/* remeber: logical sector 0 is the MBR! */
-	if (i == 0)
-	  mpio_io_sector_write(m, mem, 0, (CHAR *)sm->mbr);
-	if ((i > 0) && (i < sm->pbr_offset))
-	  mpio_io_sector_write(m, mem, i, (CHAR *)dummy);
-	
-	if (i == sm->pbr_offset)
-	  mpio_io_sector_write(m, mem, sm->pbr_offset, (CHAR *)sm->pbr);
-	
-	if ((i >= sm->fat_offset) && (i < (sm->fat_offset + (2*sm->fat_size)))) 
-	  mpio_io_sector_write(m, mem, i, 
-			       (CHAR *)(sm->fat + SECTOR_SIZE *
-				((i - sm->fat_offset) % sm->fat_size)));
-	
-	if (i>=sm->dir_offset)
-	  mpio_io_sector_write(m, mem, i, 
-			       (CHAR *)(sm->root->dir + 
-				(i - sm->dir_offset) * SECTOR_SIZE));
+	mpio_io_block_write_seq(m, mem, (i/0x20), dummy);
       }
       
-      if (sm->cdir != sm->root) 
-	mpio_directory_write(m, mem, sm->cdir);
-      
+      sm->boot_dirty  = 0;
+      sm->root->dirty = 0;
+      mpio_fat_dirty_reset(m, mem, 0);
     }
+
+  /* subdirectories down to the current one */
+  for (d = sm->root->next; d; d = d->next)
+    if (d->dirty)
+      mpio_directory_write(m, mem, d);
   
     
   return 0;
@@ -917,7 +1522,10 @@ mpio_fatentry_set_free  (mpio_t *m, mpio_mem_t mem, mpio_fatentry_t *f)
     {    
       sm = &m->internal;
       e  = f->entry * 0x10;
+      mpio_fat_load_entry(m, mem, f->entry);
+      mpio_fat_index_track(sm, f->entry, -1);
       memset((sm->fat+e), 0xff, 0x10);
+      mpio_fat_index_track(sm, f->entry, 1);
     }
 
   if (mem == MPIO_EXTERNAL_MEM) 
@@ -926,6 +1534,8 @@ mpio_fatentry_set_free  (mpio_t *m, mpio_mem_t mem, mpio_fatentry_t *f)
       mpio_fatentry_write(m, mem, f, 0);    
     }
 
+  mpio_fat_free_track(m, mem, f);
+
   return 0;
 }
 
@@ -939,7 +1549,10 @@ mpio_fatentry_set_defect(mpio_t *m, mpio_mem_t mem, mpio_fatentry_t *f)
     {    
       sm = &m->internal;
       e  = f->entry * 0x10;
+      mpio_fat_load_entry(m, mem, f->entry);
+      mpio_fat_index_track(sm, f->entry, -1);
       memset((sm->fat+e), 0xaa, 0x10);
+      mpio_fat_index_track(sm, f->entry, 1);
     }
 
   if (mem == MPIO_EXTERNAL_MEM) 
@@ -948,6 +1561,8 @@ mpio_fatentry_set_defect(mpio_t *m, mpio_mem_t mem, mpio_fatentry_t *f)
       mpio_fatentry_write(m, mem, f, 0xfff7);    
     }
 
+  mpio_fat_free_track(m, mem, f);
+
   return 0;
 }
 
@@ -961,6 +1576,7 @@ mpio_fatentry_is_defect(mpio_t *m, mpio_mem_t mem, mpio_fatentry_t *f)
     {    
       sm = &m->internal;
       e  = f->entry * 0x10;
+      mpio_fat_load_entry(m, mem, f->entry);
       if (mpio_fatentry_free(m, mem, f))
 	return 0;
       /* check if this block became defective */
@@ -1021,8 +1637,11 @@ mpio_fatentry_set_eof(mpio_t *m, mpio_mem_t mem, mpio_fatentry_t *f)
     {    
       sm = &m->internal;
       e  = f->entry * 0x10;
+      mpio_fat_load_entry(m, mem, f->entry);
       memset((f->i_fat+0x07), 0xff, 4);		    
+      mpio_fat_index_track(sm, f->entry, -1);
       memcpy((sm->fat+e), f->i_fat, 0x10);
+      mpio_fat_index_track(sm, f->entry, 1);
     }
 
   if (mem == MPIO_EXTERNAL_MEM) 
@@ -1031,6 +1650,8 @@ mpio_fatentry_set_eof(mpio_t *m, mpio_mem_t mem, mpio_fatentry_t *f)
       mpio_fatentry_write(m, mem, f, 0xffff);    
     }
 
+  mpio_fat_free_track(m, mem, f);
+
   return 0;
 }
 
@@ -1045,13 +1666,16 @@ mpio_fatentry_set_next(mpio_t *m, mpio_mem_t mem,
     {    
       sm = &m->internal;
       e  = f->entry * 0x10;
+      mpio_fat_load_entry(m, mem, f->entry);
 
       f->i_fat[0x07]= value->hw_address / 0x1000000;  
       f->i_fat[0x08]=(value->hw_address / 0x10000  ) & 0xff;  
       f->i_fat[0x09]=(value->hw_address / 0x100    ) & 0xff;  
       f->i_fat[0x0a]= value->hw_address              & 0xff;
 
+      mpio_fat_index_track(sm, f->entry, -1);
       memcpy((sm->fat+e), f->i_fat, 0x10);
+      mpio_fat_index_track(sm, f->entry, 1);
     }
   
   if (mem == MPIO_EXTERNAL_MEM) 
@@ -1060,6 +1684,8 @@ mpio_fatentry_set_next(mpio_t *m, mpio_mem_t mem,
       mpio_fatentry_write(m, mem, f, value->entry);    
     }
 
+  mpio_fat_free_track(m, mem, f);
+
   return 0;
 }
 
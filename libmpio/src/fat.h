@@ -36,18 +36,36 @@ int	mpio_bootblocks_read(mpio_t *, mpio_mem_t);
 int     mpio_mbr_eval(mpio_smartmedia_t *);
 int     mpio_pbr_eval(mpio_smartmedia_t *);
 
+/* all internal chips have been read */
+#define MPIO_FAT_CHIPS(sm) ((1 << (sm)->chips) - 1)
+
 /* functions on the FAT for internal *and* external */
-int	mpio_fat_read(mpio_t *, mpio_mem_t, mpio_callback_init_t);
+/* read whatever has not been read yet */
+int	mpio_fat_load(mpio_t *, mpio_mem_t, mpio_callback_init_t);
+/* the same, but only what is needed to access one entry */
+int	mpio_fat_load_entry(mpio_t *, mpio_mem_t, DWORD);
 int	mpio_fat_write(mpio_t *, mpio_mem_t);
 int	mpio_fat_clear(mpio_t *, mpio_mem_t);
 int	mpio_fat_free_clusters(mpio_t *, mpio_mem_t);
+/* build the free cluster accounting after reading or clearing the FAT */
+int	mpio_fat_free_build(mpio_t *, mpio_mem_t);
+/* set or clear the changed flags of all FAT sectors */
+int	mpio_fat_dirty_reset(mpio_t *, mpio_mem_t, BYTE);
+/* external FAT entries are used from an unpacked copy */
+int	mpio_fat_unpack(mpio_t *, mpio_mem_t);
 int	mpio_fat_free(mpio_t *, mpio_mem_t);
 
 /* functions to iterate through the FAT linked list(s) */
 mpio_fatentry_t *mpio_fatentry_new(mpio_t *, mpio_mem_t, DWORD, BYTE);
+/* the same without allocating, the entry is set up in place */
+void             mpio_fatentry_init(mpio_t *, mpio_mem_t, mpio_fatentry_t *,
+				    DWORD, BYTE);
 int              mpio_fatentry_plus_plus(mpio_fatentry_t *);
 
 mpio_fatentry_t *mpio_fatentry_find_free(mpio_t *, mpio_mem_t, BYTE);
+/* find a free entry starting a run of DWORD contiguous free entries */
+mpio_fatentry_t *mpio_fatentry_find_free_run(mpio_t *, mpio_mem_t, BYTE,
+					     DWORD);
 int              mpio_fatentry_next_free(mpio_t *, mpio_mem_t, 
 					 mpio_fatentry_t *);
 int              mpio_fatentry_next_entry(mpio_t *, mpio_mem_t, 
@@ -67,6 +85,12 @@ int              mpio_fatentry_set_next(mpio_t *, mpio_mem_t,
 int              mpio_fatentry_is_defect(mpio_t *, mpio_mem_t, 
 					  mpio_fatentry_t *);
 int              mpio_fatentry_free(mpio_t *, mpio_mem_t, mpio_fatentry_t *);
+
+/* resolve a whole FAT chain at once */
+int	mpio_fat_chain_get(mpio_t *, mpio_mem_t, mpio_fatentry_t *, 
+			   mpio_chain_t *);
+void	mpio_fat_chain_entry(mpio_chain_t *, DWORD, mpio_fatentry_t *);
+void	mpio_fat_chain_free(mpio_chain_t *);
   
 /* finding a file is fundamental different for internal mem */
 int	mpio_fat_internal_find_startsector(mpio_t *, BYTE);
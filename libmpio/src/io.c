@@ -34,12 +34,22 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <pthread.h>
 
 #include "io.h"
 #include "debug.h"
 #include "ecc.h"
+#include "emulator.h"
+#include "cache.h"
+#include "fat.h"
+#include "mount.h"
+#include "stats.h"
+#include "trace.h"
+#include "usb1.h"
 
 BYTE model2externalmem(mpio_model_t);
 DWORD blockaddress_encode(DWORD);
@@ -194,6 +204,63 @@ fatentry2hw(mpio_fatentry_t *f, BYTE *chip, DWORD *address)
  * zone management
  */
 
+/* slot of a logical block in the reverse lookup table */
+static int
+mpio_zone_slot(DWORD lblock)
+{
+  if (lblock == MPIO_BLOCK_CIS)
+    return MPIO_ZONE_CIS_SLOT;
+  if (lblock >= MPIO_ZONE_PBLOCKS)
+    return -1;
+
+  return lblock;
+}
+
+/* update a zonetable entry and keep the lookup tables in sync */
+static void
+mpio_zone_entry_set(mpio_smartmedia_t *sm, int zone, int block, DWORD value)
+{
+  DWORD old;
+  int slot, i;
+
+  old = sm->zonetable[zone][block];
+  sm->zonetable[zone][block] = value;
+
+  if (old == MPIO_BLOCK_FREE)
+    sm->zonefree[zone][block / 32] &= ~(1U << (block % 32));
+  if (value == MPIO_BLOCK_FREE)
+    sm->zonefree[zone][block / 32] |= (1U << (block % 32));
+
+  slot = mpio_zone_slot(old);
+  if ((slot >= 0) && (sm->zonelookup[zone][slot] == block))
+    {
+      sm->zonelookup[zone][slot] = MPIO_ZONE_NONE;
+      /* there might be another copy of this logical block */
+      if (sm->zonedups[zone])
+	for (i = 0; i < MPIO_ZONE_PBLOCKS; i++)
+	  if (sm->zonetable[zone][i] == old)
+	    {
+	      sm->zonelookup[zone][slot] = i;
+	      break;
+	    }
+    }
+
+  slot = mpio_zone_slot(value);
+  if (slot >= 0)
+    {
+      if (sm->zonelookup[zone][slot] == MPIO_ZONE_NONE)
+	{
+	  sm->zonelookup[zone][slot] = block;
+	} else {
+	  debug("found more than one block, using first one"
+		" (zone=%d lblock=0x%04x)\n", zone, value);
+	  sm->zonedups[zone] = 1;
+	  if (block < sm->zonelookup[zone][slot])
+	    sm->zonelookup[zone][slot] = block;
+	}
+    }
+}
+
 int   
 mpio_zone_init(mpio_t *m, mpio_cmd_t mem)
 {
@@ -208,6 +275,11 @@ mpio_zone_init(mpio_t *m, mpio_cmd_t mem)
     }
   sm = &m->external;
 
+  memset(sm->zonetable, 0, sizeof(mpio_zonetable_t));
+  memset(sm->zonelookup, 0xff, sizeof(mpio_zonelookup_t));
+  memset(sm->zonefree, 0, sizeof(mpio_zonefree_t));
+  memset(sm->zonedups, 0, sizeof(sm->zonedups));
+
   for(i=0; i<sm->max_blocks; i++)
     {
       zone = i / MPIO_ZONE_PBLOCKS;
@@ -215,7 +287,9 @@ mpio_zone_init(mpio_t *m, mpio_cmd_t mem)
 
       e = i * 0x10;
 
-      sm->zonetable[zone][block]=blockaddress_decode(sm->spare+e);
+      /* mark as defect first, so the lookup tables start out empty */
+      sm->zonetable[zone][block] = MPIO_BLOCK_DEFECT;
+      mpio_zone_entry_set(sm, zone, block, blockaddress_decode(sm->spare+e));
       
       hexdumpn(4, (CHAR *)sm->spare+e, 0x10);
       debugn(2, "decoded: %04x\n", sm->zonetable[zone][block]);
@@ -223,6 +297,33 @@ mpio_zone_init(mpio_t *m, mpio_cmd_t mem)
   return MPIO_OK;
 }
 
+/* the spare area of the card is only read when a block is looked up */
+int
+mpio_zone_load(mpio_t *m, mpio_mem_t mem, 
+	       mpio_callback_init_t progress_callback)
+{
+  mpio_smartmedia_t *sm;
+
+  if (mem != MPIO_EXTERNAL_MEM) 
+    {
+      debug("called function with wrong memory selection!\n");
+      return -1;
+    }
+  sm = &m->external;
+
+  if ((sm->zone_loaded) || (!sm->size))
+    return 0;
+
+  debugn(2, "reading spare area of external memory\n");
+  if (mpio_io_spare_read(m, mem, 0, sm->size, 0, (CHAR *)sm->spare,
+			 (sm->max_blocks * 0x10), progress_callback))
+    return 1;
+  mpio_zone_init(m, mem);
+  sm->zone_loaded = 1;
+
+  return 0;
+}
+
 DWORD 
 mpio_zone_block_find_log(mpio_t *m, mpio_cmd_t mem, DWORD lblock)
 {
@@ -248,7 +349,7 @@ DWORD
 mpio_zone_block_find_seq(mpio_t *m, mpio_cmd_t mem, DWORD lblock)
 {
   mpio_smartmedia_t *sm;
-  int i, f, v;
+  int v;
   DWORD zone, block;
   
   if (mem != MPIO_EXTERNAL_MEM) 
@@ -257,6 +358,7 @@ mpio_zone_block_find_seq(mpio_t *m, mpio_cmd_t mem, DWORD lblock)
       return -1;
     }
   sm = &m->external;
+  mpio_zone_load(m, mem, NULL);
 
   if ((lblock>=MPIO_BLOCK_CIS) && (lblock<(MPIO_BLOCK_CIS + BLOCK_SECTORS)))
     {
@@ -266,22 +368,12 @@ mpio_zone_block_find_seq(mpio_t *m, mpio_cmd_t mem, DWORD lblock)
       zone  = lblock / MPIO_ZONE_LBLOCKS;
       block = lblock % MPIO_ZONE_LBLOCKS;
     }
-  
-  f=0;
-  for (i=(MPIO_ZONE_PBLOCKS-1); i >=0; i--)
-    {
-
-      if (sm->zonetable[zone][i]==block)
-	{
-	  f++;
-	  v=i;
-	}
-    }
 
-  if (f>1)
-    debug("found more than one block, using first one\n");
+  v = MPIO_ZONE_NONE;
+  if (zone < MPIO_ZONE_MAX)
+    v = sm->zonelookup[zone][mpio_zone_slot(block)];
   
-  if (!f) 
+  if (v == MPIO_ZONE_NONE) 
     {      
       debugn(2, "block not found\n");
       return MPIO_BLOCK_NOT_FOUND;
@@ -322,12 +414,13 @@ mpio_zone_block_set_free_phys(mpio_t *m, mpio_cmd_t mem, DWORD value)
       return;
     }
   sm = &m->external;
+  mpio_zone_load(m, mem, NULL);
 
   zone  = value / BLOCK_SECTORS;
   block = zone  % MPIO_ZONE_PBLOCKS;
   zone  = zone  / MPIO_ZONE_PBLOCKS;
 
-  sm->zonetable[zone][block] = MPIO_BLOCK_FREE;
+  mpio_zone_entry_set(sm, zone, block, MPIO_BLOCK_FREE);
 
   return;
 }
@@ -344,12 +437,13 @@ mpio_zone_block_set_defect_phys(mpio_t *m, mpio_cmd_t mem, DWORD value)
       return;
     }
   sm = &m->external;
+  mpio_zone_load(m, mem, NULL);
 
   zone  = value / BLOCK_SECTORS;
   block = zone  % MPIO_ZONE_PBLOCKS;
   zone  = zone  / MPIO_ZONE_PBLOCKS;
 
-  sm->zonetable[zone][block] = MPIO_BLOCK_DEFECT;
+  mpio_zone_entry_set(sm, zone, block, MPIO_BLOCK_DEFECT);
 
   return;
 }
@@ -360,12 +454,13 @@ mpio_zone_block_set(mpio_t *m, mpio_cmd_t mem, DWORD pblock)
   int zone, block, pb;
 
   UNUSED(mem);
+  mpio_zone_load(m, MPIO_EXTERNAL_MEM, NULL);
   
   pb    = pblock / BLOCK_SECTORS;
   zone  = pb / MPIO_ZONE_PBLOCKS;
   block = pb % MPIO_ZONE_PBLOCKS;
 
-  m->external.zonetable[zone][block] = MPIO_BLOCK_FREE ;
+  mpio_zone_entry_set(&m->external, zone, block, MPIO_BLOCK_FREE);
 
 }
 
@@ -394,7 +489,7 @@ DWORD
 mpio_zone_block_find_free_seq(mpio_t *m, mpio_cmd_t mem, DWORD lblock)
 {
   DWORD value;
-  int zone, block, i;
+  int zone, block, i, w;
   mpio_smartmedia_t *sm;
 
   if (mem != MPIO_EXTERNAL_MEM) 
@@ -421,9 +516,15 @@ mpio_zone_block_find_free_seq(mpio_t *m, mpio_cmd_t mem, DWORD lblock)
       block = lblock % MPIO_ZONE_LBLOCKS;
     }
   
-  i=0;
-  while ((sm->zonetable[zone][i]!=MPIO_BLOCK_FREE) && (i<MPIO_ZONE_PBLOCKS))
-    i++;
+  /* first free physical block of the zone */
+  i = MPIO_ZONE_PBLOCKS;
+  if (zone < MPIO_ZONE_MAX)
+    for (w = 0; w < (MPIO_ZONE_PBLOCKS / 32); w++)
+      if (sm->zonefree[zone][w])
+	{
+	  i = (w * 32) + ffs(sm->zonefree[zone][w]) - 1;
+	  break;
+	}
 
   if (i==MPIO_ZONE_PBLOCKS)
     {
@@ -433,7 +534,7 @@ mpio_zone_block_find_free_seq(mpio_t *m, mpio_cmd_t mem, DWORD lblock)
 
   debugn(2, "set new sector in zonetable, [%d][%d] = 0x%04x\n", zone, i, block);
   
-  sm->zonetable[zone][i] = block;
+  mpio_zone_entry_set(sm, zone, i, block);
 
   return ((zone * BLOCK_SECTORS * MPIO_ZONE_PBLOCKS ) + i * BLOCK_SECTORS);
 }
@@ -445,6 +546,7 @@ mpio_zone_block_get_logical(mpio_t *m, mpio_cmd_t mem, DWORD pblock)
   int zone, block, pb;
 
   UNUSED(mem);
+  mpio_zone_load(m, MPIO_EXTERNAL_MEM, NULL);
   
   pb    = pblock / BLOCK_SECTORS;
   zone  = pb / MPIO_ZONE_PBLOCKS;
@@ -498,23 +600,67 @@ mpio_block_get_blocksize(mpio_t *m, mpio_mem_t mem) {
   return size;
 }
 
-/* 
- * open/closes the device 
+/*
+ * libusb transport
  */
-int 
-mpio_device_open(mpio_t *m){
+#ifdef MPIO_LIBUSB1
+#define mpio_usb_transport mpio_usb1_transport
+#else
+
+
+/* libusb-0.1 keeps the list of busses and devices in globals, 
+ * so scanning and opening is serialized between the contexts */
+static pthread_mutex_t mpio_usb_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+mpio_usb_scan(void)
+{
+  usb_init();
+  usb_find_busses();
+  usb_find_devices();
+}
+
+static void
+mpio_usb_device(mpio_device_t *d, struct usb_bus *bus, struct usb_device *dev)
+{
+  snprintf(d->bus, MPIO_DEVICE_ID, "%.*s", MPIO_DEVICE_ID - 1, bus->dirname);
+  snprintf(d->device, MPIO_DEVICE_ID, "%.*s", MPIO_DEVICE_ID - 1, 
+	   dev->filename);
+  d->product = dev->descriptor.idProduct;
+}
+
+static int
+mpio_usb_enumerate(mpio_device_t *devices, int max)
+{
+  struct usb_bus *bus;
+  struct usb_device *dev;
+  int n = 0;
+
+  pthread_mutex_lock(&mpio_usb_lock);
+  mpio_usb_scan();
+  
+  for (bus = usb_get_busses(); bus; bus = bus->next)
+    for (dev = bus->devices; dev; dev = dev->next)
+      if (dev->descriptor.idVendor == 0x2735) {
+	if (n < max)
+	  mpio_usb_device(&devices[n], bus, dev);
+	n++;
+      }
+
+  pthread_mutex_unlock(&mpio_usb_lock);
+
+  return n;
+}
+
+static int
+mpio_usb_open_locked(mpio_t *m){
   struct usb_device *dev;
   struct usb_interface_descriptor *interface;
   struct usb_endpoint_descriptor *ep;
   int ret, i;
 
-  if (m->fd)
-    return MPIO_OK;
-
   debugn(2, "trying libusb\n");
-  usb_init();
-  usb_find_busses();
-  usb_find_devices();
+  mpio_usb_scan();
   
   m->usb_busses = usb_get_busses();
   
@@ -523,6 +669,10 @@ mpio_device_open(mpio_t *m){
        m->usb_bus = m->usb_bus->next) {
 
     for (dev = m->usb_bus->devices; dev; dev = dev->next) {
+      if ((m->device_set) &&
+	  ((strcmp(m->usb_bus->dirname, m->device.bus)) ||
+	   (strcmp(dev->filename, m->device.device))))
+	continue;
       if (dev->descriptor.idVendor == 0x2735) {
 	if ((dev->descriptor.idProduct != 0x01)  &&
 	    (dev->descriptor.idProduct != 0x71))
@@ -569,6 +719,8 @@ mpio_device_open(mpio_t *m){
 	    return MPIO_ERR_PERMISSION_DENIED;	    
 	  }	  
 	  
+	  mpio_usb_device(&m->device, m->usb_bus, dev);
+
 	  debugn(2, "using libusb\n");
 	  return MPIO_OK;
 	}      
@@ -581,11 +733,149 @@ mpio_device_open(mpio_t *m){
   return MPIO_ERR_PERMISSION_DENIED;
 }
 
+static int
+mpio_usb_open(mpio_t *m)
+{
+  int r;
+
+  pthread_mutex_lock(&mpio_usb_lock);
+  r = mpio_usb_open_locked(m);
+  pthread_mutex_unlock(&mpio_usb_lock);
+
+  return r;
+}
+
+static int
+mpio_usb_close(mpio_t *m) {
+  debugn(2, "closing libusb\n");
+  usb_close(m->usb_handle);
+  
+  return MPIO_OK;
+}
+
+static int
+mpio_usb_write(mpio_t *m, CHAR *block, int num_bytes)
+{
+    int r;  
+    r = usb_bulk_write(m->usb_handle, m->usb_out_ep, block, num_bytes, MPIO_USB_TIMEOUT);
+    if (r < 0)
+      debug("libusb returned error: (%08x) \"%s\"\n", r, usb_strerror());
+    return r;
+}
+
+static int
+mpio_usb_read(mpio_t *m, CHAR *block, int num_bytes)
+{
+    int r;
+    r = usb_bulk_read(m->usb_handle, m->usb_in_ep, block, num_bytes, MPIO_USB_TIMEOUT);
+    if (r < 0)
+      debug("libusb returned error: (%08x) \"%s\"\n", r, usb_strerror());
+    return r;
+}
+
+static mpio_transport_t mpio_usb_transport = {
+  "libusb",
+  mpio_usb_enumerate,
+  mpio_usb_open,
+  mpio_usb_close,
+  mpio_usb_write,
+  mpio_usb_read
+};
+#endif /* MPIO_LIBUSB1 */
+
+/* 
+ * open/closes the device 
+ */
+static mpio_transport_t *
+mpio_device_transport(void)
+{
+  /* a recorded trace or the NAND emulator replace the player */
+  if (getenv(MPIO_REPLAY_ENV))
+    return &mpio_replay_transport;
+  if (getenv(MPIO_EMULATOR_ENV))
+    return &mpio_emulator_transport;
+
+  return &mpio_usb_transport;
+}
+
+int
+mpio_device_enumerate(mpio_device_t *devices, int max)
+{
+  return (*mpio_device_transport()->enumerate)(devices, max);
+}
+
+int
+mpio_device_list(CHAR *bus, CHAR *list, mpio_device_t *devices, int max)
+{
+  CHAR *end;
+  int n = 0, len;
+
+  while ((list) && (*list)) {
+    end = strchr(list, ':');
+    len = (end ? (end - list) : strlen(list));
+    if (len) {
+      if (n < max) {
+	snprintf(devices[n].bus, MPIO_DEVICE_ID, "%s", bus);
+	snprintf(devices[n].device, MPIO_DEVICE_ID, "%.*s", len, list);
+	devices[n].product = 0;
+      }
+      n++;
+    }
+    list = (end ? end + 1 : NULL);
+  }
+
+  return n;
+}
+
+void
+mpio_device_name(mpio_t *m, CHAR *name, int len)
+{
+  CHAR *p;
+
+  *name = 0;
+  if (!m->device_set)
+    return;
+
+  snprintf(name, len, ".%s.%s", m->device.bus, m->device.device);
+  for (p = name + 1; *p; p++)
+    if (!isalnum((int)*p))
+      *p = '_';
+}
+
+int 
+mpio_device_open(mpio_t *m){
+  CHAR name[MPIO_DEVICE_ID * 2 + 2];
+  CHAR *file;
+  int r;
+
+  if (m->fd)
+    return MPIO_OK;
+
+  m->transport = mpio_device_transport();
+
+  debugn(2, "using transport: %s\n", m->transport->name);
+  
+  r = (*m->transport->open)(m);
+
+  /* every player gets its own trace */
+  if ((r == MPIO_OK) && (getenv(MPIO_TRACE_ENV))) {
+    mpio_device_name(m, name, sizeof(name));
+    file = malloc(strlen(getenv(MPIO_TRACE_ENV)) + strlen(name) + 1);
+    if (file) {
+      sprintf(file, "%s%s", getenv(MPIO_TRACE_ENV), name);
+      mpio_trace_start(m, file);
+      free(file);
+    }
+  }
+
+  return r;
+}
+
 int 
 mpio_device_close(mpio_t *m) {
     if (m->fd) {      
-      debugn(2, "closing libusb\n");
-      usb_close(m->usb_handle);
+      mpio_trace_stop(m);
+      (*m->transport->close)(m);
       m->fd=0;
     }    
   
@@ -616,6 +906,11 @@ mpio_io_set_cmdpacket(mpio_t *m, mpio_cmd_t cmd, mpio_mem_t mem, DWORD index,
 {
   BYTE memory;
 
+  /* the card is about to change, a mount cache would be stale */
+  if ((cmd == PUT_SECTOR) || (cmd == PUT_BLOCK) || 
+      (cmd == PUT_MEGABLOCK) || (cmd == DEL_BLOCK))
+    mpio_mount_invalidate(m);
+
   /* clear cmdpacket*/
   memset(buffer, 0, 0x40);  
 
@@ -682,11 +977,18 @@ mpio_io_bulk_write(int fd, CHAR *block, int num_bytes)
 int
 mpio_io_write(mpio_t *m, CHAR *block, int num_bytes)
 {
-    int r;  
-    r = usb_bulk_write(m->usb_handle, m->usb_out_ep, block, num_bytes, MPIO_USB_TIMEOUT);
-    if (r < 0)
-      debug("libusb returned error: (%08x) \"%s\"\n", r, usb_strerror());
-    return r;
+  int r;
+
+  /* nothing but command packets is sent with this size */
+  if (num_bytes == CMD_SIZE)
+    mpio_stats_command(m, block[0]);
+
+  r = (*m->transport->write)(m, block, num_bytes);
+  mpio_stats_transfer(m, 1, num_bytes, r);
+  if (m->trace)
+    mpio_trace_record(m, 1, block, num_bytes, r);
+
+  return r;
 }
 
 
@@ -728,11 +1030,14 @@ mpio_io_bulk_read (int fd, CHAR *block, int num_bytes)
 int
 mpio_io_read (mpio_t *m, CHAR *block, int num_bytes)
 {
-    int r;
-    r = usb_bulk_read(m->usb_handle, m->usb_in_ep, block, num_bytes, MPIO_USB_TIMEOUT);
-    if (r < 0)
-      debug("libusb returned error: (%08x) \"%s\"\n", r, usb_strerror());
-    return r;
+  int r;
+
+  r = (*m->transport->read)(m, block, num_bytes);
+  mpio_stats_transfer(m, 0, num_bytes, r);
+  if (m->trace)
+    mpio_trace_record(m, 0, block, num_bytes, r);
+
+  return r;
 }
 
 
@@ -788,6 +1093,22 @@ mpio_io_version_read(mpio_t *m, CHAR *buffer)
   return CMD_SIZE;
 }
 
+/* check and correct both halves of a sector as received with its
+ * spare area, returns 1 if one of them can't be corrected */
+static int
+mpio_io_sector_ecc(mpio_t *m, CHAR *sector)
+{
+  int a, b;
+
+  a = mpio_ecc_256_check(sector, (sector + SECTOR_SIZE + 13));
+  b = mpio_ecc_256_check((sector + (SECTOR_SIZE / 2)), 
+			 (sector + SECTOR_SIZE + 8));
+  mpio_stats_ecc(m, a);
+  mpio_stats_ecc(m, b);
+
+  return ((a == MPIO_ECC_FAILED) || (b == MPIO_ECC_FAILED));
+}
+
 /* 
  * read sector from SmartMedia
  *
@@ -864,10 +1185,7 @@ mpio_io_sector_read(mpio_t *m, BYTE mem, DWORD index, CHAR *output)
   /* check ECC Area information */
   if (mem==MPIO_EXTERNAL_MEM) 
     {    
-      if (mpio_ecc_256_check (recvbuff,
-			      (recvbuff + SECTOR_SIZE + 13)) ||
-          mpio_ecc_256_check ((recvbuff + (SECTOR_SIZE / 2)),
-			      (recvbuff + SECTOR_SIZE + 8))    )
+      if (mpio_io_sector_ecc(m, recvbuff))
       	debug ("ECC error @ (mem=0x%02x index=0x%06x)\n", mem, index);
     }
 
@@ -889,6 +1207,132 @@ mpio_io_sector_read(mpio_t *m, BYTE mem, DWORD index, CHAR *output)
   return 0;  
 }
 
+/*
+ * read the spare area of the first sector of a (physical) block,
+ * this is the entry mpio_io_spare_read returns for this block
+ */
+int
+mpio_io_spare_sample(mpio_t *m, mpio_mem_t mem, DWORD block, CHAR *spare)
+{
+  mpio_smartmedia_t *sm;
+  mpio_fatentry_t f;
+  BYTE  chip;
+  DWORD address;
+  int nwrite, nread;
+  CHAR cmdpacket[CMD_SIZE], recvbuff[SECTOR_TRANS];
+
+  if (mem == MPIO_INTERNAL_MEM) 
+    {
+      sm = &m->internal;
+      mpio_fatentry_init(m, mem, &f, block, FTYPE_MUSIC);
+      fatentry2hw(&f, &chip, &address);
+    }
+  if (mem == MPIO_EXTERNAL_MEM) 
+    {
+      sm      = &m->external;
+      chip    = MPIO_EXTERNAL_MEM;
+      address = block * BLOCK_SECTORS;
+    }
+
+  mpio_io_set_cmdpacket(m, GET_SECTOR, chip, address, sm->size, 0, cmdpacket);
+
+  debugn (5, "\n>>> MPIO\n");
+  hexdump (cmdpacket, sizeof(cmdpacket));
+    
+  nwrite = mpio_io_write(m, cmdpacket, CMD_SIZE);
+
+  if(nwrite != CMD_SIZE) 
+    {
+      debug ("\nFailed to send command.\n");
+      close (m->fd);
+      return 1;
+    }
+
+  nread = mpio_io_read(m, recvbuff, SECTOR_TRANS);
+
+  if(nread != SECTOR_TRANS) 
+    {
+      debug ("\nFailed to read Sector.(nread=0x%04x)\n", nread);
+      close (m->fd);
+      return 1;
+    }
+
+  debugn (5, "\n<<< MPIO\n");
+  hexdump (recvbuff, SECTOR_TRANS);
+
+  memcpy(spare, recvbuff + SECTOR_SIZE, 0x10);
+
+  return 0;
+}
+
+/*
+ * read count logical sectors starting at index
+ *
+ * runs of at least MPIO_SECTOR_BATCH sectors inside one block are
+ * fetched with a single GET_BLOCK, only the short edges of a range
+ * are read sector by sector
+ */
+int
+mpio_io_sector_range_read(mpio_t *m, BYTE mem, DWORD index, DWORD count, 
+			  CHAR *output)
+{
+  mpio_smartmedia_t *sm=0;
+  BYTE  block[BLOCK_SIZE];
+  DWORD address, offset, n;
+
+  if (mem == MPIO_INTERNAL_MEM) sm = &m->internal;
+  if (mem == MPIO_EXTERNAL_MEM) sm = &m->external;
+  if (!sm)
+    {
+      debug("error in memory selection, aborting\n");      
+      exit (-1);
+    }
+
+  while (count)
+    {
+      offset  = index % BLOCK_SECTORS;
+      n       = BLOCK_SECTORS - offset;
+      if (n > count)
+	n = count;
+
+      /* the new chips can't be adressed by sector */
+      address = MPIO_BLOCK_NOT_FOUND;
+      if ((n >= MPIO_SECTOR_BATCH) && (!sm->version) && 
+	  (index < MPIO_BLOCK_CIS))
+	{
+	  if (mem == MPIO_INTERNAL_MEM)
+	    address = index - offset;
+	  if (mem == MPIO_EXTERNAL_MEM)
+	    address = mpio_zone_block_find_seq(m, mem, (index / BLOCK_SECTORS));
+	}
+
+      if (address == MPIO_BLOCK_NOT_FOUND) 
+	{
+	  if (mpio_io_sector_read(m, mem, index, output))
+	    return 1;
+	  n = 1;
+	} else {
+	  debugn (2, "sectors: (index=0x%8x count=0x%02x block=0x%06x)\n", 
+		  index, n, address);
+	  if (n == BLOCK_SECTORS) 
+	    {
+	      if (mpio_io_block_read_phys(m, mem, mem, address, (BYTE *)output))
+		return 1;
+	    } else {
+	      if (mpio_io_block_read_phys(m, mem, mem, address, block))
+		return 1;
+	      memcpy(output, block + (offset * SECTOR_SIZE), n * SECTOR_SIZE);
+	    }
+	}
+
+      index  += n;
+      count  -= n;
+      output += n * SECTOR_SIZE;
+    }
+
+  return 0;
+}
+
 /* 
  * write sector to SmartMedia
  *
@@ -922,6 +1366,8 @@ mpio_io_sector_write(mpio_t *m, BYTE mem, DWORD index, CHAR *input)
       exit (-1);
     }
 
+  mpio_cache_flush(m);
+
   /* we have to:
    * - find the physical block (or allocate a new one)
    * - calculate the logical block for zone management
@@ -1028,7 +1474,10 @@ mpio_io_sector_write(mpio_t *m, BYTE mem, DWORD index, CHAR *input)
   
   /* easy but working, we write back the FAT info we read before */
   if (mem==MPIO_INTERNAL_MEM) 
+    {
+      mpio_fat_load_entry(m, mem, 0);
       memcpy((sendbuff+SECTOR_SIZE), sm->fat, 0x10);
+    }
 
   debugn (5, "\n>>> MPIO\n");
   hexdump(sendbuff, SECTOR_TRANS);
@@ -1047,20 +1496,69 @@ mpio_io_sector_write(mpio_t *m, BYTE mem, DWORD index, CHAR *input)
 }
 
 /*
- * read/write of megablocks
+ * transfer frames
+ *
+ * The player sends and expects the data of a block interleaved with
+ * the spare areas. mpio_io_frame_iov describes where the data lies
+ * inside a frame, so it can be moved straight between the frame and
+ * its final place (file, memory) without an intermediate block.
  */
 int
-mpio_io_megablock_read(mpio_t *m, mpio_mem_t mem, mpio_fatentry_t *f, BYTE *output)
+mpio_io_frame_iov(mpio_t *m, mpio_mem_t mem, BYTE write, CHAR *frame,
+		  int len, struct iovec *iov)
 {
-  int i=0;
-  int j=0;
-  int nwrite, nread;
-  mpio_smartmedia_t *sm;
-  BYTE  chip;
-  DWORD address;
-  CHAR cmdpacket[CMD_SIZE], recvbuff[BLOCK_TRANS];
+  int chunk, stride, n;
 
-  if (mem == MPIO_INTERNAL_MEM) sm = &m->internal;
+  if ((write) && (mem == MPIO_INTERNAL_MEM) && (m->internal.version))
+    {
+      /* megablock: 8 transfers of 8 pages with 2048 bytes each */
+      chunk  = 0x800;
+      stride = 0x840;
+    } else {
+      chunk  = SECTOR_SIZE;
+      stride = SECTOR_TRANS;
+    }
+
+  for (n = 0; len > 0; n++, len -= chunk)
+    {
+      iov[n].iov_base = frame + (n * stride);
+      iov[n].iov_len  = (len > chunk ? chunk : len);
+    }
+
+  return n;
+}
+
+/* copy the data of a received frame to output */
+static void
+mpio_io_frame_unpack(mpio_t *m, mpio_mem_t mem, CHAR *frame, BYTE *output)
+{
+  struct iovec iov[MEGABLOCK_SECTORS];
+  int i, n;
+
+  n = mpio_io_frame_iov(m, mem, 0, frame, 
+			mpio_block_get_blocksize(m, mem), iov);
+  for (i = 0; i < n; i++) 
+    {
+      memcpy(output, iov[i].iov_base, iov[i].iov_len);
+      output += iov[i].iov_len;
+    }
+}
+
+/*
+ * read/write of megablocks
+ */
+int
+mpio_io_megablock_read_frame(mpio_t *m, mpio_mem_t mem, mpio_fatentry_t *f, 
+			     CHAR *frame)
+{
+  int i=0;
+  int nwrite, nread;
+  mpio_smartmedia_t *sm;
+  BYTE  chip;
+  DWORD address;
+  CHAR cmdpacket[CMD_SIZE];
+
+  if (mem == MPIO_INTERNAL_MEM) sm = &m->internal;
   if (mem == MPIO_EXTERNAL_MEM) sm = &m->external;
 
   fatentry2hw(f, &chip, &address);
@@ -1081,43 +1579,50 @@ mpio_io_megablock_read(mpio_t *m, mpio_mem_t mem, mpio_fatentry_t *f, BYTE *outp
       return 1;
     }
 
-  /*  Receive packets from MPIO   */
+  /*  Receive packets from MPIO
+   * the 8 sub-blocks follow each other without a gap, so they are
+   * fetched with one bulk transfer instead of waiting for each one
+   */
+  nread = mpio_io_read(m, frame, MEGABLOCK_READ);
+      
+  if(nread != MEGABLOCK_READ) 
+    {
+      debug ("\nFailed to read megablock.(nread=0x%04x)\n",nread);
+      close (m->fd);
+      return 1;
+    }
+
   for (i = 0; i < 8; i++) 
     {      
-      nread = mpio_io_read(m, recvbuff, BLOCK_TRANS);
-      
-      if(nread != BLOCK_TRANS) 
-	{
-	  debug ("\nFailed to read (sub-)block.(nread=0x%04x)\n",nread);
-	  close (m->fd);
-	  return 1;
-	}
-      
       debugn(5, "\n<<< MPIO (%d)\n", i);
-      hexdump(recvbuff, BLOCK_TRANS);
-
-      for (j = 0; j < BLOCK_SECTORS; j++) {
-	memcpy(output + (j * SECTOR_SIZE) + (i * BLOCK_SIZE), 
-	       recvbuff + (j * SECTOR_TRANS), 
-	       SECTOR_SIZE);
-      }
+      hexdump(frame + (i * BLOCK_TRANS), BLOCK_TRANS);
     }
 
   return 0;  
 }
 
+int
+mpio_io_megablock_read(mpio_t *m, mpio_mem_t mem, mpio_fatentry_t *f, BYTE *output)
+{
+  CHAR recvbuff[MEGABLOCK_READ];
+
+  if (mpio_io_megablock_read_frame(m, mem, f, recvbuff))
+    return 1;
+
+  mpio_io_frame_unpack(m, mem, recvbuff, output);
+
+  return 0;
+}
+
 /*
  * read/write of blocks
  */
 int
 mpio_io_block_read(mpio_t *m, mpio_mem_t mem, mpio_fatentry_t *f, BYTE *output)
 {
-  int i=0;
-  int nwrite, nread;
   mpio_smartmedia_t *sm;
   BYTE  chip;
   DWORD address;
-  CHAR cmdpacket[CMD_SIZE], recvbuff[BLOCK_TRANS];
 
   if (mem == MPIO_INTERNAL_MEM) sm = &m->internal;
   if (mem == MPIO_EXTERNAL_MEM) sm = &m->external;
@@ -1127,6 +1632,57 @@ mpio_io_block_read(mpio_t *m, mpio_mem_t mem, mpio_fatentry_t *f, BYTE *output)
 
   fatentry2hw(f, &chip, &address);
 
+  return mpio_io_block_read_phys(m, mem, chip, address, output);
+}
+
+/* receive the frame of a block without unpacking it, frame has to
+ * hold MEGABLOCK_READ bytes */
+int
+mpio_io_block_read_frame(mpio_t *m, mpio_mem_t mem, mpio_fatentry_t *f, 
+			 CHAR *frame)
+{
+  mpio_smartmedia_t *sm;
+  BYTE  chip;
+  DWORD address;
+
+  if (mem == MPIO_INTERNAL_MEM) sm = &m->internal;
+  if (mem == MPIO_EXTERNAL_MEM) sm = &m->external;
+
+  if (sm->version)
+    return mpio_io_megablock_read_frame(m, mem, f, frame);
+
+  fatentry2hw(f, &chip, &address);
+
+  return mpio_io_block_read_phys_frame(m, mem, chip, address, frame);
+}
+
+/* read the physical block at chip/address and strip the spare areas */
+int
+mpio_io_block_read_phys(mpio_t *m, mpio_mem_t mem, BYTE chip, DWORD address,
+			BYTE *output)
+{
+  CHAR recvbuff[BLOCK_TRANS];
+
+  if (mpio_io_block_read_phys_frame(m, mem, chip, address, recvbuff))
+    return 1;
+
+  mpio_io_frame_unpack(m, mem, recvbuff, output);
+
+  return 0;
+}
+
+int
+mpio_io_block_read_phys_frame(mpio_t *m, mpio_mem_t mem, BYTE chip, 
+			      DWORD address, CHAR *recvbuff)
+{
+  int i=0;
+  int nwrite, nread;
+  mpio_smartmedia_t *sm;
+  CHAR cmdpacket[CMD_SIZE];
+
+  if (mem == MPIO_INTERNAL_MEM) sm = &m->internal;
+  if (mem == MPIO_EXTERNAL_MEM) sm = &m->external;
+
   mpio_io_set_cmdpacket(m, GET_BLOCK, chip, address, sm->size, 0, cmdpacket);
 
   debugn(5, "\n>>> MPIO\n");
@@ -1154,28 +1710,20 @@ mpio_io_block_read(mpio_t *m, mpio_mem_t mem, mpio_fatentry_t *f, BYTE *output)
   debugn(5, "\n<<< MPIO\n");
   hexdump(recvbuff, BLOCK_TRANS);
 
-  for (i = 0; i < BLOCK_SECTORS; i++) 
-    {
-      /* check ECC Area information */
-      if (mem==MPIO_EXTERNAL_MEM) {      
-	if (mpio_ecc_256_check ((recvbuff + (i * SECTOR_TRANS)),
-				((recvbuff +(i * SECTOR_TRANS) 
-				  + SECTOR_SIZE +13))) ||	
-	    mpio_ecc_256_check ((recvbuff + (i * SECTOR_TRANS) 
-				 + (SECTOR_SIZE / 2)),
-				((recvbuff +(i * SECTOR_TRANS) 
-				  + SECTOR_SIZE + 8))))
+  /* check ECC Area information */
+  if (mem==MPIO_EXTERNAL_MEM) 
+    for (i = 0; i < BLOCK_SECTORS; i++) 
+      {
+	if (mpio_io_sector_ecc(m, recvbuff + (i * SECTOR_TRANS)))
 	  debug ("ECC error @ (chip=0x%02x address=0x%06x)\n", chip, address);
       }
-      
-      memcpy(output + (i * SECTOR_SIZE), 
-	     recvbuff + (i * SECTOR_TRANS), 
-	     SECTOR_SIZE);
-    }
 
   return 0;  
 }
 
+/* size of the bulk transfers used to read the spare area */
+#define MPIO_SPARE_BULK 0x40000
+
 /* Read spare is only usefull for the internal memory,
  * the FAT lies there. It is updated during the
  * mpio_io_{sector,block}_{read,write} operations.
@@ -1190,12 +1738,39 @@ int
 mpio_io_spare_read(mpio_t *m, BYTE mem, DWORD index, WORD size,
 		   BYTE wsize, CHAR *output, int toread,
 		   mpio_callback_init_t progress_callback)
+{
+  mpio_smartmedia_t *sm;
+  int chip;
+
+  if (mem == MPIO_INTERNAL_MEM) sm = &m->internal;  
+  if (mem == MPIO_EXTERNAL_MEM) sm = &m->external;
+
+  for (chip = 1; chip <= sm->chips; chip++) 
+    if (mpio_io_spare_read_chip(m, mem, chip, index, size, wsize, 
+				output, toread, progress_callback))
+      return 1;
+
+  if (progress_callback)
+    (*progress_callback)(mem, toread, toread);
+  
+  return 0;  
+}
+
+/* 
+ * read the spare area of a single chip (1..chips), output and toread
+ * describe the whole memory, the chip's part is filled in
+ */
+int
+mpio_io_spare_read_chip(mpio_t *m, BYTE mem, BYTE chip, DWORD index, 
+			WORD size, BYTE wsize, CHAR *output, int toread,
+			mpio_callback_init_t progress_callback)
 {
   mpio_smartmedia_t *sm;
   int i;
   int nwrite, nread;
-  int chip = 0;
   int chips = 0;
+  int done, len, n;
+  CHAR *base;
   CHAR cmdpacket[CMD_SIZE];
 
   if (mem == MPIO_INTERNAL_MEM) sm = &m->internal;  
@@ -1203,52 +1778,57 @@ mpio_io_spare_read(mpio_t *m, BYTE mem, DWORD index, WORD size,
 
   chips = sm->chips;  
   
-  for (chip = 1; chip <= chips; chip++) 
-    {
-      if (mem == MPIO_INTERNAL_MEM) 
-	mpio_io_set_cmdpacket(m, GET_SPARE_AREA, (1 << (chip-1)), 
-			      index, (size / sm->chips), 
-			      wsize, cmdpacket);
-      if (mem == MPIO_EXTERNAL_MEM) 
-	mpio_io_set_cmdpacket(m, GET_SPARE_AREA, mem, index, size, 
-			      wsize, cmdpacket);
-      debugn(5, "\n>>> MPIO\n");
-      hexdump(cmdpacket, sizeof(cmdpacket));
+  if (mem == MPIO_INTERNAL_MEM) 
+    mpio_io_set_cmdpacket(m, GET_SPARE_AREA, (1 << (chip-1)), 
+			  index, (size / sm->chips), 
+			  wsize, cmdpacket);
+  if (mem == MPIO_EXTERNAL_MEM) 
+    mpio_io_set_cmdpacket(m, GET_SPARE_AREA, mem, index, size, 
+			  wsize, cmdpacket);
+  debugn(5, "\n>>> MPIO\n");
+  hexdump(cmdpacket, sizeof(cmdpacket));
       
-      nwrite = mpio_io_write(m, cmdpacket, CMD_SIZE);
+  nwrite = mpio_io_write(m, cmdpacket, CMD_SIZE);
       
-      if(nwrite != CMD_SIZE) {
-	debug ("\nFailed to send command.\n");
-	close (m->fd);
-	return 1;
-      }
+  if(nwrite != CMD_SIZE) {
+    debug ("\nFailed to send command.\n");
+    close (m->fd);
+    return 1;
+  }
       
-      /*  Receive packet from MPIO   */
-      for (i = 0; i < (toread / chips / CMD_SIZE); i++) 
-	{	  
-	  nread = mpio_io_read(m,
-			       output + (i * CMD_SIZE) +
-			       (toread / chips * (chip - 1)),
-			       CMD_SIZE);
+  /*  Receive the spare area of this chip with big bulk transfers
+   *  and split it up into the CMD_SIZE packets the player sends
+   */
+  base = output + (toread / chips * (chip - 1));
+  len  = (toread / chips / CMD_SIZE) * CMD_SIZE;
+  done = 0;
+  i    = 0;
+  while (done < len)
+    {
+      n = len - done;
+      if (n > MPIO_SPARE_BULK)
+	n = MPIO_SPARE_BULK;
 
+      nread = mpio_io_read(m, base + done, n);
+	  
+      if (nread <= 0) 
+	{
+	  debug ("\nFailed to read Block.(nread=0x%04x)\n",nread);
+	  close (m->fd);
+	  return 1;
+	}
+      done += nread;
+
+      for (; ((i + 1) * CMD_SIZE) <= done; i++)
+	{
 	  if ((progress_callback) && (i % 256))
 	    (*progress_callback)(mem, 
 				 (i*CMD_SIZE+(toread/chips*(chip-1))),
 				 toread );
-      
-	  if(nread != CMD_SIZE) 
-	    {
-	      debug ("\nFailed to read Block.(nread=0x%04x)\n",nread);
-	      close (m->fd);
-	      return 1;
-	    }
 	  debugn(5, "\n<<< MPIO\n");
-	  hexdump(output + (i * CMD_SIZE) + (toread / chips * (chip - 1)), 
-		  CMD_SIZE);
+	  hexdump(base + (i * CMD_SIZE), CMD_SIZE);
 	}
     }
-  if (progress_callback)
-    (*progress_callback)(mem, toread, toread);
   
   return 0;  
 }
@@ -1298,6 +1878,8 @@ mpio_io_block_delete_phys(mpio_t *m, BYTE chip, DWORD address)
       mpio_zone_block_set_free_phys(m, chip, address);
     }
 
+  mpio_cache_flush(m);
+
   if (sm->version) {
     CMD_OK    = 0xe0;
     CMD_ERROR = 0xe1; 
@@ -1354,96 +1936,110 @@ mpio_io_block_delete_phys(mpio_t *m, BYTE chip, DWORD address)
   return CMD_SIZE;
 }
 
-int  
-mpio_io_megablock_write(mpio_t *m, mpio_mem_t mem, mpio_fatentry_t *f, BYTE *data)
+/*
+ * writing a block is split into three steps, so the expensive part
+ * can be done ahead of time (see mpio_file_put):
+ *
+ * frame: copy the data into the transfer layout and generate the ECC
+ * patch: fill in what depends on the FAT entry and the physical block
+ * send:  hand the frame over to the player
+ */
+int
+mpio_io_block_frame(mpio_t *m, mpio_mem_t mem, BYTE *data, CHAR *frame)
 {
-  mpio_smartmedia_t *sm;
-  int nwrite;
-  int i, j, k;
-  DWORD block_address, ba;
-  CHAR cmdpacket[CMD_SIZE], sendbuff[MEGABLOCK_TRANS_WRITE];
-  BYTE  chip=0;
-  DWORD address;
+  struct iovec iov[MEGABLOCK_SECTORS];
+  int i, n;
 
-  if (mem == MPIO_INTERNAL_MEM) 
-    {
-      sm = &m->internal;
-      fatentry2hw(f, &chip, &address);
-    }
-	
-  if (mem == MPIO_EXTERNAL_MEM) 
+  n = mpio_io_frame_iov(m, mem, 1, frame, 
+			mpio_block_get_blocksize(m, mem), iov);
+  for (i = 0; i < n; i++) 
     {
-      printf ("This should never happen!");
-      exit(1);      
+      memcpy(iov[i].iov_base, data, iov[i].iov_len);
+      data += iov[i].iov_len;
     }
 
-  /* build and send cmd packet */
-  mpio_io_set_cmdpacket(m, PUT_MEGABLOCK, chip, address, sm->size, 0x10, cmdpacket);
-  cmdpacket[8] = 0x02; /* el yuck'o */  
-
-  debugn(5, "\n>>> MPIO\n");
-  hexdump(cmdpacket, sizeof(cmdpacket));
-  hexdump((CHAR *)f->i_fat, 0x10);
+  return mpio_io_frame_spare(m, mem, frame);
+}
 
-  nwrite = mpio_io_write(m, cmdpacket, CMD_SIZE);
+/* fill in the spare areas of a frame whose data is already in place */
+int
+mpio_io_frame_spare(mpio_t *m, mpio_mem_t mem, CHAR *frame)
+{
+  int i;
 
-  if(nwrite != CMD_SIZE) 
+  /* megablock: the spare areas are filled in by mpio_io_block_patch */
+  if ((mem == MPIO_INTERNAL_MEM) && (m->internal.version))
+    return 0;
+  
+  for (i = 0; i < BLOCK_SECTORS; i++) 
     {
-      debug ("\nFailed to send command.\n");
-      close (m->fd);
-      return 1;
+      memset(frame + (i * SECTOR_TRANS) + SECTOR_SIZE,
+	     0xff, CMD_SIZE);
+
+      if (mem == MPIO_EXTERNAL_MEM) 
+	{      
+	  /* generate ECC Area information */
+	  mpio_ecc_256_gen ((frame + (i * SECTOR_TRANS)),                   
+			    ((frame + (i * SECTOR_TRANS) 
+			      + SECTOR_SIZE + 13)));
+	  mpio_ecc_256_gen ((frame + (i * SECTOR_TRANS) 
+			      + (SECTOR_SIZE / 2)), 
+			    ((frame + (i * SECTOR_TRANS) 
+			      + SECTOR_SIZE + 8)));
+	}
     }
-  
-  for (i = 0; i < 8 ; i++) {
-    /* build block for transfer to MPIO */
-    for (j = 0; j < 8; j++) 
-      {
-	memcpy(sendbuff + (j * 0x840), 
-	       data + (j * 0x800) + (i * BLOCK_SIZE),	   
-	       0x800);
-	for (k = 0; k < 4; k++) {
-	  memcpy((sendbuff + (j * 0x840) + 0x800 + (k * 0x10)), 
-		 f->i_fat, 0x10);
-	  if (k) 
-	    memset((sendbuff + (j * 0x840) + 0x800 + (k * 0x10)), 0xee, 1);
-	}	
-      }
-    
-    /*  send packet to MPIO   */
-    debugn(5, "\n<<< MPIO (%d)\n", i);
-    hexdump(sendbuff, MEGABLOCK_TRANS_WRITE);
-      
-    nwrite = mpio_io_write(m, sendbuff, MEGABLOCK_TRANS_WRITE);
-    
-    if(nwrite != MEGABLOCK_TRANS_WRITE) 
-      {
-	debug ("\nFailed to write block (i=%d nwrite=0x%04x)\n", i, nwrite);
-	close (m->fd);
-	return 1;
-      }    
-    
-  }
 
   return 0;
 }
 
-int  
-mpio_io_block_write(mpio_t *m, mpio_mem_t mem, mpio_fatentry_t *f, BYTE *data)
+/* fill in the logical block address of an external block */
+static void
+mpio_io_block_address_set(CHAR *frame, DWORD block_address)
 {
-  mpio_smartmedia_t *sm;
-  int nwrite;
+  DWORD ba;
   int i;
-  DWORD block_address, ba;
-  CHAR cmdpacket[CMD_SIZE], sendbuff[BLOCK_TRANS];
-  BYTE  chip=0;
-  DWORD address;
+
+  for (i = 0; i < BLOCK_SECTORS; i++) 
+    {
+      ba = (block_address / 0x100) & 0xff;
+      frame[(i * SECTOR_TRANS) + SECTOR_SIZE + 0x06] = ba;
+      frame[(i * SECTOR_TRANS) + SECTOR_SIZE + 0x0b] = ba;
+      
+      ba = block_address & 0xff;
+      frame[(i * SECTOR_TRANS) + SECTOR_SIZE + 0x07] = ba;
+      frame[(i * SECTOR_TRANS) + SECTOR_SIZE + 0x0c] = ba;
+    }
+}
+
+int
+mpio_io_block_patch(mpio_t *m, mpio_mem_t mem, mpio_fatentry_t *f, 
+		    CHAR *frame, BYTE *chip, DWORD *address)
+{
+  mpio_smartmedia_t *sm;
+  DWORD block_address;
+  int i, j, k;
 
   if (mem == MPIO_INTERNAL_MEM) 
     {
       sm = &m->internal;
-      if (sm->version)
-	return mpio_io_megablock_write(m, mem, f, data);
-      fatentry2hw(f, &chip, &address);
+      fatentry2hw(f, chip, address);
+
+      if (sm->version) 
+	{
+	  for (i = 0; i < 8 ; i++) 
+	    for (j = 0; j < 8; j++) 
+	      for (k = 0; k < 4; k++) {
+		memcpy((frame + (i * MEGABLOCK_TRANS_WRITE) + (j * 0x840) 
+			+ 0x800 + (k * 0x10)), f->i_fat, 0x10);
+		if (k) 
+		  memset((frame + (i * MEGABLOCK_TRANS_WRITE) + (j * 0x840) 
+			  + 0x800 + (k * 0x10)), 0xee, 1);
+	      }	
+	} else {
+	  memcpy(frame + SECTOR_SIZE, f->i_fat, 0x10);
+	}
+/*       debug("address %02x:%06x\n", *chip, *address); */
+/*       hexdumpn(0, f->i_fat, 0x10); */
     }
 	
   if (mem == MPIO_EXTERNAL_MEM) 
@@ -1455,56 +2051,39 @@ mpio_io_block_write(mpio_t *m, mpio_mem_t mem, mpio_fatentry_t *f, BYTE *data)
       }
 	
       /* find free physical block */
-      chip = MPIO_EXTERNAL_MEM;
-      address = mpio_zone_block_find_free_log(m, mem, f->entry);
+      *chip    = MPIO_EXTERNAL_MEM;
+      *address = mpio_zone_block_find_free_log(m, mem, f->entry);
+
+      /* fill in block information */
+      block_address = mpio_zone_block_get_logical(m, mem, *address);
+      mpio_io_block_address_set(frame, blockaddress_encode(block_address));
     }
 
-  /* build block for transfer to MPIO */
-  for (i = 0; i < BLOCK_SECTORS; i++) 
-    {
-      memcpy(sendbuff + (i * SECTOR_TRANS), 
-	     data + (i * SECTOR_SIZE),	   
-	     SECTOR_SIZE);
-      memset(sendbuff + (i * SECTOR_TRANS) + SECTOR_SIZE,
-	     0xff, CMD_SIZE);
+  return 0;
+}
 
-      if (mem == MPIO_INTERNAL_MEM) 
-	{	  
-	  if (i == 0)
-	    {	      
-	      memcpy((sendbuff+SECTOR_SIZE+(i * SECTOR_TRANS)), 
-		     f->i_fat, 0x10);
-/* 	      debug("address %02x:%06x\n", chip, address); */
-/* 	      hexdumpn(0, f->i_fat, 0x10); */
-	    }	  
-	}      
+int
+mpio_io_block_send(mpio_t *m, mpio_mem_t mem, BYTE chip, DWORD address,
+		   CHAR *frame)
+{
+  mpio_smartmedia_t *sm;
+  CHAR cmdpacket[CMD_SIZE];
+  int nwrite, i;
 
-      /* fill in block information */
-      if (mem == MPIO_EXTERNAL_MEM) 
-	{      
-	  block_address = mpio_zone_block_get_logical(m, mem, address);
-	  block_address = blockaddress_encode(block_address);
+  if (mem == MPIO_INTERNAL_MEM) sm = &m->internal;
+  if (mem == MPIO_EXTERNAL_MEM) sm = &m->external;
 
-	  ba = (block_address / 0x100) & 0xff;
-	  sendbuff[(i * SECTOR_TRANS) + SECTOR_SIZE + 0x06] = ba;
-	  sendbuff[(i * SECTOR_TRANS) + SECTOR_SIZE + 0x0b] = ba;
-	  
-	  ba = block_address & 0xff;
-	  sendbuff[(i * SECTOR_TRANS) + SECTOR_SIZE + 0x07] = ba;
-	  sendbuff[(i * SECTOR_TRANS) + SECTOR_SIZE + 0x0c] = ba;
-	  
-	  /* generate ECC Area information */
-	  mpio_ecc_256_gen ((sendbuff + (i * SECTOR_TRANS)),                   
-			    ((sendbuff + (i * SECTOR_TRANS) 
-			      + SECTOR_SIZE + 13)));
-	  mpio_ecc_256_gen ((sendbuff + (i * SECTOR_TRANS) 
-			      + (SECTOR_SIZE / 2)), 
-			    ((sendbuff + (i * SECTOR_TRANS) 
-			      + SECTOR_SIZE + 8)));
-	}
-  }
+  mpio_cache_flush(m);
 
-  mpio_io_set_cmdpacket(m, PUT_BLOCK, chip, address, sm->size, 0x48 , cmdpacket);
+  if ((mem == MPIO_INTERNAL_MEM) && (sm->version))
+    {
+      mpio_io_set_cmdpacket(m, PUT_MEGABLOCK, chip, address, sm->size, 0x10,
+			    cmdpacket);
+      cmdpacket[8] = 0x02; /* el yuck'o */  
+    } else {
+      mpio_io_set_cmdpacket(m, PUT_BLOCK, chip, address, sm->size, 0x48,
+			    cmdpacket);
+    }
 
   debugn(5, "\n>>> MPIO\n");
   hexdump(cmdpacket, sizeof(cmdpacket));
@@ -1518,10 +2097,29 @@ mpio_io_block_write(mpio_t *m, mpio_mem_t mem, mpio_fatentry_t *f, BYTE *data)
       return 1;
     }
 
+  if ((mem == MPIO_INTERNAL_MEM) && (sm->version))
+    {
+      for (i = 0; i < 8 ; i++) {
+	debugn(5, "\n<<< MPIO (%d)\n", i);
+	hexdump(frame + (i * MEGABLOCK_TRANS_WRITE), MEGABLOCK_TRANS_WRITE);
+      }
+
+      /*  send all 8 sub-blocks to MPIO with one bulk transfer */
+      nwrite = mpio_io_write(m, frame, 8 * MEGABLOCK_TRANS_WRITE);
+    
+      if(nwrite != (8 * MEGABLOCK_TRANS_WRITE)) 
+	{
+	  debug ("\nFailed to write megablock (nwrite=0x%04x)\n", nwrite);
+	  close (m->fd);
+	  return 1;
+	}    
+      return 0;
+    }
+
   /*  send packet to MPIO   */
   debugn(5, "\n<<< MPIO\n");
-  hexdump(sendbuff, BLOCK_TRANS);
-  nwrite = mpio_io_write(m, sendbuff, BLOCK_TRANS);
+  hexdump(frame, BLOCK_TRANS);
+  nwrite = mpio_io_write(m, frame, BLOCK_TRANS);
 
   if(nwrite != BLOCK_TRANS) 
     {
@@ -1532,3 +2130,73 @@ mpio_io_block_write(mpio_t *m, mpio_mem_t mem, mpio_fatentry_t *f, BYTE *data)
 
   return 0;
 }
+
+/* patch and send a frame built by mpio_io_block_frame */
+int
+mpio_io_block_write_frame(mpio_t *m, mpio_mem_t mem, mpio_fatentry_t *f, 
+			  CHAR *frame)
+{
+  BYTE  chip = 0;
+  DWORD address;
+
+  mpio_io_block_patch(m, mem, f, frame, &chip, &address);
+
+  return mpio_io_block_send(m, mem, chip, address, frame);
+}
+
+int  
+mpio_io_megablock_write(mpio_t *m, mpio_mem_t mem, mpio_fatentry_t *f, BYTE *data)
+{
+  CHAR frame[MPIO_FRAME_SIZE];
+
+  if (mem == MPIO_EXTERNAL_MEM) 
+    {
+      printf ("This should never happen!");
+      exit(1);      
+    }
+
+  mpio_io_block_frame(m, mem, data, frame);
+  hexdump((CHAR *)f->i_fat, 0x10);
+
+  return mpio_io_block_write_frame(m, mem, f, frame);
+}
+
+int  
+mpio_io_block_write(mpio_t *m, mpio_mem_t mem, mpio_fatentry_t *f, BYTE *data)
+{
+  CHAR frame[MPIO_FRAME_SIZE];
+
+  mpio_io_block_frame(m, mem, data, frame);
+
+  return mpio_io_block_write_frame(m, mem, f, frame);
+}
+
+/*
+ * the blocks in front of the data area (MBR, PBR, FAT and root
+ * directory) are addressed by their logical sector number, like
+ * mpio_io_sector_write does, but written with one PUT_BLOCK
+ */
+int  
+mpio_io_block_write_seq(mpio_t *m, mpio_mem_t mem, DWORD lblock, BYTE *data)
+{
+  CHAR frame[BLOCK_TRANS];
+  DWORD address;
+
+  if (mem != MPIO_EXTERNAL_MEM) 
+    {
+      debug("called function with wrong memory selection!\n");
+      return 1;
+    }
+
+  address = mpio_zone_block_find_free_seq(m, mem, lblock);
+  if (address == MPIO_BLOCK_NOT_FOUND)
+    {
+      debug ("Oops, this should never happen! (lblock=0x%06x)\n", lblock);
+      return 1;
+    }
+
+  mpio_io_block_frame(m, mem, data, frame);
+  mpio_io_block_address_set(frame, blockaddress_encode(lblock));
+
+  return mpio_io_block_send(m, mem, MPIO_EXTERNAL_MEM, address, frame);
+}
@@ -26,6 +26,8 @@
 #ifndef _MPIO_IO_H_
 #define _MPIO_IO_H_
 
+#include <sys/uio.h>
+
 #include "defs.h"
 
 #ifdef __cplusplus
@@ -35,9 +37,19 @@ extern "C" {
 /* open/closes the device */
 int mpio_device_open(mpio_t *);
 int mpio_device_close(mpio_t *);  
+/* list the players of the selected transport, returns the number found */
+int mpio_device_enumerate(mpio_device_t *, int);
+/* name of the selected player usable in file names, empty if the
+ * player was not selected explicitly */
+void mpio_device_name(mpio_t *, CHAR *, int);
+/* fill devices from a ':' separated list of files (for the emulator
+ * and replay), returns the number of files */
+int mpio_device_list(CHAR *, CHAR *, mpio_device_t *, int);
 
 /* phys.<->log. block mapping */
 int   mpio_zone_init(mpio_t *, mpio_cmd_t);
+/* read the spare area and build the tables, unless already done */
+int   mpio_zone_load(mpio_t *, mpio_mem_t, mpio_callback_init_t);
 /* context, memory bank, logical block */
 /* returns address of physical block! */
 DWORD mpio_zone_block_find_log(mpio_t *, mpio_cmd_t, DWORD);
@@ -76,22 +88,51 @@ int	mpio_io_version_read(mpio_t *, CHAR *);
 /* */
 int	mpio_io_sector_read (mpio_t *, BYTE, DWORD, CHAR *);
 int	mpio_io_sector_write(mpio_t *, BYTE, DWORD, CHAR *);
+/* spare area of one block, checked by the mount cache */
+int	mpio_io_spare_sample(mpio_t *, mpio_mem_t, DWORD, CHAR *);
+/* read a range of sectors, using block transfers where possible */
+int	mpio_io_sector_range_read(mpio_t *, BYTE, DWORD, DWORD, CHAR *);
 
 /* */
 int	mpio_io_block_read  (mpio_t *, mpio_mem_t, mpio_fatentry_t *, BYTE *);
+int	mpio_io_block_read_phys(mpio_t *, mpio_mem_t, BYTE, DWORD, BYTE *);
+/* the same, but the frame is left as received, see mpio_io_frame_iov */
+int	mpio_io_block_read_frame(mpio_t *, mpio_mem_t, mpio_fatentry_t *, 
+				 CHAR *);
+int	mpio_io_block_read_phys_frame(mpio_t *, mpio_mem_t, BYTE, DWORD, 
+				      CHAR *);
 int	mpio_io_block_write (mpio_t *, mpio_mem_t, mpio_fatentry_t *, BYTE *);
 int	mpio_io_block_delete(mpio_t *, mpio_mem_t, mpio_fatentry_t *);
 /* needed for formatting of external memory */
 int	mpio_io_block_delete_phys(mpio_t *, BYTE, DWORD);
+/* write a whole block of logical sectors (the FAT area) at once */
+int	mpio_io_block_write_seq(mpio_t *, mpio_mem_t, DWORD, BYTE *);
+
+/* split block writes, frame and patch don't talk to the player */
+int	mpio_io_block_frame (mpio_t *, mpio_mem_t, BYTE *, CHAR *);
+int	mpio_io_frame_spare (mpio_t *, mpio_mem_t, CHAR *);
+/* where the data of a read (0) or write (1) frame is */
+int	mpio_io_frame_iov   (mpio_t *, mpio_mem_t, BYTE, CHAR *, int, 
+			     struct iovec *);
+int	mpio_io_block_patch (mpio_t *, mpio_mem_t, mpio_fatentry_t *, CHAR *,
+			     BYTE *, DWORD *);
+int	mpio_io_block_send  (mpio_t *, mpio_mem_t, BYTE, DWORD, CHAR *);
+int	mpio_io_block_write_frame(mpio_t *, mpio_mem_t, mpio_fatentry_t *,
+				  CHAR *);
 
 /* */
 int	mpio_io_megablock_read  (mpio_t *, mpio_mem_t, mpio_fatentry_t *, BYTE *);
+int	mpio_io_megablock_read_frame(mpio_t *, mpio_mem_t, mpio_fatentry_t *, 
+				     CHAR *);
 /* */
 int	mpio_io_megablock_write (mpio_t *, mpio_mem_t, mpio_fatentry_t *, BYTE *);
 
 /* */
 int	mpio_io_spare_read  (mpio_t *, BYTE, DWORD, WORD, BYTE, CHAR *, int,
 			     mpio_callback_init_t);
+/* the same for a single chip of the internal memory */
+int	mpio_io_spare_read_chip(mpio_t *, BYTE, BYTE, DWORD, WORD, BYTE, 
+				CHAR *, int, mpio_callback_init_t);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,390 @@
+/*
+ *  libmpio - a library for accessing Digit@lways MPIO players
+ *  Copyright (C) 2002-2004 Markus Germeier
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc.,g 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/*
+ * 
+ * host side cache of what mpio_init reads from the player
+ *
+ * Reading the spare areas of all blocks takes most of the time when
+ * a connection is opened. If a cache directory is set, a snapshot of
+ * the internal FAT, the external zone tables, boot blocks and FAT is
+ * kept there. It is used as long as a cheap fingerprint still
+ * matches: the firmware string (which includes the chip IDs), both
+ * root directories, the CIS and a few sampled spare areas.
+ *
+ * The snapshot is removed before the first write to the player and
+ * written again by mpio_sync once memory and card agree again.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mpio.h"
+#include "mount.h"
+#include "io.h"
+#include "fat.h"
+#include "directory.h"
+#include "debug.h"
+
+#define MPIO_MOUNT_MAGIC   "MPIOMNT1"
+#define MPIO_MOUNT_FILE    "mount.cache"
+#define MPIO_MOUNT_SAMPLES 8           /* spare areas checked per memory */
+
+DWORD blockaddress_decode(BYTE *);
+
+/* process-wide, only written before the players are opened */
+static CHAR *mpio_mount_dir = NULL;
+
+void
+mpio_mount_cache_set(CHAR *dir)
+{
+  if (mpio_mount_dir)
+    free(mpio_mount_dir);
+  mpio_mount_dir = NULL;
+
+  if (dir)
+    mpio_mount_dir = strdup(dir);
+}
+
+static CHAR *
+mpio_mount_path(mpio_t *m, CHAR *suffix)
+{
+  CHAR name[MPIO_DEVICE_ID * 2 + 2];
+  CHAR *path;
+
+  /* players opened with mpio_init_device have a cache of their own */
+  mpio_device_name(m, name, sizeof(name));
+
+  path = malloc(strlen(mpio_mount_dir) + strlen(MPIO_MOUNT_FILE) + 
+		strlen(name) + strlen(suffix) + 2);
+  if (path)
+    sprintf(path, "%s/%s%s%s", mpio_mount_dir, MPIO_MOUNT_FILE, name, suffix);
+
+  return path;
+}
+
+static int
+mpio_mount_get(FILE *file, void *p, size_t size)
+{
+  return (fread(p, 1, size, file) != size);
+}
+
+static int
+mpio_mount_put(FILE *file, void *p, size_t size)
+{
+  return (fwrite(p, 1, size, file) != size);
+}
+
+/* does the memory hold changes which are not on the card yet? */
+static BYTE
+mpio_mount_dirty(mpio_smartmedia_t *sm)
+{
+  DWORD i;
+
+  if ((sm->boot_dirty) || (sm->root->dirty))
+    return 1;
+
+  if ((sm->fat) && (sm->fat_dirty))
+    for (i = 0; i < sm->fat_size; i++)
+      if (sm->fat_dirty[i])
+	return 1;
+
+  return 0;
+}
+
+/* compare a few spare areas on the player with the snapshot */
+static int
+mpio_mount_sample(mpio_t *m, mpio_mem_t mem)
+{
+  mpio_smartmedia_t *sm;
+  CHAR spare[0x10];
+  DWORD block;
+  int i;
+
+  if (mem == MPIO_INTERNAL_MEM) sm = &m->internal;
+  if (mem == MPIO_EXTERNAL_MEM) sm = &m->external;
+
+  for (i = 0; i < MPIO_MOUNT_SAMPLES; i++)
+    {
+      block = (i * sm->max_blocks) / MPIO_MOUNT_SAMPLES;
+      if (mpio_io_spare_sample(m, mem, block, spare))
+	return 1;
+
+      if ((mem == MPIO_INTERNAL_MEM) && 
+	  (memcmp(spare, sm->fat + (block * 0x10), 0x10)))
+	return 1;
+
+      if ((mem == MPIO_EXTERNAL_MEM) &&
+	  (blockaddress_decode((BYTE *)spare) != 
+	   sm->zonetable[block / MPIO_ZONE_PBLOCKS][block % MPIO_ZONE_PBLOCKS]))
+	return 1;
+    }
+
+  return 0;
+}
+
+static int
+mpio_mount_load_internal(mpio_t *m, FILE *file)
+{
+  mpio_smartmedia_t *sm = &m->internal;
+  BYTE *dir;
+  int ret;
+
+  if (mpio_mount_get(file, sm->fat, sm->fat_size * SECTOR_SIZE))
+    return 1;
+
+  /* the root directory has already been read by mpio_init_internal */
+  dir = malloc(sizeof(sm->root->dir));
+  if (!dir)
+    return 1;
+  ret = (mpio_mount_get(file, dir, sizeof(sm->root->dir)) ||
+	 memcmp(dir, sm->root->dir, sizeof(sm->root->dir)));
+  free(dir);
+
+  return ret;
+}
+
+static int
+mpio_mount_load_external(mpio_t *m, FILE *file)
+{
+  mpio_smartmedia_t *sm = &m->external;
+  CHAR cis[SECTOR_SIZE];
+  BYTE valid;
+
+  if ((mpio_mount_get(file, &valid, 1)) ||
+      (mpio_mount_get(file, sm->cis, SECTOR_SIZE)) ||
+      (mpio_mount_get(file, sm->mbr, SECTOR_SIZE)) ||
+      (mpio_mount_get(file, sm->pbr, SECTOR_SIZE)) ||
+      (mpio_mount_get(file, sm->zonetable, sizeof(mpio_zonetable_t))) ||
+      (mpio_mount_get(file, sm->zonelookup, sizeof(mpio_zonelookup_t))) ||
+      (mpio_mount_get(file, sm->zonefree, sizeof(mpio_zonefree_t))) ||
+      (mpio_mount_get(file, sm->zonedups, sizeof(sm->zonedups))))
+    return 1;
+
+  /* see mpio_bootblocks_read */
+  sm->fat      = 0;
+  sm->fat_size = 0;
+  sm->fat_nums = 0;
+
+  if (valid)
+    {
+      if ((mpio_mbr_eval(sm)) || (mpio_pbr_eval(sm)))
+	return 1;
+      sm->fat = malloc(SECTOR_SIZE * sm->fat_size);
+      if ((!sm->fat) ||
+	  (mpio_mount_get(file, sm->fat, sm->fat_size * SECTOR_SIZE)) ||
+	  (mpio_mount_get(file, sm->root->dir, sizeof(sm->root->dir))))
+	return 1;
+    }
+
+  /* the zone tables are needed to find the CIS */
+  sm->zone_loaded = 1;
+  if ((mpio_io_sector_read(m, MPIO_EXTERNAL_MEM, MPIO_BLOCK_CIS, cis)) ||
+      (memcmp(cis, sm->cis, SECTOR_SIZE)))
+    return 1;
+
+  return 0;
+}
+
+int
+mpio_mount_load(mpio_t *m)
+{
+  mpio_smartmedia_t *sm;
+  CHAR *path;
+  FILE *file;
+  CHAR magic[8], version[CMD_SIZE];
+  BYTE *root = NULL;
+  int ret = 1;
+
+  if (!mpio_mount_dir)
+    return 1;
+  if (!(path = mpio_mount_path(m, "")))
+    return 1;
+  file = fopen(path, "r");
+  free(path);
+  if (!file)
+    return 1;
+
+  if ((mpio_mount_get(file, magic, sizeof(magic))) ||
+      (memcmp(magic, MPIO_MOUNT_MAGIC, sizeof(magic))) ||
+      (mpio_mount_get(file, version, CMD_SIZE)) ||
+      (memcmp(version, m->version, CMD_SIZE)))
+    goto out;
+
+  if ((m->internal.size) && 
+      ((mpio_mount_load_internal(m, file)) ||
+       (mpio_mount_sample(m, MPIO_INTERNAL_MEM))))
+    goto out;
+
+  sm = &m->external;
+  if (sm->size) 
+    {
+      if ((mpio_mount_load_external(m, file)) ||
+	  (mpio_mount_sample(m, MPIO_EXTERNAL_MEM)))
+	goto out;
+
+      /* compare the root directory with the one on the card */
+      if (sm->fat)
+	{
+	  root = malloc(sizeof(sm->root->dir));
+	  if (!root)
+	    goto out;
+	  memcpy(root, sm->root->dir, sizeof(sm->root->dir));
+	  if ((mpio_rootdir_read(m, MPIO_EXTERNAL_MEM)) ||
+	      (memcmp(root, sm->root->dir, sizeof(sm->root->dir))))
+	    goto out;
+	}
+    }
+
+  /* nothing may follow */
+  if (fgetc(file) != EOF)
+    goto out;
+
+  m->internal.fat_loaded = MPIO_FAT_CHIPS(&m->internal);
+  m->external.fat_loaded = 1;
+  if (m->internal.size)
+    mpio_fat_free_build(m, MPIO_INTERNAL_MEM);
+  if (sm->fat) 
+    {
+      mpio_fat_unpack(m, MPIO_EXTERNAL_MEM);
+      mpio_fat_free_build(m, MPIO_EXTERNAL_MEM);
+      mpio_fat_dirty_reset(m, MPIO_EXTERNAL_MEM, 0);
+    }
+
+  debugn(2, "using mount cache\n");
+  m->mount_valid = 1;
+  ret = 0;
+
+ out:
+  if ((ret) && (m->external.fat))
+    {
+      /* mpio_bootblocks_read starts from scratch */
+      free(m->external.fat);
+      m->external.fat = 0;
+    }
+  if (ret)
+    m->external.zone_loaded = 0;
+  if (root)
+    free(root);
+  fclose(file);
+
+  return ret;
+}
+
+int
+mpio_mount_save(mpio_t *m)
+{
+  mpio_smartmedia_t *sm;
+  CHAR *path, *tmp;
+  FILE *file;
+  BYTE valid;
+  int error = 0;
+
+  if (!mpio_mount_dir)
+    return 0;
+
+  /* only a complete picture is worth keeping */
+  if (((m->internal.size) && 
+       (m->internal.fat_loaded != MPIO_FAT_CHIPS(&m->internal))) ||
+      ((m->external.size) && (!m->external.fat_loaded)))
+    return 0;
+
+  if (((m->internal.size) && (mpio_mount_dirty(&m->internal))) ||
+      ((m->external.size) && (mpio_mount_dirty(&m->external))))
+    {
+      mpio_mount_invalidate(m);
+      return 0;
+    }
+
+  path = mpio_mount_path(m, "");
+  tmp  = mpio_mount_path(m, ".new");
+  if ((!path) || (!tmp) || (!(file = fopen(tmp, "w"))))
+    {
+      debugn(2, "could not write mount cache\n");
+      free(path);
+      free(tmp);
+      return 1;
+    }
+
+  error |= mpio_mount_put(file, MPIO_MOUNT_MAGIC, 8);
+  error |= mpio_mount_put(file, m->version, CMD_SIZE);
+
+  sm = &m->internal;
+  if (sm->size)
+    {
+      error |= mpio_mount_put(file, sm->fat, sm->fat_size * SECTOR_SIZE);
+      error |= mpio_mount_put(file, sm->root->dir, sizeof(sm->root->dir));
+    }
+
+  sm = &m->external;
+  if (sm->size)
+    {
+      valid = (sm->fat != 0);
+      error |= mpio_mount_put(file, &valid, 1);
+      error |= mpio_mount_put(file, sm->cis, SECTOR_SIZE);
+      error |= mpio_mount_put(file, sm->mbr, SECTOR_SIZE);
+      error |= mpio_mount_put(file, sm->pbr, SECTOR_SIZE);
+      error |= mpio_mount_put(file, sm->zonetable, sizeof(mpio_zonetable_t));
+      error |= mpio_mount_put(file, sm->zonelookup, 
+			      sizeof(mpio_zonelookup_t));
+      error |= mpio_mount_put(file, sm->zonefree, sizeof(mpio_zonefree_t));
+      error |= mpio_mount_put(file, sm->zonedups, sizeof(sm->zonedups));
+      if (valid)
+	{
+	  error |= mpio_mount_put(file, sm->fat, sm->fat_size * SECTOR_SIZE);
+	  error |= mpio_mount_put(file, sm->root->dir, sizeof(sm->root->dir));
+	}
+    }
+
+  error |= fclose(file);
+
+  if ((error) || (rename(tmp, path)))
+    {
+      debugn(2, "could not write mount cache\n");
+      unlink(tmp);
+      error = 1;
+    } else {
+      m->mount_valid = 1;
+    }
+
+  free(path);
+  free(tmp);
+
+  return error;
+}
+
+void
+mpio_mount_invalidate(mpio_t *m)
+{
+  CHAR *path;
+
+  if ((!m->mount_valid) || (!mpio_mount_dir))
+    return;
+
+  m->mount_valid = 0;
+  if ((path = mpio_mount_path(m, "")))
+    {
+      unlink(path);
+      free(path);
+    }
+}
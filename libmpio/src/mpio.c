@@ -30,10 +30,13 @@
 #include <sys/types.h>
 #include <utime.h>
 
+#include "cache.h"
 #include "cis.h"
 #include "defs.h"
 #include "debug.h"
 #include "directory.h"
+#include "pipeline.h"
+#include "mount.h"
 #include "io.h"
 #include "mpio.h"
 #include "smartmedia.h"
@@ -49,6 +52,7 @@ int mpio_file_get_real(mpio_t *, mpio_mem_t, mpio_filename_t, mpio_filename_t,
 
 int mpio_file_put_real(mpio_t *, mpio_mem_t, mpio_filename_t, mpio_filename_t,
 		       mpio_filetype_t, mpio_callback_t, CHAR *, int);
+static void mpio_put_job_stop(struct mpio_put_job_tx *);
 
 static CHAR *mpio_model_name[] = {
   "MPIO-DME",
@@ -113,9 +117,12 @@ static mpio_error_t mpio_errors[] = {
 
 static const int mpio_error_num = sizeof mpio_errors / sizeof(mpio_error_t);
 
-static int _mpio_errno = 0;
+/* last error of the calling thread */
+static __thread int _mpio_errno = 0;
+/* process-wide, only written before the players are opened */
+static BYTE mpio_preload = 0;
 
-#define MPIO_ERR_RETURN(err) { _mpio_errno = err; return -1 ; }
+#define MPIO_ERR_RETURN(err) { _mpio_errno = m->error = err; return -1 ; }
 
 #define MPIO_CHECK_FILENAME(filename) \
   if (!mpio_check_filename(filename)) { \
@@ -128,6 +135,12 @@ mpio_error_set(int err) {
   return -1;
 }
 
+int
+mpio_context_error_set(mpio_t *m, int err) {
+  _mpio_errno = m->error = err;
+  return -1;
+}
+
 void
 mpio_bail_out(void){
   printf("I'm utterly confused and aborting now, sorry!");
@@ -226,6 +239,7 @@ mpio_init_internal(mpio_t *m)
   /* Read directory from internal memory */
   sm->dir_offset=0;
   sm->root = malloc (sizeof(mpio_directory_t));
+  mpio_directory_cache_init(sm->root);
   sm->root->dentry=0;
   sm->root->name[0]    = 0;
   sm->root->next    = NULL;
@@ -317,6 +331,7 @@ mpio_init_external(mpio_t *m)
   /* setup directory support */
   sm->dir_offset=0;
   sm->root = malloc (sizeof(mpio_directory_t));
+  mpio_directory_cache_init(sm->root);
   sm->root->dentry=0;
   sm->root->name[0] = 0;
   sm->root->next    = NULL;
@@ -327,13 +342,31 @@ mpio_init_external(mpio_t *m)
   sm->recursive_directory=0;
 }
 
+void
+mpio_preload_set(BYTE preload)
+{
+  mpio_preload = preload;
+}
+
+int
+mpio_enumerate(mpio_device_t *devices, int max)
+{
+  return mpio_device_enumerate(devices, max);
+}
+
 mpio_t *
 mpio_init(mpio_callback_init_t progress_callback) 
+{
+  return mpio_init_device(NULL, progress_callback);
+}
+
+mpio_t *
+mpio_init_device(mpio_device_t *device, mpio_callback_init_t progress_callback) 
 {
   mpio_t *new_mpio;
-  mpio_smartmedia_t *sm;  
   int id_offset;
   BYTE i;
+  BYTE cached;
 
   new_mpio = malloc(sizeof(mpio_t));
   if (!new_mpio) {
@@ -342,6 +375,11 @@ mpio_init(mpio_callback_init_t progress_callback)
     return NULL;
   }  
   memset(new_mpio, 0, sizeof(mpio_t));
+  new_mpio->stats_op = -1;
+  if (device) {
+    new_mpio->device = *device;
+    new_mpio->device_set = 1;
+  }
 
   new_mpio->fd=0;
   if (mpio_device_open(new_mpio) != MPIO_OK) {
@@ -440,30 +478,24 @@ mpio_init(mpio_callback_init_t progress_callback)
   /* external init */
   mpio_init_external(new_mpio);
 
-  /* read FAT/spare area */
-  if (new_mpio->internal.size)
-    mpio_fat_read(new_mpio, MPIO_INTERNAL_MEM, progress_callback);
-  
-  /* read the spare area (for block mapping) */
-  if (new_mpio->external.size)
-    {      
-      sm = &new_mpio->external;  
-      mpio_io_spare_read(new_mpio, MPIO_EXTERNAL_MEM, 0,
-			 sm->size, 0, (CHAR *)sm->spare,
-			 (sm->max_blocks * 0x10), progress_callback);
-      mpio_zone_init(new_mpio, MPIO_EXTERNAL_MEM);
-
-      /* card might be defect */
-      if (mpio_bootblocks_read(new_mpio, MPIO_EXTERNAL_MEM)==0) 
-	{
-	  sm->fat = malloc(SECTOR_SIZE*sm->fat_size);
-	  mpio_fat_read(new_mpio, MPIO_EXTERNAL_MEM, NULL);
-	  mpio_rootdir_read(new_mpio, MPIO_EXTERNAL_MEM);
-	}
+  /* a valid mount cache saves reading the spare areas */
+  cached = !mpio_mount_load(new_mpio);
+
+  /* otherwise FAT/spare areas are read on first use, see mpio_fat_load */
+  if ((mpio_preload) && (!cached))
+    {
+      mpio_fat_load(new_mpio, MPIO_INTERNAL_MEM, progress_callback);
+      mpio_fat_load(new_mpio, MPIO_EXTERNAL_MEM, progress_callback);
     }
 
+  new_mpio->pipeline = MPIO_PIPELINE_DEPTH;
+  new_mpio->cache    = MPIO_CACHE_BLOCKS;
+
   /* set default charset for filename conversion */
-  new_mpio->charset=strdup(MPIO_CHARSET);
+  new_mpio->ic_to_unicode   = (iconv_t)(-1);
+  new_mpio->ic_from_unicode = (iconv_t)(-1);
+  if (!mpio_charset_set(new_mpio, MPIO_CHARSET))
+    new_mpio->charset=strdup(MPIO_CHARSET);
 
   return new_mpio;  
 }
@@ -511,6 +543,31 @@ mpio_close(mpio_t *m)
       free(m->internal.fat);
     if(m->external.fat)
       free(m->external.fat);
+    if(m->internal.fat_free_map)
+      free(m->internal.fat_free_map);
+    if(m->external.fat_free_map)
+      free(m->external.fat_free_map);
+    if(m->internal.fat_dirty)
+      free(m->internal.fat_dirty);
+    if(m->external.fat_dirty)
+      free(m->external.fat_dirty);
+    if(m->external.fat_table)
+      free(m->external.fat_table);
+
+    if(m->internal.root)
+      mpio_directory_cache_free(m->internal.root);
+    if(m->external.root)
+      mpio_directory_cache_free(m->external.root);
+
+    mpio_file_put_prefetch(m, MPIO_INTERNAL_MEM, NULL);
+    mpio_cache_free(m);
+
+    if(m->ic_to_unicode != (iconv_t)(-1))
+      iconv_close(m->ic_to_unicode);
+    if(m->ic_from_unicode != (iconv_t)(-1))
+      iconv_close(m->ic_from_unicode);
+    if(m->charset)
+      free(m->charset);
     
     free(m);
   }
@@ -531,6 +588,41 @@ mpio_get_model(mpio_t *m)
   return r;
 }
 
+BYTE
+mpio_pipeline_set(mpio_t *m, BYTE value)
+{
+  if (value > MPIO_PIPELINE_MAX)
+    value = MPIO_PIPELINE_MAX;
+  
+  m->pipeline = value;
+
+  return m->pipeline;
+}
+
+BYTE
+mpio_pipeline_get(mpio_t *m)
+{
+  return m->pipeline;
+}
+
+BYTE
+mpio_cache_set(mpio_t *m, BYTE value)
+{
+  if (value > MPIO_CACHE_MAX)
+    value = MPIO_CACHE_MAX;
+  
+  mpio_cache_flush(m);
+  m->cache = value;
+
+  return m->cache;
+}
+
+BYTE
+mpio_cache_get(mpio_t *m)
+{
+  return m->cache;
+}
+
 void    
 mpio_get_info(mpio_t *m, mpio_info_t *info)
 {
@@ -602,13 +694,168 @@ mpio_file_get_to_memory(mpio_t *m, mpio_mem_t mem, mpio_filename_t filename,
   return mpio_file_get_real(m, mem, filename, NULL, progress_callback, memory);
 }
 
+int
+mpio_file_read(mpio_t *m, mpio_mem_t mem, mpio_filename_t filename,
+	       DWORD offset, DWORD len, BYTE *buf)
+{
+  mpio_smartmedia_t *sm;
+  BYTE block[MEGABLOCK_SIZE];
+  BYTE *p, *data;
+  mpio_fatentry_t *f;
+  mpio_chain_t chain;
+  DWORD filesize, i, skip, toread, done = 0;
+  int block_size;
+
+  MPIO_CHECK_FILENAME(filename);
+
+  if (mem == MPIO_INTERNAL_MEM) sm = &m->internal;  
+  if (mem == MPIO_EXTERNAL_MEM) sm = &m->external;
+
+  if (!sm->size)
+    MPIO_ERR_RETURN(MPIO_ERR_MEMORY_NOT_AVAIL);
+
+  block_size = mpio_block_get_blocksize(m, mem);
+
+  p = mpio_dentry_find_name(m, mem, filename);
+  if (!p)
+    p = mpio_dentry_find_name_8_3(m, mem, filename);
+  if (!p)
+    MPIO_ERR_RETURN(MPIO_ERR_FILE_NOT_FOUND);
+  if (!mpio_dentry_is_dir(m, mem, p))
+    MPIO_ERR_RETURN(MPIO_ERR_FILE_IS_A_DIR);
+
+  filesize = mpio_dentry_get_filesize(m, mem, p);
+  if (offset >= filesize)
+    return 0;
+  if (len > (filesize - offset))
+    len = filesize - offset;
+
+  f = mpio_dentry_get_startcluster(m, mem, p);
+  if (!f)
+    MPIO_ERR_RETURN(MPIO_ERR_FILE_NOT_FOUND);
+
+  if (mpio_fat_chain_get(m, mem, f, &chain) != MPIO_OK)
+    {
+      free(f);
+      MPIO_ERR_RETURN(MPIO_ERR_FAT_ERROR);
+    }
+
+  /* only the blocks covering the range are read */
+  i    = offset / block_size;
+  skip = offset % block_size;
+  while ((done < len) && (i < chain.count))
+    {
+      mpio_fat_chain_entry(&chain, i, f);
+      
+      data = mpio_cache_block_read(m, mem, f);
+      if (!data)
+	{
+	  if (mpio_io_block_read(m, mem, f, block))
+	    break;
+	  data = block;
+	}
+
+      toread = block_size - skip;
+      if (toread > (len - done))
+	toread = len - done;
+      memcpy(buf + done, data + skip, toread);
+
+      done += toread;
+      skip  = 0;
+      i++;
+    }
+
+  if ((done < len) && (chain.defect))
+    debug("defective block encountered!\n");
+  
+  mpio_fat_chain_free(&chain);
+  free(f);
+
+  if (done < len)
+    MPIO_ERR_RETURN(MPIO_ERR_READING_FILE);
+
+  return done;
+}
+
+/* arguments of the download transfer thread */
+typedef struct {
+  mpio_t          *m;
+  mpio_mem_t       mem;
+  mpio_fatentry_t *f;
+  mpio_chain_t    *chain;
+  DWORD            filesize;
+  mpio_ring_t     *ring;
+} mpio_get_job_t;
+
+/* reads the blocks of the FAT chain and fills the ring with them */
+static void *
+mpio_file_get_thread(void *arg)
+{
+  mpio_get_job_t *job = arg;
+  BYTE *block;
+  DWORD filesize = job->filesize;
+  DWORD i;
+  int block_size, toread;
+
+  block_size = mpio_block_get_blocksize(job->m, job->mem);
+  
+  for (i = 0; (i < job->chain->count) && (filesize > 0); i++)
+    {
+      block = mpio_ring_put_begin(job->ring);
+      if (!block)
+	break;
+      
+      mpio_fat_chain_entry(job->chain, i, job->f);
+      mpio_io_block_read_frame(job->m, job->mem, job->f, (CHAR *)block);
+
+      if (filesize > block_size) {
+	toread = block_size;
+      } else {
+	toread = filesize;
+      }    
+      mpio_ring_put_end(job->ring, toread);
+      filesize -= toread;
+    }
+
+  mpio_ring_close(job->ring);
+
+  return NULL;
+}
+
+/* store a downloaded block in memory or the local file */
+static int
+mpio_file_get_store(mpio_t *m, mpio_mem_t mem, CHAR **memory, int fd, 
+		    DWORD offset, CHAR *frame, int towrite)
+{
+  struct iovec iov[MEGABLOCK_SECTORS];
+  int i, n;
+
+  /* the data goes straight from the received frame to its place */
+  n = mpio_io_frame_iov(m, mem, 0, frame, towrite, iov);
+  if (memory) 
+    {
+      for (i = 0; i < n; i++) 
+	{
+	  memcpy((*memory) + offset, iov[i].iov_base, iov[i].iov_len);
+	  offset += iov[i].iov_len;
+	}
+    } else {
+      if (writev(fd, iov, n) != towrite) {
+	debug("error writing file data\n");
+	return 1;
+      }
+    }
+
+  return 0;
+}
+
 int
 mpio_file_get_real(mpio_t *m, mpio_mem_t mem, mpio_filename_t filename,
 		   mpio_filename_t as, mpio_callback_t progress_callback,
 		   CHAR **memory)
 {
   mpio_smartmedia_t *sm;
-  BYTE block[MEGABLOCK_SIZE];
+  CHAR frame[MEGABLOCK_READ];
   int fd, towrite;
   BYTE   *p;
   mpio_fatentry_t *f = 0;
@@ -616,8 +863,13 @@ mpio_file_get_real(mpio_t *m, mpio_mem_t mem, mpio_filename_t filename,
   long mtime;
   DWORD filesize, fsize;
   BYTE abort = 0;
-  int merror;
+  DWORD i;
   int block_size;
+  mpio_chain_t chain;
+  mpio_ring_t *ring = NULL;
+  mpio_get_job_t job;
+  pthread_t thread;
+  BYTE *block_p;
 
   MPIO_CHECK_FILENAME(filename);
 
@@ -647,6 +899,12 @@ mpio_file_get_real(mpio_t *m, mpio_mem_t mem, mpio_filename_t filename,
   if (f && p) {    
     filesize=fsize=mpio_dentry_get_filesize(m, mem, p);
 
+    if (mpio_fat_chain_get(m, mem, f, &chain) != MPIO_OK)
+      {
+	free (f);
+	MPIO_ERR_RETURN(MPIO_ERR_FAT_ERROR);
+      }
+
     if (memory) {
       *memory = malloc(filesize);
     } else {
@@ -654,40 +912,89 @@ mpio_file_get_real(mpio_t *m, mpio_mem_t mem, mpio_filename_t filename,
       fd = open(as, (O_RDWR | O_CREAT), (S_IRWXU | S_IRGRP | S_IROTH));
     }
     
-    do
+    if (m->pipeline)
+      ring = mpio_ring_new(m->pipeline, MEGABLOCK_READ);
+    if (ring) 
       {
-	mpio_io_block_read(m, mem, f, block);
-
-	if (filesize > block_size) {
-	  towrite = block_size;
-	} else {
-	  towrite = filesize;
-	}    
+	job.m        = m;
+	job.mem      = mem;
+	job.f        = f;
+	job.chain    = &chain;
+	job.filesize = filesize;
+	job.ring     = ring;
+	if (pthread_create(&thread, NULL, mpio_file_get_thread, &job)) 
+	  {
+	    debug("could not start transfer thread\n");
+	    mpio_ring_free(ring);
+	    ring = NULL;
+	  }
+      }
 
-	if (memory)
+    if (ring)
+      {
+	/* the transfer thread reads ahead while we write the data */
+	while ((!abort) && (block_p = mpio_ring_get_begin(ring, &towrite)))
 	  {
-	    memcpy((*memory)+(fsize-filesize) , block, towrite);
-	  } else {
-	    if (write(fd, block, towrite) != towrite) {
-	      debug("error writing file data\n");
-	      close(fd);
-	      free (f);
-	      MPIO_ERR_RETURN(MPIO_ERR_WRITING_FILE);
-	    } 
+	    if (mpio_file_get_store(m, mem, memory, fd, fsize - filesize, 
+				    (CHAR *)block_p, towrite))
+	      {
+		mpio_ring_abort(ring, MPIO_ERR_WRITING_FILE);
+		break;
+	      }
+	    mpio_ring_get_end(ring);
+	    filesize -= towrite;
+	    
+	    if (progress_callback)
+	      abort=(*progress_callback)((fsize-filesize), fsize);
+	    if (abort) 
+	      {
+		debug("aborting operation");	
+		mpio_ring_abort(ring, 0);
+	      }
+	  }
+	pthread_join(thread, NULL);
+	if (mpio_ring_error(ring))
+	  {
+	    mpio_ring_free(ring);
+	    mpio_fat_chain_free(&chain);
+	    close(fd);
+	    free (f);
+	    MPIO_ERR_RETURN(MPIO_ERR_WRITING_FILE);
 	  }
+	mpio_ring_free(ring);
+      } else {
+	for (i = 0; (i < chain.count) && (filesize > 0) && (!abort); i++)
+	  {
+	    mpio_fat_chain_entry(&chain, i, f);
+	    mpio_io_block_read_frame(m, mem, f, frame);
+
+	    if (filesize > block_size) {
+	      towrite = block_size;
+	    } else {
+	      towrite = filesize;
+	    }    
+
+	    if (mpio_file_get_store(m, mem, memory, fd, fsize - filesize, 
+				    frame, towrite))
+	      {
+		mpio_fat_chain_free(&chain);
+		close(fd);
+		free (f);
+		MPIO_ERR_RETURN(MPIO_ERR_WRITING_FILE);
+	      } 
 	
-	filesize -= towrite;
+	    filesize -= towrite;
 	
-	if (progress_callback)
-	  abort=(*progress_callback)((fsize-filesize), fsize);
-	if (abort)
-	  debug("aborting operation");	
-
-      } while ((((merror=(mpio_fatentry_next_entry(m, mem, f)))>0) && 
-		(filesize>0)) && (!abort));
+	    if (progress_callback)
+	      abort=(*progress_callback)((fsize-filesize), fsize);
+	    if (abort)
+	      debug("aborting operation");	
+	  }
+      }
 
-    if (merror<0)
+    if (chain.defect)
       debug("defective block encountered!\n");
+    mpio_fat_chain_free(&chain);
   
     if(!memory) 
       {	
@@ -705,7 +1012,7 @@ mpio_file_get_real(mpio_t *m, mpio_mem_t mem, mpio_filename_t filename,
 
   } else {
     debugn(2, "unable to locate the file: %s\n", filename);
-    _mpio_errno=MPIO_ERR_FILE_NOT_FOUND;
+    _mpio_errno = m->error = MPIO_ERR_FILE_NOT_FOUND;
   }
 
   return (fsize-filesize);
@@ -738,6 +1045,241 @@ mpio_file_put_from_memory(mpio_t *m, mpio_mem_t mem, mpio_filename_t filename,
 			    progress_callback, memory, memory_size);
 }
 
+/* local side of an upload: reads the file and prepares the transfer
+ * frames, in a separate thread if m->pipeline is set */
+struct mpio_put_job_tx {
+  mpio_t      *m;
+  mpio_mem_t   mem;
+  CHAR         filename[INFO_LINE];
+  int          fd;
+  CHAR        *memory;
+  DWORD        fsize;
+  DWORD        left;             /* bytes not read yet */
+  BYTE         eof;              /* the last frame has been built */
+  time_t       ctime;
+  int          block_size;
+  CHAR        *frame;            /* only used without a transfer thread */
+  mpio_ring_t *ring;
+  pthread_t    thread;
+};
+typedef struct mpio_put_job_tx mpio_put_job_t;
+
+/* read the next block straight into its frame */
+static int
+mpio_put_job_read(mpio_put_job_t *job, CHAR *frame, int *len)
+{
+  struct iovec iov[MEGABLOCK_SECTORS];
+  CHAR *p;
+  int toread, i, n;
+
+  if (job->eof)
+    return 1;
+
+  if (job->left >= job->block_size) {      
+    toread = job->block_size;
+  } else {
+    toread = job->left;
+  }
+  
+  /* the end of the last block is padded */
+  if (toread < job->block_size)
+    memset(frame, 0xff, MPIO_FRAME_SIZE);
+
+  n = mpio_io_frame_iov(job->m, job->mem, 1, frame, toread, iov);
+  if (job->memory) 
+    {
+      p = job->memory + (job->fsize - job->left);
+      for (i = 0; i < n; i++) 
+	{
+	  memcpy(iov[i].iov_base, p, iov[i].iov_len);
+	  p += iov[i].iov_len;
+	}
+    } else {	
+      if (readv(job->fd, iov, n) != toread) {
+	debug("error reading file data\n");
+	return -1;
+      }
+    }
+  job->left -= toread;
+  if (!job->left)
+    job->eof = 1;
+
+  mpio_io_frame_spare(job->m, job->mem, frame);
+  *len = toread;
+
+  return 0;
+}
+
+static void *
+mpio_put_job_thread(void *arg)
+{
+  mpio_put_job_t *job = arg;
+  CHAR *frame;
+  int r, len;
+
+  while ((frame = (CHAR *)mpio_ring_put_begin(job->ring)))
+    {
+      r = mpio_put_job_read(job, frame, &len);
+      if (r < 0)
+	mpio_ring_abort(job->ring, MPIO_ERR_READING_FILE);
+      if (r)
+	break;
+      mpio_ring_put_end(job->ring, len);
+    }
+  
+  mpio_ring_close(job->ring);
+
+  return NULL;
+}
+
+static void
+mpio_put_job_stop(mpio_put_job_t *job)
+{
+  if (job->ring)
+    {
+      mpio_ring_abort(job->ring, 0);
+      pthread_join(job->thread, NULL);
+      mpio_ring_free(job->ring);
+    }
+  if (!job->memory)
+    close(job->fd);
+  free(job->frame);
+  free(job);
+}
+
+static int
+mpio_put_job_start(mpio_t *m, mpio_mem_t mem, mpio_filename_t filename,
+		   CHAR *memory, int memory_size, mpio_put_job_t **out)
+{
+  mpio_put_job_t *job;
+  struct stat file_stat;
+
+  job = malloc(sizeof(mpio_put_job_t));
+  if (!job)
+    return MPIO_ERR_OUT_OF_MEMORY;
+  memset(job, 0, sizeof(mpio_put_job_t));
+  job->m          = m;
+  job->mem        = mem;
+  job->memory     = memory;
+  job->block_size = mpio_block_get_blocksize(m, mem);
+  
+  if (memory)
+    {
+      job->fsize = memory_size;
+    } else {      
+      strncpy(job->filename, filename, INFO_LINE);
+      if (stat((const char *)job->filename, &file_stat)!=0) {
+	debug("could not find file: %s\n", job->filename);
+	free(job);
+	return MPIO_ERR_FILE_NOT_FOUND;
+      }
+      job->fsize = file_stat.st_size;
+      job->ctime = file_stat.st_ctime;
+      debugn(2, "filesize: %d\n", job->fsize);
+
+      /* open file for reading */
+      job->fd = open(job->filename, O_RDONLY);    
+      if (job->fd==-1) 
+	{
+	  debug("could not open file: %s\n", job->filename);
+	  free(job);
+	  return MPIO_ERR_FILE_NOT_FOUND;
+	}
+    }
+  job->left  = job->fsize;
+
+  if (m->pipeline)
+    {
+      job->ring = mpio_ring_new(m->pipeline, MPIO_FRAME_SIZE);
+      if ((job->ring) && 
+	  (pthread_create(&job->thread, NULL, mpio_put_job_thread, job)))
+	{
+	  debug("could not start transfer thread\n");
+	  mpio_ring_free(job->ring);
+	  job->ring = NULL;
+	}
+    }
+  if (!job->ring)
+    job->frame = malloc(MPIO_FRAME_SIZE);
+  
+  if ((!job->ring) && (!job->frame))
+    {
+      mpio_put_job_stop(job);
+      return MPIO_ERR_OUT_OF_MEMORY;
+    }
+
+  *out = job;
+  
+  return MPIO_OK;
+}
+
+/* get the next prepared frame, NULL if reading the file failed */
+static CHAR *
+mpio_put_job_next(mpio_put_job_t *job, int *len)
+{
+  if (job->ring)
+    return (CHAR *)mpio_ring_get_begin(job->ring, len);
+
+  if (mpio_put_job_read(job, job->frame, len))
+    return NULL;
+
+  return job->frame;
+}
+
+static void
+mpio_put_job_done(mpio_put_job_t *job)
+{
+  if (job->ring)
+    mpio_ring_get_end(job->ring);
+}
+
+/* close the gaps left by jobs that were used or dropped */
+static void
+mpio_file_put_prefetch_shift(mpio_t *m)
+{
+  int i, j;
+
+  for (i = 0, j = 0; i < MPIO_PREFETCH; i++)
+    if (m->prefetch[i])
+      m->prefetch[j++] = m->prefetch[i];
+  for (; j < MPIO_PREFETCH; j++)
+    m->prefetch[j] = NULL;
+}
+
+int
+mpio_file_put_prefetch(mpio_t *m, mpio_mem_t mem, mpio_filename_t filename)
+{
+  int err, i;
+  
+  /* the job of the file put next is kept, older ones are dropped */
+  for (i = 0; i < MPIO_PREFETCH; i++)
+    if ((m->prefetch[i]) && 
+	((!filename) || ((i == 0) && (m->prefetch[MPIO_PREFETCH - 1]))))
+      {
+	mpio_put_job_stop(m->prefetch[i]);
+	m->prefetch[i] = NULL;
+      }
+  mpio_file_put_prefetch_shift(m);
+  
+  /* nothing to gain without a transfer thread */
+  if ((!m->pipeline) || (!filename))
+    return MPIO_OK;
+
+  for (i = 0; (i < MPIO_PREFETCH) && (m->prefetch[i]); i++)
+    if ((m->prefetch[i]->mem == mem) &&
+	(strncmp(m->prefetch[i]->filename, filename, INFO_LINE) == 0))
+      return MPIO_OK;
+
+  err = mpio_put_job_start(m, mem, filename, NULL, 0, &m->prefetch[i]);
+  if (err)
+    {
+      m->prefetch[i] = NULL;
+      MPIO_ERR_RETURN(err);
+    }
+
+  return MPIO_OK;
+}
+
 int
 mpio_file_put_real(mpio_t *m, mpio_mem_t mem, mpio_filename_t i_filename,
 		   mpio_filename_t o_filename, mpio_filetype_t filetype,
@@ -746,13 +1288,12 @@ mpio_file_put_real(mpio_t *m, mpio_mem_t mem, mpio_filename_t i_filename,
 {
   mpio_smartmedia_t *sm;
   mpio_fatentry_t   *f, current, firstblock, backup; 
+  mpio_put_job_t    *job = NULL;
   WORD start;
-  BYTE block[MEGABLOCK_SIZE];
-  CHAR use_filename[INFO_LINE];
-  int fd, toread;
-  struct stat file_stat;
+  CHAR *frame;
+  int toread, err, i;
   struct tm tt;
-  time_t curr;
+  time_t curr, ctime;
   int block_size;
   
   BYTE *p = NULL;
@@ -773,23 +1314,32 @@ mpio_file_put_real(mpio_t *m, mpio_mem_t mem, mpio_filename_t i_filename,
 
   block_size = mpio_block_get_blocksize(m, mem);
 
-  if (memory)
-    {
-      fsize=filesize=memory_size;
-    } else {      
-	strncpy(use_filename, i_filename, INFO_LINE);
-      if (stat((const char *)use_filename, &file_stat)!=0) {
-	debug("could not find file: %s\n", use_filename);
-	MPIO_ERR_RETURN(MPIO_ERR_FILE_NOT_FOUND);
+  /* the file might already be read by mpio_file_put_prefetch */
+  for (i = 0; (!memory) && (i < MPIO_PREFETCH) && (m->prefetch[i]); i++)
+    if ((m->prefetch[i]->mem == mem) &&
+	(strncmp(m->prefetch[i]->filename, i_filename, INFO_LINE) == 0))
+      {
+	debugn(2, "using prefetched file: %s\n", i_filename);
+	job = m->prefetch[i];
+	m->prefetch[i] = NULL;
+	mpio_file_put_prefetch_shift(m);
+	break;
       }
-      fsize=filesize=file_stat.st_size;
-      debugn(2, "filesize: %d\n", fsize);
+  if (!job)
+    {
+      err = mpio_put_job_start(m, mem, i_filename, memory, memory_size, 
+			       &job);
+      if (err)
+	MPIO_ERR_RETURN(err);
     }
+  fsize = filesize = job->fsize;
+  ctime = job->ctime;
   
   /* check if there is enough space left */
   mpio_memory_free(m, mem, &free);
   if (free*1024<fsize) {
     debug("not enough space left (only %d KB)\n", free);
+    mpio_put_job_stop(job);
     MPIO_ERR_RETURN(MPIO_ERR_NOT_ENOUGH_SPACE);
   }
 
@@ -800,14 +1350,22 @@ mpio_file_put_real(mpio_t *m, mpio_mem_t mem, mpio_filename_t i_filename,
   if (p) 
     {
       debug("filename already exists\n");
+      mpio_put_job_stop(job);
       MPIO_ERR_RETURN(MPIO_ERR_FILE_EXISTS);
     }
 
-  /* find first free sector */
-  f = mpio_fatentry_find_free(m, mem, filetype);
+  /* number of blocks needed for file */
+  blocks = filesize / block_size;
+  if (filesize % block_size)
+    blocks++;      
+  debugn(2, "blocks: %02x\n", blocks);      
+
+  /* find first free sector, try to keep the file in one piece */
+  f = mpio_fatentry_find_free_run(m, mem, filetype, (blocks ? blocks : 1));
   if (!f) 
     {
       debug("could not free cluster for file!\n");
+      mpio_put_job_stop(job);
       MPIO_ERR_RETURN(MPIO_ERR_FAT_ERROR);
     } else {
       memcpy(&firstblock, f, sizeof(mpio_fatentry_t));
@@ -824,46 +1382,24 @@ mpio_file_put_real(mpio_t *m, mpio_mem_t mem, mpio_filename_t i_filename,
 	f->i_fat[0x0e] = f->i_index;	
       start         = f->i_index;
 
-      /* number of blocks needed for file */
-      blocks = filesize / block_size;
-      if (filesize % block_size)
-	blocks++;      
-      debugn(2, "blocks: %02x\n", blocks);      
       f->i_fat[0x02]=(blocks / 0x100) & 0xff;
       f->i_fat[0x03]= blocks          & 0xff;
     }  
 
-  if (!memory)
-    {      
-      /* open file for reading */
-      fd = open(use_filename, O_RDONLY);    
-      if (fd==-1) 
-	{
-	  debug("could not open file: %s\n", use_filename);
-	  MPIO_ERR_RETURN(MPIO_ERR_FILE_NOT_FOUND);
-	}
-    }
-
-  while ((filesize>block_size) && (!abort)) {
-
-    if (filesize>=block_size) {      
-      toread=block_size;
-    } else {
-      toread=filesize;
-    }
-    
-    if (memory) 
+  /* the frames are read and built by the job, here we only do the
+   * FAT bookkeeping and push them to the player */
+  while (1) {
+    frame = mpio_put_job_next(job, &toread);
+    if (!frame)
       {
-	memcpy(block, memory+(fsize-filesize), toread);
-      } else {	
-	if (read(fd, block, toread)!=toread) {
-	  debug("error reading file data\n");
-	  close(fd);
-	  MPIO_ERR_RETURN(MPIO_ERR_READING_FILE);
-	}
+	mpio_put_job_stop(job);
+	MPIO_ERR_RETURN(MPIO_ERR_READING_FILE);
       }
     filesize -= toread;
 
+    if ((!filesize) || (abort))
+      break;
+
     /* get new free block from FAT and write current block out */
     memcpy(&current, f, sizeof(mpio_fatentry_t));    
     if (!(mpio_fatentry_next_free(m, mem, f))) 
@@ -873,38 +1409,19 @@ mpio_file_put_real(mpio_t *m, mpio_mem_t mem, mpio_filename_t i_filename,
 	exit(-1);
       }    
     mpio_fatentry_set_next(m ,mem, &current, f);
-    mpio_io_block_write(m, mem, &current, block);
+    mpio_io_block_write_frame(m, mem, &current, frame);
+    mpio_put_job_done(job);
 	
     if (progress_callback)
       abort=(*progress_callback)((fsize-filesize), fsize);
   }
 
-  /* handle the last block to write */
-
-  if (filesize>=block_size) {      
-    toread=block_size;
-  } else {
-    toread=filesize;
-  }
-
-  if (memory)
-    {
-      memcpy(block, memory+(fsize-filesize), toread);
-    } else {      
-      if (read(fd, block, toread)!=toread) {
-	debug("error reading file data\n");
-	close(fd);
-	MPIO_ERR_RETURN(MPIO_ERR_READING_FILE);
-      }
-    }
-  filesize -= toread;
-  
   /* mark end of FAT chain and write last block */
   mpio_fatentry_set_eof(m ,mem, f);
-  mpio_io_block_write(m, mem, f, block);
+  mpio_io_block_write_frame(m, mem, f, frame);
+  mpio_put_job_done(job);
 
-  if (!memory)
-    close(fd);
+  mpio_put_job_stop(job);
 
   if (progress_callback)
     (*progress_callback)((fsize-filesize), fsize);
@@ -960,11 +1477,11 @@ mpio_file_put_real(mpio_t *m, mpio_mem_t mem, mpio_filename_t i_filename,
       if (memory) 
 	{
 	  time(&curr);
-	  tt = * localtime(&curr);
+	  localtime_r(&curr, &tt);
 	}
       mpio_dentry_put(m, mem,
 		      o_filename, strlen(o_filename),
-		      ((memory)?mktime(&tt):file_stat.st_ctime), 
+		      ((memory)?mktime(&tt):ctime), 
 		      fsize, start, 0x20);
     }  
 
@@ -1167,6 +1684,8 @@ mpio_memory_format(mpio_t *m, mpio_mem_t mem,
     /* ... and set internal administration accordingly */
     mpio_mbr_eval(sm);
     mpio_pbr_eval(sm);
+    sm->boot_dirty = 1;
+    sm->fat_loaded = 1;
 
     if (!sm->fat) 		/* perhaps we have to build a new FAT */
       sm->fat=malloc(sm->fat_size*SECTOR_SIZE);
@@ -1182,6 +1701,7 @@ mpio_memory_format(mpio_t *m, mpio_mem_t mem,
 
   /* this writes the FAT *and* the root directory */
   mpio_fat_write(m, mem);
+  mpio_mount_save(m);
 
   if (progress_callback)
     (*progress_callback)(sm->max_cluster+1, sm->max_cluster+1);
@@ -1195,8 +1715,9 @@ mpio_file_del(mpio_t *m, mpio_mem_t mem, mpio_filename_t filename,
 {
   BYTE *p;
   mpio_smartmedia_t *sm;
-  mpio_fatentry_t   *f, backup;
-  DWORD filesize, fsize;
+  mpio_fatentry_t   *f;
+  mpio_chain_t chain;
+  DWORD filesize, fsize, i;
   BYTE abort=0;
   int block_size;
 
@@ -1244,16 +1765,20 @@ mpio_file_del(mpio_t *m, mpio_mem_t mem, mpio_filename_t filename,
       }
 
     filesize=fsize=mpio_dentry_get_filesize(m, mem, p);    
-    do
+
+    if (mpio_fat_chain_get(m, mem, f, &chain) != MPIO_OK)
+      {
+	free(f);
+	MPIO_ERR_RETURN(MPIO_ERR_FAT_ERROR);
+      }
+
+    for (i = 0; i < chain.count; i++)
       {
+	mpio_fat_chain_entry(&chain, i, f);
 	debugn(2, "sector: %4x\n", f->entry);	    
     
 	mpio_io_block_delete(m, mem, f);
-	
-	if (filesize != fsize) 
-	  mpio_fatentry_set_free(m, mem, &backup);
-
-	memcpy(&backup, f, sizeof(mpio_fatentry_t));	
+	mpio_fatentry_set_free(m, mem, f);
 
 	if (filesize > block_size) 
 	  {
@@ -1273,10 +1798,8 @@ mpio_file_del(mpio_t *m, mpio_mem_t mem, mpio_filename_t filename,
 		(*progress_callback)((fsize-filesize), fsize);
 	      }	    
 	  }
-	
-      } while (mpio_fatentry_next_entry(m, mem, f));
-/*     mpio_io_block_delete(m, mem, &backup); */
-    mpio_fatentry_set_free(m, mem, &backup);
+      }
+    mpio_fat_chain_free(&chain);
     free(f);
   
   } else {
@@ -1305,6 +1828,7 @@ int
 mpio_sync(mpio_t *m, mpio_mem_t mem)
 {
   mpio_smartmedia_t *sm;
+  int ret;
   
   if (mem == MPIO_INTERNAL_MEM) sm = &m->internal;  
   if (mem == MPIO_EXTERNAL_MEM) sm = &m->external;
@@ -1313,7 +1837,10 @@ mpio_sync(mpio_t *m, mpio_mem_t mem)
     return 0;
 
   /* this writes the FAT *and* the root directory */
-  return mpio_fat_write(m, mem);  
+  ret = mpio_fat_write(m, mem);  
+  mpio_mount_save(m);
+
+  return ret;
 }
 
 int  
@@ -1321,7 +1848,7 @@ mpio_health(mpio_t *m, mpio_mem_t mem, mpio_health_t *r)
 {
   mpio_smartmedia_t *sm;
   int i, j, zones;
-  mpio_fatentry_t   *f;
+  mpio_fatentry_t   f;
   
   if (mem == MPIO_INTERNAL_MEM) 
     {
@@ -1332,7 +1859,7 @@ mpio_health(mpio_t *m, mpio_mem_t mem, mpio_health_t *r)
 
       r->block_size = mpio_block_get_blocksize(m, mem) / 1024;
       
-      f = mpio_fatentry_new(m, mem, 0x00, FTYPE_MUSIC);  
+      mpio_fatentry_init(m, mem, &f, 0x00, FTYPE_MUSIC);  
       
       for (i=0 ; i < sm->chips; i++) 
 	{
@@ -1342,14 +1869,12 @@ mpio_health(mpio_t *m, mpio_mem_t mem, mpio_health_t *r)
 	  /* now count the broken blocks */
 	  for(j=0; j<r->data[i].total; j++)
 	    {
-	      if (mpio_fatentry_is_defect(m, mem, f))
+	      if (mpio_fatentry_is_defect(m, mem, &f))
 		r->data[i].broken++;
-	      mpio_fatentry_plus_plus(f);
+	      mpio_fatentry_plus_plus(&f);
 	    }
 	}
       
-      free(f);
-      
       return MPIO_OK;
     }
   
@@ -1359,6 +1884,7 @@ mpio_health(mpio_t *m, mpio_mem_t mem, mpio_health_t *r)
       sm = &m->external;
       if (!sm->size)
 	return MPIO_ERR_MEMORY_NOT_AVAIL;
+      mpio_zone_load(m, mem, NULL);
 
       zones = sm->max_cluster / MPIO_ZONE_LBLOCKS + 1;
       r->num = zones;
@@ -1389,7 +1915,7 @@ mpio_health(mpio_t *m, mpio_mem_t mem, mpio_health_t *r)
 int
 mpio_memory_dump(mpio_t *m, mpio_mem_t mem)
 {
-  BYTE block[MEGABLOCK_SIZE];
+  BYTE block[MEGABLOCK_SIZE + SECTOR_SIZE];
   int i;
   mpio_fatentry_t   *f;
 
@@ -1398,6 +1924,8 @@ mpio_memory_dump(mpio_t *m, mpio_mem_t mem)
       if (!m->internal.size)
 	return 0;
 
+      if (mpio_fat_load(m, mem, NULL))
+	return 1;
       hexdump((CHAR *)m->internal.fat, m->internal.max_blocks*0x10);
       hexdump((CHAR *)m->internal.root->dir, DIR_SIZE);
       if (m->internal.version) {
@@ -1411,8 +1939,7 @@ mpio_memory_dump(mpio_t *m, mpio_mem_t mem)
 	free (f);
       } else {	
 	/* old chip */ 
-        for (i = 0 ; i<=0x100 ; i++) 
-	  mpio_io_sector_read(m, mem, i, (CHAR *)block);
+	mpio_io_sector_range_read(m, mem, 0, 0x101, (CHAR *)block);
       }      
 
     }
@@ -1422,11 +1949,12 @@ mpio_memory_dump(mpio_t *m, mpio_mem_t mem)
       if (!m->external.size)
 	return 0;
 
+      if (mpio_fat_load(m, mem, NULL))
+	return 1;
       hexdump((CHAR *)m->external.spare, m->external.max_blocks*0x10);
       hexdump((CHAR *)m->external.fat,   m->external.fat_size*SECTOR_SIZE);
       hexdump((CHAR *)m->external.root->dir, DIR_SIZE);
-      for (i = 0 ; i<=0x100 ; i++) 
-	mpio_io_sector_read(m, mem, i, (CHAR *)block);
+      mpio_io_sector_range_read(m, mem, 0, 0x101, (CHAR *)block);
     }
   
   return 0;  
@@ -1441,6 +1969,15 @@ mpio_errno(void)
   return no;
 }
 
+int
+mpio_context_errno(mpio_t *m)
+{
+  int no = m->error;
+  m->error = 0;
+  
+  return no;
+}
+
 char *
 mpio_strerror(int err)
 {
@@ -0,0 +1,161 @@
+/*
+ *  libmpio - a library for accessing Digit@lways MPIO players
+ *  Copyright (C) 2002-2004 Markus Germeier
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc.,g 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/*
+ * 
+ * ring buffer for overlapping USB transfers and local I/O
+ *
+ * mpio_file_get and mpio_file_put hand blocks between a transfer
+ * thread and the calling thread through this ring. Progress callbacks
+ * are always called from the calling thread.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pipeline.h"
+
+mpio_ring_t *
+mpio_ring_new(int slots, int size)
+{
+  mpio_ring_t *r;
+
+  r = malloc(sizeof(mpio_ring_t));
+  if (!r)
+    return NULL;
+  memset(r, 0, sizeof(mpio_ring_t));
+
+  r->data = malloc(slots * size);
+  r->len  = malloc(slots * sizeof(int));
+  if ((!r->data) || (!r->len))
+    {
+      free(r->data);
+      free(r->len);
+      free(r);
+      return NULL;
+    }
+  r->slots = slots;
+  r->size  = size;
+
+  pthread_mutex_init(&r->lock, NULL);
+  pthread_cond_init(&r->cond, NULL);
+
+  return r;
+}
+
+void
+mpio_ring_free(mpio_ring_t *r)
+{
+  if (!r)
+    return;
+
+  pthread_cond_destroy(&r->cond);
+  pthread_mutex_destroy(&r->lock);
+  free(r->data);
+  free(r->len);
+  free(r);
+}
+
+BYTE *
+mpio_ring_put_begin(mpio_ring_t *r)
+{
+  BYTE *p = NULL;
+
+  pthread_mutex_lock(&r->lock);
+  while ((r->count == r->slots) && (!r->aborted))
+    pthread_cond_wait(&r->cond, &r->lock);
+  if (!r->aborted)
+    p = r->data + (r->head * r->size);
+  pthread_mutex_unlock(&r->lock);
+
+  return p;
+}
+
+void
+mpio_ring_put_end(mpio_ring_t *r, int len)
+{
+  pthread_mutex_lock(&r->lock);
+  r->len[r->head] = len;
+  r->head = (r->head + 1) % r->slots;
+  r->count++;
+  pthread_cond_broadcast(&r->cond);
+  pthread_mutex_unlock(&r->lock);
+}
+
+void
+mpio_ring_close(mpio_ring_t *r)
+{
+  pthread_mutex_lock(&r->lock);
+  r->closed = 1;
+  pthread_cond_broadcast(&r->cond);
+  pthread_mutex_unlock(&r->lock);
+}
+
+BYTE *
+mpio_ring_get_begin(mpio_ring_t *r, int *len)
+{
+  BYTE *p = NULL;
+
+  pthread_mutex_lock(&r->lock);
+  while ((!r->count) && (!r->closed) && (!r->aborted))
+    pthread_cond_wait(&r->cond, &r->lock);
+  if ((r->count) && (!r->aborted))
+    {
+      p    = r->data + (r->tail * r->size);
+      *len = r->len[r->tail];
+    }
+  pthread_mutex_unlock(&r->lock);
+
+  return p;
+}
+
+void
+mpio_ring_get_end(mpio_ring_t *r)
+{
+  pthread_mutex_lock(&r->lock);
+  r->tail = (r->tail + 1) % r->slots;
+  r->count--;
+  pthread_cond_broadcast(&r->cond);
+  pthread_mutex_unlock(&r->lock);
+}
+
+void
+mpio_ring_abort(mpio_ring_t *r, int error)
+{
+  pthread_mutex_lock(&r->lock);
+  r->aborted = 1;
+  if ((error) && (!r->error))
+    r->error = error;
+  pthread_cond_broadcast(&r->cond);
+  pthread_mutex_unlock(&r->lock);
+}
+
+int
+mpio_ring_error(mpio_ring_t *r)
+{
+  int e;
+
+  pthread_mutex_lock(&r->lock);
+  e = r->error;
+  pthread_mutex_unlock(&r->lock);
+
+  return e;
+}
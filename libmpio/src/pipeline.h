@@ -0,0 +1,71 @@
+/*
+ *  libmpio - a library for accessing Digit@lways MPIO players
+ *  Copyright (C) 2002-2004 Markus Germeier
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc.,g 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#ifndef _MPIO_PIPELINE_H_
+#define _MPIO_PIPELINE_H_
+
+#include <pthread.h>
+
+#include "defs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* ring of block buffers shared by one producer and one consumer thread */
+typedef struct {
+  BYTE  *data;                     /* slots * size bytes */
+  int   *len;                      /* valid bytes per slot */
+  int    slots;
+  int    size;
+
+  int    head;                     /* next slot to fill */
+  int    tail;                     /* next slot to drain */
+  int    count;                    /* # of filled slots */
+
+  BYTE   closed;                   /* producer is done */
+  BYTE   aborted;                  /* stop both sides */
+  int    error;                    /* MPIO_ERR_* reported by either side */
+
+  pthread_mutex_t lock;
+  pthread_cond_t  cond;
+} mpio_ring_t;
+
+mpio_ring_t *mpio_ring_new(int, int);
+void         mpio_ring_free(mpio_ring_t *);
+
+/* producer side, returns NULL if the ring was aborted */
+BYTE *mpio_ring_put_begin(mpio_ring_t *);
+void  mpio_ring_put_end(mpio_ring_t *, int);
+void  mpio_ring_close(mpio_ring_t *);
+
+/* consumer side, returns NULL if the ring is drained or aborted */
+BYTE *mpio_ring_get_begin(mpio_ring_t *, int *);
+void  mpio_ring_get_end(mpio_ring_t *);
+
+/* stop the transfer from either side, error may be 0 */
+void  mpio_ring_abort(mpio_ring_t *, int);
+int   mpio_ring_error(mpio_ring_t *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _MPIO_PIPELINE_H_ */
@@ -0,0 +1,177 @@
+/*
+ *  libmpio - a library for accessing Digit@lways MPIO players
+ *  Copyright (C) 2002-2004 Markus Germeier
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc.,g 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/*
+ * 
+ * transfer statistics
+ *
+ * Every command packet starts a new command, all transfers up to the
+ * next one are accounted to it. The time from sending the command to
+ * the end of its last transfer goes into a log2 histogram, so slow
+ * erases can be told apart from slow transfers.
+ *
+ * This costs two gettimeofday calls per transfer and is always on.
+ *
+ */
+
+#include <string.h>
+#include <sys/time.h>
+
+#include "ecc.h"
+#include "mpio.h"
+#include "stats.h"
+
+static CHAR *mpio_stats_names[MPIO_STATS_OPS] = {
+  "GET_BLOCK",
+  "PUT_BLOCK",
+  "PUT_MEGABLOCK",
+  "DEL_BLOCK",
+  "GET_SECTOR",
+  "PUT_SECTOR",
+  "GET_SPARE_AREA",
+  "other"
+};
+
+static unsigned long long
+mpio_stats_now(void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+
+  return ((unsigned long long)tv.tv_sec * 1000000) + tv.tv_usec;
+}
+
+/* account the time of the running command */
+static void
+mpio_stats_finish(mpio_t *m)
+{
+  mpio_stats_single_t *s;
+  unsigned long long usec;
+  int i = 0;
+
+  if (m->stats_op < 0)
+    return;
+  
+  s    = &m->stats.op[m->stats_op];
+  usec = m->stats_end - m->stats_start;
+  if (m->stats_end < m->stats_start)
+    usec = 0;
+  
+  s->usec += usec;
+  while ((usec /= 2) && (i < (MPIO_STATS_BUCKETS - 1)))
+    i++;
+  s->latency[i]++;
+
+  m->stats_op = -1;
+}
+
+void
+mpio_stats_command(mpio_t *m, BYTE cmd)
+{
+  mpio_stats_finish(m);
+
+  switch(cmd)
+    {
+    case GET_BLOCK:
+      m->stats_op = MPIO_STATS_GET_BLOCK;
+      break;
+    case PUT_BLOCK:
+      m->stats_op = MPIO_STATS_PUT_BLOCK;
+      break;
+    case PUT_MEGABLOCK:
+      m->stats_op = MPIO_STATS_PUT_MEGABLOCK;
+      break;
+    case DEL_BLOCK:
+      m->stats_op = MPIO_STATS_DEL_BLOCK;
+      break;
+    case GET_SECTOR:
+      m->stats_op = MPIO_STATS_GET_SECTOR;
+      break;
+    case PUT_SECTOR:
+      m->stats_op = MPIO_STATS_PUT_SECTOR;
+      break;
+    case GET_SPARE_AREA:
+      m->stats_op = MPIO_STATS_GET_SPARE_AREA;
+      break;
+    default:
+      m->stats_op = MPIO_STATS_OTHER;
+    }
+
+  m->stats.op[m->stats_op].commands++;
+  m->stats_start = m->stats_end = mpio_stats_now();
+}
+
+void
+mpio_stats_transfer(mpio_t *m, BYTE out, int want, int got)
+{
+  mpio_stats_single_t *s;
+
+  m->stats_end = mpio_stats_now();
+
+  if (got < want)
+    {
+      if (out)
+	m->stats.short_writes++;
+      else
+	m->stats.short_reads++;
+    }
+  
+  if ((m->stats_op < 0) || (got <= 0))
+    return;
+
+  s = &m->stats.op[m->stats_op];
+  if (out)
+    s->bytes_out += got;
+  else
+    s->bytes_in  += got;
+}
+
+void
+mpio_stats_ecc(mpio_t *m, int result)
+{
+  if (result == MPIO_ECC_CORRECTED)
+    m->stats.ecc_corrected++;
+  if (result == MPIO_ECC_FAILED)
+    m->stats.ecc_failed++;
+}
+
+void
+mpio_stats_get(mpio_t *m, mpio_stats_t *stats)
+{
+  mpio_stats_finish(m);
+  memcpy(stats, &m->stats, sizeof(mpio_stats_t));
+}
+
+void
+mpio_stats_reset(mpio_t *m)
+{
+  mpio_stats_finish(m);
+  memset(&m->stats, 0, sizeof(mpio_stats_t));
+}
+
+CHAR *
+mpio_stats_name(mpio_stats_op_t op)
+{
+  if (op >= MPIO_STATS_OPS)
+    return NULL;
+  
+  return mpio_stats_names[op];
+}
@@ -0,0 +1,41 @@
+/*
+ *  libmpio - a library for accessing Digit@lways MPIO players
+ *  Copyright (C) 2002-2004 Markus Germeier
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc.,g 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#ifndef _MPIO_STATS_H_
+#define _MPIO_STATS_H_
+
+#include "defs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* a command packet is about to be sent */
+void	mpio_stats_command(mpio_t *, BYTE);
+/* a transfer of the running command is done, 1 = host -> player */
+void	mpio_stats_transfer(mpio_t *, BYTE, int, int);
+/* result of mpio_ecc_256_check */
+void	mpio_stats_ecc(mpio_t *, int);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _MPIO_STATS_H_ */
@@ -0,0 +1,286 @@
+/*
+ *  libmpio - a library for accessing Digit@lways MPIO players
+ *  Copyright (C) 2002-2004 Markus Germeier
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc.,g 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/*
+ *
+ * trace recorder and replay
+ *
+ * MPIO_TRACE=<file>   record every transfer to and from the player,
+ *                     for a player opened with mpio_init_device
+ *                     the name of the device is appended
+ * MPIO_REPLAY=<file>[:<file>]  use recorded traces instead of players
+ *
+ * A trace starts with TRACE_MAGIC, followed by one record per
+ * transfer: a mpio_trace_head_t and the bytes that were actually
+ * transferred. Everything is stored in host byte order.
+ *
+ * Replay hands out the recorded responses and checks that the
+ * library sends the same command packets and data sizes again. The
+ * first difference ends the replay, all later transfers fail. The
+ * host side state has to match the recording as well, e.g. the
+ * mount cache and mpio_preload_set.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "debug.h"
+#include "io.h"
+#include "trace.h"
+
+#define TRACE_MAGIC     "MPIOTRC1"
+#define TRACE_WRITE     'W'
+#define TRACE_READ      'R'
+
+typedef struct {
+  BYTE  type;                      /* TRACE_WRITE or TRACE_READ */
+  BYTE  pad[3];
+  DWORD want;                      /* size of the transfer */
+  int   got;                       /* result of the transfer */
+  DWORD usec;                      /* since the start of the trace */
+} mpio_trace_head_t;
+
+struct mpio_trace_tx {
+  FILE *file;
+  struct timeval start;
+  DWORD records;
+};
+
+typedef struct mpio_trace_tx mpio_trace_t;
+
+/*
+ * recorder
+ */
+int
+mpio_trace_start(mpio_t *m, CHAR *filename)
+{
+  mpio_trace_t *t;
+
+  t = malloc(sizeof(mpio_trace_t));
+  if (!t)
+    return MPIO_ERR_OUT_OF_MEMORY;
+  memset(t, 0, sizeof(mpio_trace_t));
+
+  t->file = fopen(filename, "wb");
+  if ((!t->file) || (fwrite(TRACE_MAGIC, 8, 1, t->file) != 1))
+    {
+      debug("trace: could not create %s\n", filename);
+      if (t->file)
+	fclose(t->file);
+      free(t);
+      return MPIO_ERR_WRITING_FILE;
+    }
+
+  gettimeofday(&t->start, NULL);
+  m->trace = t;
+  debugn(2, "trace: recording to %s\n", filename);
+  
+  return MPIO_OK;
+}
+
+void
+mpio_trace_record(mpio_t *m, BYTE out, CHAR *block, int want, int got)
+{
+  mpio_trace_t *t = m->trace;
+  mpio_trace_head_t h;
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+  memset(&h, 0, sizeof(h));
+  h.type = (out ? TRACE_WRITE : TRACE_READ);
+  h.want = want;
+  h.got  = got;
+  h.usec = ((now.tv_sec - t->start.tv_sec) * 1000000) + 
+    (now.tv_usec - t->start.tv_usec);
+
+  if ((fwrite(&h, sizeof(h), 1, t->file) != 1) ||
+      ((got > 0) && (fwrite(block, got, 1, t->file) != 1)))
+    {
+      debug("trace: could not write record, recording stopped\n");
+      mpio_trace_stop(m);
+      return;
+    }
+  t->records++;
+}
+
+void
+mpio_trace_stop(mpio_t *m)
+{
+  mpio_trace_t *t = m->trace;
+
+  if (!t)
+    return;
+
+  debugn(2, "trace: %d records written\n", t->records);
+  fclose(t->file);
+  free(t);
+  m->trace = NULL;
+}
+
+/*
+ * replay transport
+ */
+typedef struct {
+  FILE *file;
+  DWORD records;
+  BYTE  failed;                    /* the library left the trace */
+} mpio_replay_t;
+
+static int
+mpio_replay_enumerate(mpio_device_t *devices, int max)
+{
+  return mpio_device_list("replay", getenv(MPIO_REPLAY_ENV), devices, max);
+}
+
+static int
+mpio_replay_open(mpio_t *m)
+{
+  mpio_replay_t *r;
+  CHAR magic[8];
+  CHAR *file;
+
+  if ((!m->device_set) && 
+      (mpio_replay_enumerate(&m->device, 1) < 1))
+    return MPIO_ERR_DEVICE_NOT_READY;
+  file = m->device.device;
+
+  r = malloc(sizeof(mpio_replay_t));
+  if (!r)
+    return MPIO_ERR_OUT_OF_MEMORY;
+  memset(r, 0, sizeof(mpio_replay_t));
+
+  r->file = fopen(file, "rb");
+  if ((!r->file) || (fread(magic, 8, 1, r->file) != 1) ||
+      (memcmp(magic, TRACE_MAGIC, 8) != 0))
+    {
+      debug("replay: not a valid trace: %s\n", file);
+      if (r->file)
+	fclose(r->file);
+      free(r);
+      return MPIO_ERR_DEVICE_NOT_READY;
+    }
+
+  debugn(2, "replay: using trace %s\n", file);
+
+  m->transport_data = r;
+  m->fd = 1;
+
+  return MPIO_OK;
+}
+
+static int
+mpio_replay_close(mpio_t *m)
+{
+  mpio_replay_t *r = m->transport_data;
+
+  debugn(2, "replay: %d records used%s\n", r->records, 
+	 (r->failed ? ", trace left" : ""));
+  fclose(r->file);
+  free(r);
+  m->transport_data = NULL;
+
+  return MPIO_OK;
+}
+
+/* fetch the next record and check that it matches the transfer,
+ * the data of a read is stored in block, written command packets
+ * are compared with it */
+static int
+mpio_replay_next(mpio_t *m, BYTE type, CHAR *block, int num_bytes)
+{
+  mpio_replay_t *r = m->transport_data;
+  mpio_trace_head_t h;
+  CHAR cmd[CMD_SIZE];
+  int ok = 1;
+
+  if (r->failed)
+    return -1;
+
+  if (fread(&h, sizeof(h), 1, r->file) != 1)
+    {
+      debug("replay: end of trace after %d records\n", r->records);
+      r->failed = 1;
+      return -1;
+    }
+
+  if ((h.type != type) || (h.want != (DWORD)num_bytes) || 
+      (h.got > num_bytes))
+    {
+      debug("replay: record %d is a %c of 0x%x bytes, not a %c of 0x%x\n", 
+	    r->records, h.type, h.want, type, num_bytes);
+      r->failed = 1;
+      return -1;
+    }
+
+  if (h.got > 0)
+    {
+      if (type == TRACE_READ)
+	{
+	  ok = (fread(block, h.got, 1, r->file) == 1);
+	} else if (h.got == CMD_SIZE) {
+	  ok = (fread(cmd, CMD_SIZE, 1, r->file) == 1);
+	  if ((ok) && (memcmp(cmd, block, CMD_SIZE) != 0))
+	    {
+	      debug("replay: command of record %d differs\n", r->records);
+	      hexdump(cmd, CMD_SIZE);
+	      r->failed = 1;
+	      return -1;
+	    }
+	} else {
+	  /* data frames only have to match in size */
+	  ok = (fseek(r->file, h.got, SEEK_CUR) == 0);
+	}
+    }
+
+  if (!ok)
+    {
+      debug("replay: trace is truncated\n");
+      r->failed = 1;
+      return -1;
+    }
+
+  r->records++;
+
+  return h.got;
+}
+
+static int
+mpio_replay_write(mpio_t *m, CHAR *block, int num_bytes)
+{
+  return mpio_replay_next(m, TRACE_WRITE, block, num_bytes);
+}
+
+static int
+mpio_replay_read(mpio_t *m, CHAR *block, int num_bytes)
+{
+  return mpio_replay_next(m, TRACE_READ, block, num_bytes);
+}
+
+mpio_transport_t mpio_replay_transport = {
+  "replay",
+  mpio_replay_enumerate,
+  mpio_replay_open,
+  mpio_replay_close,
+  mpio_replay_write,
+  mpio_replay_read
+};
@@ -0,0 +1,44 @@
+/*
+ *  libmpio - a library for accessing Digit@lways MPIO players
+ *  Copyright (C) 2002-2004 Markus Germeier
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc.,g 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#ifndef _MPIO_TRACE_H_
+#define _MPIO_TRACE_H_
+
+#include "defs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* start recording all transfers to a trace file */
+int	mpio_trace_start(mpio_t *, CHAR *);
+/* called after every transfer, 1 = host -> player */
+void	mpio_trace_record(mpio_t *, BYTE, CHAR *, int, int);
+void	mpio_trace_stop(mpio_t *);
+
+/* serves the responses of a recorded trace instead of a device,
+ * used if MPIO_REPLAY_ENV points to a trace file */
+extern mpio_transport_t mpio_replay_transport;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _MPIO_TRACE_H_ */
@@ -0,0 +1,429 @@
+/*
+ *  libmpio - a library for accessing Digit@lways MPIO players
+ *  Copyright (C) 2002-2004 Markus Germeier
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc.,g 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/*
+ *
+ * libusb-1.0 transport
+ *
+ * A read is split into transfers of MPIO_USB1_CHUNK bytes which are
+ * all submitted at once. The host controller then always has the next
+ * transfer queued and the player can stream without waiting for the
+ * host between packets. Completions are handled by an event thread
+ * shared by all open players, the reading thread sleeps until its
+ * transfers are done.
+ *
+ * Command packets and data frames are written synchronously, the
+ * player does not start to answer before a command is complete.
+ *
+ */
+
+#ifdef MPIO_LIBUSB1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <libusb.h>
+
+#include "usb1.h"
+#include "debug.h"
+
+/* one queued IN transfer, a multiple of the packet size */
+#define MPIO_USB1_CHUNK  BLOCK_TRANS
+
+typedef struct {
+  libusb_device_handle *handle;
+  unsigned char in_ep;
+  unsigned char out_ep;
+} mpio_usb1_t;
+
+/* transfers of one read */
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t  done;
+  struct libusb_transfer **t;
+  int submitted;
+  int pending;
+  int cancelled;
+} mpio_usb1_read_t;
+
+static libusb_context *mpio_usb1_ctx = NULL;
+static int mpio_usb1_error = 0;
+static pthread_once_t mpio_usb1_once = PTHREAD_ONCE_INIT;
+
+/* the event thread runs while at least one player is open */
+static pthread_mutex_t mpio_usb1_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t mpio_usb1_thread;
+static int mpio_usb1_users = 0;
+static int mpio_usb1_stop = 0;
+
+static void
+mpio_usb1_init(void)
+{
+  mpio_usb1_error = libusb_init(&mpio_usb1_ctx);
+  if (mpio_usb1_error)
+    debug("libusb_init failed: %s\n", libusb_error_name(mpio_usb1_error));
+}
+
+static void *
+mpio_usb1_events(void *arg)
+{
+  struct timeval tv;
+
+  while (!__atomic_load_n(&mpio_usb1_stop, __ATOMIC_ACQUIRE))
+    {
+      /* wake up now and then to notice the stop request */
+      tv.tv_sec  = 0;
+      tv.tv_usec = 100000;
+      libusb_handle_events_timeout_completed(mpio_usb1_ctx, &tv, NULL);
+    }
+
+  return NULL;
+}
+
+static int
+mpio_usb1_events_start(void)
+{
+  int r = 0;
+
+  pthread_mutex_lock(&mpio_usb1_lock);
+  if (mpio_usb1_users == 0)
+    {
+      __atomic_store_n(&mpio_usb1_stop, 0, __ATOMIC_RELEASE);
+      r = pthread_create(&mpio_usb1_thread, NULL, mpio_usb1_events, NULL);
+    }
+  if (r == 0)
+    mpio_usb1_users++;
+  pthread_mutex_unlock(&mpio_usb1_lock);
+
+  return r;
+}
+
+static void
+mpio_usb1_events_stop(void)
+{
+  pthread_mutex_lock(&mpio_usb1_lock);
+  if (--mpio_usb1_users == 0)
+    {
+      __atomic_store_n(&mpio_usb1_stop, 1, __ATOMIC_RELEASE);
+      pthread_join(mpio_usb1_thread, NULL);
+    }
+  pthread_mutex_unlock(&mpio_usb1_lock);
+}
+
+static void
+mpio_usb1_device(mpio_device_t *d, libusb_device *dev, WORD product)
+{
+  /* the names libusb-0.1 uses on Linux */
+  snprintf(d->bus, MPIO_DEVICE_ID, "%03d", libusb_get_bus_number(dev));
+  snprintf(d->device, MPIO_DEVICE_ID, "%03d", libusb_get_device_address(dev));
+  d->product = product;
+}
+
+static int
+mpio_usb1_enumerate(mpio_device_t *devices, int max)
+{
+  struct libusb_device_descriptor desc;
+  libusb_device **list;
+  ssize_t count, i;
+  int n = 0;
+
+  pthread_once(&mpio_usb1_once, mpio_usb1_init);
+  if (mpio_usb1_error)
+    return 0;
+
+  count = libusb_get_device_list(mpio_usb1_ctx, &list);
+  if (count < 0)
+    return 0;
+
+  for (i = 0; i < count; i++)
+    if ((libusb_get_device_descriptor(list[i], &desc) == 0) &&
+	(desc.idVendor == 0x2735))
+      {
+	if (n < max)
+	  mpio_usb1_device(&devices[n], list[i], desc.idProduct);
+	n++;
+      }
+
+  libusb_free_device_list(list, 1);
+
+  return n;
+}
+
+/* find the bulk endpoints of the first interface */
+static int
+mpio_usb1_endpoints(libusb_device *dev, mpio_usb1_t *u)
+{
+  struct libusb_config_descriptor *config;
+  const struct libusb_interface_descriptor *interface;
+  const struct libusb_endpoint_descriptor *ep;
+  int i;
+
+  if (libusb_get_active_config_descriptor(dev, &config))
+    return 0;
+
+  interface = config->interface->altsetting;
+  for (i = 0 ; i < interface->bNumEndpoints; i++) {
+    ep = &interface->endpoint[i];
+    debugn(2, "USB endpoint #%d (Addr=0x%02x, Attr=0x%02x)\n", i,
+	   ep->bEndpointAddress, ep->bmAttributes);
+    if (ep->bmAttributes == LIBUSB_TRANSFER_TYPE_BULK) {
+      if (ep->bEndpointAddress & LIBUSB_ENDPOINT_IN)
+	u->in_ep = ep->bEndpointAddress;
+      else
+	u->out_ep = ep->bEndpointAddress;
+    }
+  }
+  libusb_free_config_descriptor(config);
+
+  return (u->in_ep && u->out_ep);
+}
+
+static int
+mpio_usb1_open(mpio_t *m)
+{
+  struct libusb_device_descriptor desc;
+  libusb_device **list;
+  mpio_device_t id;
+  mpio_usb1_t *u;
+  ssize_t count, i;
+  int r = MPIO_ERR_PERMISSION_DENIED;
+
+  debugn(2, "trying libusb-1.0\n");
+  pthread_once(&mpio_usb1_once, mpio_usb1_init);
+  if (mpio_usb1_error)
+    return MPIO_ERR_DEVICE_NOT_READY;
+
+  u = malloc(sizeof(mpio_usb1_t));
+  if (!u)
+    return MPIO_ERR_OUT_OF_MEMORY;
+  memset(u, 0, sizeof(mpio_usb1_t));
+
+  count = libusb_get_device_list(mpio_usb1_ctx, &list);
+  for (i = 0; i < count; i++)
+    {
+      if ((libusb_get_device_descriptor(list[i], &desc)) ||
+	  (desc.idVendor != 0x2735))
+	continue;
+      mpio_usb1_device(&id, list[i], desc.idProduct);
+      if ((m->device_set) &&
+	  ((strcmp(id.bus, m->device.bus)) ||
+	   (strcmp(id.device, m->device.device))))
+	continue;
+
+      if ((desc.idProduct != 0x01) && (desc.idProduct != 0x71))
+	debugn(2, "Found Product ID %02x, which is unknown. Proceeding anyway.\n",
+	       desc.idProduct);
+
+      if (libusb_open(list[i], &u->handle))
+	continue;
+
+      if ((libusb_claim_interface(u->handle, 0)) ||
+	  (!mpio_usb1_endpoints(list[i], u)))
+	{
+	  debugn(2, "Error claiming device or finding its bulk endpoints\n");
+	  libusb_close(u->handle);
+	  u->handle = NULL;
+	  break;
+	}
+
+      if (mpio_usb1_events_start())
+	{
+	  debug("could not start libusb event thread\n");
+	  libusb_release_interface(u->handle, 0);
+	  libusb_close(u->handle);
+	  u->handle = NULL;
+	  r = MPIO_ERR_DEVICE_NOT_READY;
+	  break;
+	}
+
+      m->device = id;
+      m->transport_data = u;
+      m->fd = 1;
+      r = MPIO_OK;
+      debugn(2, "using libusb-1.0\n");
+      break;
+    }
+  if (count >= 0)
+    libusb_free_device_list(list, 1);
+
+  if (r != MPIO_OK)
+    free(u);
+
+  return r;
+}
+
+static int
+mpio_usb1_close(mpio_t *m)
+{
+  mpio_usb1_t *u = m->transport_data;
+
+  debugn(2, "closing libusb-1.0\n");
+  libusb_release_interface(u->handle, 0);
+  libusb_close(u->handle);
+  mpio_usb1_events_stop();
+  free(u);
+  m->transport_data = NULL;
+
+  return MPIO_OK;
+}
+
+static int
+mpio_usb1_write(mpio_t *m, CHAR *block, int num_bytes)
+{
+  mpio_usb1_t *u = m->transport_data;
+  int r, done = 0;
+
+  r = libusb_bulk_transfer(u->handle, u->out_ep, (unsigned char *)block,
+			   num_bytes, &done, MPIO_USB_TIMEOUT);
+  if ((r < 0) && (!done))
+    {
+      debug("libusb returned error: %s\n", libusb_error_name(r));
+      return r;
+    }
+
+  return done;
+}
+
+/* called on the event thread */
+static void
+mpio_usb1_read_done(struct libusb_transfer *t)
+{
+  mpio_usb1_read_t *rd = t->user_data;
+  int i;
+
+  pthread_mutex_lock(&rd->lock);
+  /* the player sent less than asked for, the transfers queued behind
+   * this one would only wait for their timeout */
+  if ((!rd->cancelled) &&
+      ((t->status != LIBUSB_TRANSFER_COMPLETED) || 
+       (t->actual_length < t->length)))
+    {
+      rd->cancelled = 1;
+      for (i = 0; (i < rd->submitted) && (rd->t[i] != t); i++)
+	;
+      for (i++; i < rd->submitted; i++)
+	libusb_cancel_transfer(rd->t[i]);
+    }
+  rd->pending--;
+  pthread_cond_signal(&rd->done);
+  pthread_mutex_unlock(&rd->lock);
+}
+
+static int
+mpio_usb1_read(mpio_t *m, CHAR *block, int num_bytes)
+{
+  mpio_usb1_t *u = m->transport_data;
+  struct libusb_transfer **t;
+  mpio_usb1_read_t rd;
+  int n, i, len, got = 0, r = 0, complete = 1;
+
+  n = (num_bytes + MPIO_USB1_CHUNK - 1) / MPIO_USB1_CHUNK;
+  t = malloc(n * sizeof(struct libusb_transfer *));
+  if (!t)
+    return -1;
+
+  pthread_mutex_init(&rd.lock, NULL);
+  pthread_cond_init(&rd.done, NULL);
+  rd.t         = t;
+  rd.submitted = 0;
+  rd.pending   = 0;
+  rd.cancelled = 0;
+
+  /* queue all of them before the first one completes */
+  for (i = 0; i < n; i++)
+    {
+      len = num_bytes - (i * MPIO_USB1_CHUNK);
+      if (len > MPIO_USB1_CHUNK)
+	len = MPIO_USB1_CHUNK;
+
+      t[i] = libusb_alloc_transfer(0);
+      if (!t[i])
+	{
+	  r = -1;
+	  break;
+	}
+      libusb_fill_bulk_transfer(t[i], u->handle, u->in_ep,
+				(unsigned char *)block + (i * MPIO_USB1_CHUNK),
+				len, mpio_usb1_read_done, &rd,
+				MPIO_USB_TIMEOUT);
+
+      pthread_mutex_lock(&rd.lock);
+      r = (rd.cancelled ? -1 : libusb_submit_transfer(t[i]));
+      if (r == 0)
+	{
+	  rd.submitted++;
+	  rd.pending++;
+	}
+      pthread_mutex_unlock(&rd.lock);
+      if (r)
+	{
+	  if (!rd.cancelled)
+	    debug("libusb returned error: %s\n", libusb_error_name(r));
+	  libusb_free_transfer(t[i]);
+	  break;
+	}
+    }
+  n = i;
+
+  pthread_mutex_lock(&rd.lock);
+  while (rd.pending)
+    pthread_cond_wait(&rd.done, &rd.lock);
+  pthread_mutex_unlock(&rd.lock);
+
+  /* only the data up to the first short transfer is in place,
+   * whatever followed it landed at the wrong offset */
+  for (i = 0; i < n; i++)
+    {
+      if (complete)
+	{
+	  got += t[i]->actual_length;
+	  if ((t[i]->status != LIBUSB_TRANSFER_COMPLETED) ||
+	      (t[i]->actual_length < t[i]->length))
+	    {
+	      if ((t[i]->status != LIBUSB_TRANSFER_COMPLETED) &&
+		  (t[i]->status != LIBUSB_TRANSFER_CANCELLED))
+		debug("libusb transfer failed: status %d\n", t[i]->status);
+	      complete = 0;
+	    }
+	}
+      libusb_free_transfer(t[i]);
+    }
+  free(t);
+
+  pthread_cond_destroy(&rd.done);
+  pthread_mutex_destroy(&rd.lock);
+
+  if ((got == 0) && (r < 0) && (!rd.cancelled))
+    return r;
+
+  return got;
+}
+
+mpio_transport_t mpio_usb1_transport = {
+  "libusb-1.0",
+  mpio_usb1_enumerate,
+  mpio_usb1_open,
+  mpio_usb1_close,
+  mpio_usb1_write,
+  mpio_usb1_read
+};
+
+#endif /* MPIO_LIBUSB1 */
@@ -470,11 +470,25 @@ mpiosh_callback_put(int read, int total)
 /*   printf("\n"); */
 /* } */
 
+/* index of the next regular file matching regex, size if none */
+static int
+mpiosh_mput_next(struct dirent **dentry, int j, int size, regex_t *regex)
+{
+  struct stat st;
+  
+  for (; j < size; j++) 
+    if ((stat(dentry[j]->d_name, &st) == 0) && (S_ISREG(st.st_mode)) &&
+	(!regexec(regex, dentry[j]->d_name, 0, NULL, 0)))
+      break;
+  
+  return j;
+}
+
 void
 mpiosh_cmd_mput(char *args[])
 {
   char			dir_buf[NAME_MAX];
-  int			size, j, i = 0, error, written = 0;
+  int			size, j, k, i = 0, error, written = 0;
   struct dirent **	dentry, **run;
   struct stat		st;
   regex_t	        regex;
@@ -505,6 +519,11 @@ mpiosh_cmd_mput(char *args[])
 	  }
 	  
 	  if (!(error = regexec(&regex, (*run)->d_name, 0, NULL, 0))) {
+	    /* let the library read the next file while this one is sent */
+	    k = mpiosh_mput_next(dentry, j + 1, size, &regex);
+	    mpio_file_put_prefetch(mpiosh.dev, mpiosh.card, 
+				   ((k < size) ? dentry[k]->d_name : NULL));
+
 	    printf("putting '%s' ... \n", (*run)->d_name);
 	    if (mpio_file_put(mpiosh.dev, mpiosh.card, (*run)->d_name, 
 			      FTYPE_MUSIC, mpiosh_callback_put) == -1) {
@@ -530,6 +549,7 @@ mpiosh_cmd_mput(char *args[])
     i++;
   }
   regfree(&regex);
+  mpio_file_put_prefetch(mpiosh.dev, mpiosh.card, NULL);
   if (mpiosh_cancel) 
     debug("operation cancelled by user\n");
 
@@ -883,6 +903,62 @@ mpiosh_cmd_health(char *args[])
   
 }
 
+void
+mpiosh_cmd_stats(char *args[])
+{
+  mpio_stats_t stats;
+  mpio_stats_single_t *s;
+  unsigned long from;
+  int i, j;
+  
+  MPIOSH_CHECK_CONNECTION_CLOSED;
+
+  if (args[0] != NULL) {
+    if (!strcmp(args[0], "reset")) {
+      mpio_stats_reset(mpiosh.dev);
+      printf("transfer statistics are reset\n");
+    } else {
+      printf("unknown argument '%s'\n", args[0]);
+    }
+    return;
+  }
+  
+  mpio_stats_get(mpiosh.dev, &stats);
+
+  printf("command          count     KB out      KB in   avg usec\n");
+  printf("=======================================================\n");
+  for (i = 0; i < MPIO_STATS_OPS; i++) {
+    s = &stats.op[i];
+    if (!s->commands)
+      continue;
+    printf("%-14s %7u %10llu %10llu %10llu\n", mpio_stats_name(i), 
+	   s->commands, (s->bytes_out / 1024), (s->bytes_in / 1024),
+	   (s->usec / s->commands));
+  }
+  printf("\nshort reads: %u  short writes: %u\n", 
+	 stats.short_reads, stats.short_writes);
+  printf("ECC errors corrected: %u  uncorrectable: %u\n", 
+	 stats.ecc_corrected, stats.ecc_failed);
+
+  for (i = 0; i < MPIO_STATS_OPS; i++) {
+    s = &stats.op[i];
+    if (!s->commands)
+      continue;
+    printf("\nlatency of %s:\n", mpio_stats_name(i));
+    for (j = 0; j < MPIO_STATS_BUCKETS; j++) {
+      if (!s->latency[j])
+	continue;
+      from = (j ? (1UL << j) : 0);
+      if (j == (MPIO_STATS_BUCKETS - 1)) {
+	printf("  >= %8lu usec: %7u\n", from, s->latency[j]);
+      } else {
+	printf("  %8lu - %8lu usec: %7u\n", from, (1UL << (j + 1)) - 1,
+	       s->latency[j]);
+      }
+    }
+  }
+}
+
 void
 mpiosh_cmd_backup(char *args[])
 {
@@ -50,6 +50,7 @@ void mpiosh_cmd_switch(char *args[]);
 void mpiosh_cmd_rename(char *args[]);
 void mpiosh_cmd_dump_mem(char *args[]);
 void mpiosh_cmd_health(char *args[]);
+void mpiosh_cmd_stats(char *args[]);
 void mpiosh_cmd_backup(char *args[]);
 void mpiosh_cmd_restore(char *args[]);
 #if 0
@@ -123,6 +123,10 @@ struct mpiosh_cmd_t commands[] = {
   { "health", NULL, NULL,
     "  show the health status from the selected memory",
     mpiosh_cmd_health, NULL },
+  { "stats", NULL, "[reset]",
+    "  show the transfer statistics of this connection, 'reset'\n"
+    "  clears them",
+    mpiosh_cmd_stats, NULL },
   { "font_upload", NULL, "[<fontfile>]",
     "  upload the give fontfile to the internal memory",
     mpiosh_cmd_font_upload, NULL },
@@ -38,6 +38,8 @@
 void
 mpiosh_init(void)
 {
+  char *path;
+
   /* set state */
   mpiosh.dev = NULL;
   mpiosh.config = NULL;
@@ -54,6 +56,13 @@ mpiosh_init(void)
   else
     mpiosh.prompt = mpiosh.config->prompt_int;
 
+  /* keep the mount cache of the library next to the backups */
+  path = mpiosh_config_check_backup_dir(mpiosh.config, TRUE);
+  if (path) {
+    mpio_mount_cache_set(path);
+    free(path);
+  }
+
   /* inital mpio library */
   mpiosh.dev = mpio_init(mpiosh_callback_init);
 
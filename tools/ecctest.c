@@ -0,0 +1,277 @@
+/*
+ *  libmpio - a library for accessing Digit@lways MPIO players
+ *  Copyright (C) 2002-2004 Markus Germeier
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc.,g 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/*
+ *
+ * ecctest - differential test and benchmark of the ECC kernels
+ *
+ * Every kernel of mpio_ecc_256_gen is compared with the original bit
+ * by bit implementation, which is kept here as the reference: every
+ * byte value at every position on zero, 0xff and random backgrounds,
+ * plus a number of random blocks. Afterwards the throughput of the
+ * reference and of every kernel is reported.
+ *
+ * usage: ecctest [random blocks] [MB for the benchmark]
+ *
+ * Built with cmake -DECCTEST=ON, use -DCMAKE_BUILD_TYPE=Release for
+ * meaningful numbers. The exit code is 1 if any ECC differs.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "src/ecc.h"
+
+#define GET_BIT(d, o) (((d) >> (o)) & 0x01 )
+#define XOR_BITS(d, x1, x2, x3, x4) (GET_BIT((d), (x1)) ^ \
+                                     GET_BIT((d), (x2)) ^ \
+                                     GET_BIT((d), (x3)) ^ \
+                                     GET_BIT((d), (x4)))
+#define ADD_BITS(c, d1, d2, v) if ((c)) d1 ^= (v); else d2 ^= (v)
+
+/* mpio_ecc_256_gen as it was before the table and SIMD kernels */
+static int
+ecctest_reference(CHAR *data, CHAR *ecc)
+{
+  CHAR p1, p1_;
+  CHAR p2, p2_;
+  CHAR p4, p4_;
+
+  CHAR p08, p08_;
+  CHAR p16, p16_;
+  CHAR p32, p32_;
+  CHAR p64, p64_;
+
+  CHAR p0128, p0128_;
+  CHAR p0256, p0256_;
+  CHAR p0512, p0512_;
+  CHAR p1024, p1024_;
+
+  int i, j;
+
+  /* init */
+  p1=p1_=0;
+  p2=p2_=0;
+  p4=p4_=0;
+
+  p08=p08_=0;
+  p16=p16_=0;
+  p32=p32_=0;
+  p64=p64_=0;
+
+  p0128=p0128_=0;
+  p0256=p0256_=0;
+  p0512=p0512_=0;
+  p1024=p1024_=0;
+
+  /* vertical */
+  for (i=0; i<256; i++) {
+    /* p1, p1_ */
+    p1 ^= XOR_BITS(data[i], 7, 5, 3, 1);
+    p1_^= XOR_BITS(data[i], 6, 4, 2, 0);
+
+    /* p2, p2_ */
+    p2 ^= XOR_BITS(data[i], 7, 6, 3, 2);
+    p2_^= XOR_BITS(data[i], 5, 4, 1, 0);
+
+    /* p4, p4_ */
+    p4 ^= XOR_BITS(data[i], 7, 6, 5, 4);
+    p4_^= XOR_BITS(data[i], 3, 2, 1, 0);
+  }
+
+  /* horizontal */
+  for (i=0; i<8; i++) {
+    for (j=0; j<256; j++) {
+      /* p08, p08_ */
+      ADD_BITS(GET_BIT(j, 0), p08, p08_, GET_BIT(data[j], i));
+
+      /* p16, p16_ */
+      ADD_BITS(GET_BIT(j, 1), p16, p16_, GET_BIT(data[j], i));
+
+      /* p32, p32_ */
+      ADD_BITS(GET_BIT(j, 2), p32, p32_, GET_BIT(data[j], i));
+
+      /* p64, p64_ */
+      ADD_BITS(GET_BIT(j, 3), p64, p64_, GET_BIT(data[j], i));
+
+      /* p0128, p0128_ */
+      ADD_BITS(GET_BIT(j, 4), p0128, p0128_, GET_BIT(data[j], i));
+
+      /* p0256, p0256_ */
+      ADD_BITS(GET_BIT(j, 5), p0256, p0256_, GET_BIT(data[j], i));
+
+      /* p0512, p0512_ */
+      ADD_BITS(GET_BIT(j, 6), p0512, p0512_, GET_BIT(data[j], i));
+
+      /* p1024, p1024_ */
+      ADD_BITS(GET_BIT(j, 7), p1024, p1024_, GET_BIT(data[j], i));
+    }
+  }
+
+  /* calculate actual ECC */
+  ecc[0]=~((p64 << 7) | (p64_ << 6) |
+	   (p32 << 5) | (p32_ << 4) |
+	   (p16 << 3) | (p16_ << 2) |
+	   (p08 << 1) | (p08_ << 0));
+
+  ecc[1]=~((p1024 << 7) | (p1024_ << 6) |
+	   (p0512 << 5) | (p0512_ << 4) |
+	   (p0256 << 3) | (p0256_ << 2) |
+	   (p0128 << 1) | (p0128_ << 0));
+
+  ecc[2]=~((p4 << 7) | (p4_ << 6) |
+	   (p2 << 5) | (p2_ << 4) |
+	   (p1 << 3) | (p1_ << 2));
+
+  return 0;
+}
+
+typedef int (*ecctest_gen_t)(CHAR *, CHAR *);
+
+static const char *ecctest_kernels[] = { "table", "sse2", "avx2" };
+
+static int
+ecctest_compare(CHAR *data)
+{
+  CHAR ref[3], own[3];
+
+  ecctest_reference(data, ref);
+  mpio_ecc_256_gen(data, own);
+
+  return memcmp(ref, own, 3) != 0;
+}
+
+/* returns the number of blocks with a different ECC */
+static long
+ecctest_check(long blocks)
+{
+  CHAR data[256];
+  long errors = 0, n;
+  int b, i, v;
+
+  /* every byte value at every position on three backgrounds */
+  for (b = 0; b < 3; b++)
+    for (i = 0; i < 256; i++)
+      for (v = 0; v < 256; v++)
+	{
+	  if (b == 2)
+	    {
+	      srand((i << 8) | v);
+	      for (n = 0; n < 256; n++)
+		data[n] = rand();
+	    } else {
+	      memset(data, (b ? 0xff : 0x00), 256);
+	    }
+	  data[i] = v;
+	  errors += ecctest_compare(data);
+	}
+
+  srand(1);
+  for (n = 0; n < blocks; n++)
+    {
+      for (i = 0; i < 256; i++)
+	data[i] = rand();
+      errors += ecctest_compare(data);
+    }
+
+  return errors;
+}
+
+static double
+ecctest_now(void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+
+  return tv.tv_sec + (tv.tv_usec / 1000000.0);
+}
+
+/* GB/s of the given implementation over size bytes */
+static double
+ecctest_bench(ecctest_gen_t gen, CHAR *buffer, long size)
+{
+  CHAR ecc[3];
+  double start;
+  long i;
+  int sum = 0;
+
+  start = ecctest_now();
+  for (i = 0; i < size; i += 256)
+    {
+      (*gen)(buffer + (i & 0xfffff), ecc);
+      sum += ecc[0];
+    }
+
+  /* keep the compiler from dropping the loop */
+  if (sum == 1)
+    printf(" ");
+
+  return (size / (ecctest_now() - start)) / 1e9;
+}
+
+int
+main(int argc, char *argv[])
+{
+  CHAR *buffer;
+  long blocks = 200000, size = 256;
+  long errors, total = 0;
+  int k, i;
+
+  if (argc > 1)
+    blocks = strtol(argv[1], NULL, 10);
+  if (argc > 2)
+    size = strtol(argv[2], NULL, 10);
+  size *= 1024 * 1024;
+
+  buffer = malloc(0x100000 + 256);
+  if (!buffer)
+    return 2;
+  srand(2);
+  for (i = 0; i < 0x100000 + 256; i++)
+    buffer[i] = rand();
+
+  for (k = MPIO_ECC_KERNEL_TABLE; k <= MPIO_ECC_KERNEL_AVX2; k++)
+    {
+      if (mpio_ecc_256_kernel_set(k))
+	{
+	  printf("%-9s not available\n", ecctest_kernels[k]);
+	  continue;
+	}
+      errors = ecctest_check(blocks);
+      total += errors;
+      printf("%-9s %ld differences\n", ecctest_kernels[k], errors);
+    }
+
+  /* the reference is slow, it gets a smaller share */
+  printf("%-9s %.2f GB/s\n", "reference",
+	 ecctest_bench(ecctest_reference, buffer, size / 16));
+  for (k = MPIO_ECC_KERNEL_TABLE; k <= MPIO_ECC_KERNEL_AVX2; k++)
+    if (!mpio_ecc_256_kernel_set(k))
+      printf("%-9s %.2f GB/s\n", ecctest_kernels[k],
+	     ecctest_bench(mpio_ecc_256_gen, buffer, size));
+
+  free(buffer);
+
+  return (total != 0);
+}
@@ -0,0 +1,176 @@
+/*
+ *  libmpio - a library for accessing Digit@lways MPIO players
+ *  Copyright (C) 2002-2004 Markus Germeier
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc.,g 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/*
+ *
+ * emubench - throughput and latency of get and put on the NAND emulator
+ *
+ * For both memories of a fresh emulator image a large file is put and
+ * read back (throughput), then small files are put and read back one
+ * after the other (latency per file). Everything read is compared with
+ * what was written.
+ *
+ * usage: emubench [MB] [small files]
+ *
+ * The emulator is set up through its environment variables, e.g.
+ * MPIO_EMULATOR_LATENCY and MPIO_EMULATOR_BANDWIDTH to model a real
+ * player, see libmpio/src/emulator.c. Built with cmake -DEMUBENCH=ON.
+ * The exit code is 1 if any file differs.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "mpio.h"
+
+#define EMUBENCH_SMALL 4096          /* size of the small files */
+
+static const char *emubench_mems[] = { "internal", "external" };
+
+static double
+emubench_now(void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+
+  return tv.tv_sec + (tv.tv_usec / 1000000.0);
+}
+
+static void
+emubench_fill(CHAR *data, int size, int seed)
+{
+  int i;
+
+  for (i = 0; i < size; i++)
+    data[i] = (i * 13 + seed * 5 + (i >> 11)) & 0xff;
+}
+
+/* put and get one file, returns 0 if it came back unchanged */
+static int
+emubench_file(mpio_t *m, mpio_mem_t mem, char *name, CHAR *data, int size,
+	      double *put, double *get)
+{
+  CHAR *got = NULL;
+  double start;
+  int r;
+
+  start = emubench_now();
+  r = mpio_file_put_from_memory(m, mem, name, FTYPE_MUSIC, NULL,
+				data, size);
+  *put += emubench_now() - start;
+  if (r != size)
+    return -1;
+
+  start = emubench_now();
+  r = mpio_file_get_to_memory(m, mem, name, NULL, &got);
+  *get += emubench_now() - start;
+
+  r = ((r != size) || (!got) || (memcmp(data, got, size)));
+  free(got);
+
+  return r;
+}
+
+static int
+emubench_run(mpio_t *m, mpio_mem_t mem, int size, int small)
+{
+  mpio_filename_t name;
+  CHAR *data;
+  double put = 0, get = 0;
+  int errors = 0, i;
+
+  data = malloc(size);
+  if (!data)
+    return 1;
+
+  emubench_fill(data, size, 0);
+  snprintf(name, sizeof(name), "BENCH.MP3");
+  errors += (emubench_file(m, mem, name, data, size, &put, &get) != 0);
+  printf("%-8s put %7.2f MB/s  get %7.2f MB/s  (%d KB)\n",
+	 emubench_mems[mem != MPIO_INTERNAL_MEM],
+	 (size / put) / (1024 * 1024), (size / get) / (1024 * 1024),
+	 size / 1024);
+  mpio_file_del(m, mem, name, NULL);
+
+  put = get = 0;
+  for (i = 0; i < small; i++)
+    {
+      emubench_fill(data, EMUBENCH_SMALL, i + 1);
+      snprintf(name, sizeof(name), "S%04d.MP3", i);
+      errors += (emubench_file(m, mem, name, data, EMUBENCH_SMALL,
+			       &put, &get) != 0);
+    }
+  if (small)
+    printf("%-8s put %7.2f ms/file get %7.2f ms/file (%d files of %d KB)\n",
+	   emubench_mems[mem != MPIO_INTERNAL_MEM], (put * 1000) / small,
+	   (get * 1000) / small, small, EMUBENCH_SMALL / 1024);
+
+  if (errors)
+    printf("%-8s %d files differ\n", emubench_mems[mem != MPIO_INTERNAL_MEM],
+	   errors);
+
+  free(data);
+
+  return errors;
+}
+
+int
+main(int argc, char *argv[])
+{
+  char image[256];
+  mpio_t *m;
+  mpio_mem_t mem;
+  int size = 8, small = 32;
+  int k, errors = 0;
+
+  if (argc > 1)
+    size = strtol(argv[1], NULL, 10);
+  if (argc > 2)
+    small = strtol(argv[2], NULL, 10);
+  size *= 1024 * 1024;
+
+  snprintf(image, sizeof(image), "/tmp/emubench-%d.img", (int)getpid());
+  setenv("MPIO_EMULATOR", image, 1);
+  unlink(image);
+
+  m = mpio_init(NULL);
+  if (!m)
+    {
+      printf("could not open the emulator image %s\n", image);
+      return 1;
+    }
+
+  for (k = 0; k < 2; k++)
+    {
+      mem = (k ? MPIO_EXTERNAL_MEM : MPIO_INTERNAL_MEM);
+      mpio_memory_format(m, mem, NULL);
+      errors += emubench_run(m, mem, size, small);
+    }
+
+  mpio_close(m);
+  unlink(image);
+
+  return (errors != 0);
+}
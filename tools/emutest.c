@@ -0,0 +1,272 @@
+/*
+ *  libmpio - a library for accessing Digit@lways MPIO players
+ *  Copyright (C) 2002-2004 Markus Germeier
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc.,g 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/*
+ *
+ * emutest - regression tests of libmpio against the NAND emulator
+ *
+ * Every test formats both memories of a fresh emulator image, works
+ * on them through the library and reads everything back.
+ *
+ * usage: emutest [image]
+ *
+ * Built with cmake -DEMUTEST=ON and run by ctest. The image defaults
+ * to a file in /tmp and is removed afterwards. The exit code is 1 if
+ * any test fails.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mpio.h"
+#include "src/directory.h"
+
+static const char *emutest_mems[] = { "internal", "external" };
+
+/* contents of a test file, different for every seed */
+static void
+emutest_fill(CHAR *data, int size, int seed)
+{
+  int i;
+
+  for (i = 0; i < size; i++)
+    data[i] = (i * 31 + seed * 7 + (i >> 9)) & 0xff;
+}
+
+static int
+emutest_put(mpio_t *m, mpio_mem_t mem, char *name, int size, int seed)
+{
+  CHAR *data;
+  int r;
+
+  data = malloc(size);
+  if (!data)
+    return -1;
+  emutest_fill(data, size, seed);
+  r = mpio_file_put_from_memory(m, mem, name, FTYPE_MUSIC, NULL,
+				data, size);
+  free(data);
+
+  return (r == size ? 0 : -1);
+}
+
+/* returns 0 if the file on the player has the expected contents */
+static int
+emutest_check(mpio_t *m, mpio_mem_t mem, char *name, int size, int seed)
+{
+  CHAR *data, *got = NULL;
+  int r;
+
+  data = malloc(size);
+  if (!data)
+    return -1;
+  emutest_fill(data, size, seed);
+  r = mpio_file_get_to_memory(m, mem, name, NULL, &got);
+  if ((r != size) || (!got) || (memcmp(data, got, size)))
+    {
+      printf("  %s: %s differs\n", emutest_mems[mem != MPIO_INTERNAL_MEM],
+	     name);
+      r = -1;
+    } else {
+      r = 0;
+    }
+  free(got);
+  free(data);
+
+  return r;
+}
+
+/*
+ * fill the memory with files of 20 blocks, delete every other one and
+ * put two files of 10 blocks and one of 30, which has to be fragmented
+ */
+static int
+emutest_fragment(mpio_t *m, mpio_mem_t mem)
+{
+  mpio_filename_t name;
+  int block, files, errors = 0, i;
+  DWORD free;
+
+  block = mpio_block_get_blocksize(m, mem);
+
+  for (files = 0; ; files++)
+    {
+      mpio_memory_free(m, mem, &free);
+      if (free * 1024 < (DWORD)(block * 21))
+	break;
+      snprintf(name, sizeof(name), "F%03d.MP3", files);
+      if (emutest_put(m, mem, name, block * 20, files))
+	{
+	  printf("  put of %s failed\n", name);
+	  return 1;
+	}
+    }
+
+  for (i = 1; i < files; i += 2)
+    {
+      snprintf(name, sizeof(name), "F%03d.MP3", i);
+      mpio_file_del(m, mem, name, NULL);
+    }
+
+  if ((emutest_put(m, mem, "A.MP3", block * 10, 1000)) ||
+      (emutest_put(m, mem, "B.MP3", block * 10, 1001)) ||
+      (emutest_put(m, mem, "C.MP3", block * 30, 1002)))
+    {
+      printf("  put into the gaps failed\n");
+      return 1;
+    }
+
+  for (i = 0; i < files; i += 2)
+    {
+      snprintf(name, sizeof(name), "F%03d.MP3", i);
+      errors += (emutest_check(m, mem, name, block * 20, i) != 0);
+    }
+  errors += (emutest_check(m, mem, "A.MP3", block * 10, 1000) != 0);
+  errors += (emutest_check(m, mem, "B.MP3", block * 10, 1001) != 0);
+  errors += (emutest_check(m, mem, "C.MP3", block * 30, 1002) != 0);
+
+  return errors;
+}
+
+/*
+ * the start cluster of files with long names from the cache of parsed
+ * dentries has to match the 8.3 dentry on the media
+ */
+static int
+emutest_dentry(mpio_t *m, mpio_mem_t mem)
+{
+  static char *names[] = {
+    "SHORT.MP3",
+    "a long name.mp3",
+    "a name that needs three or more VFAT slots for itself.mp3",
+    "ANOTHER.MP3",
+    "the last file with a fairly long name as well.mp3",
+    NULL
+  };
+  mpio_smartmedia_t *sm;
+  mpio_dir_entry_t *dentry;
+  mpio_fatentry_t *f, *g;
+  mpio_filename_t name;
+  BYTE *p;
+  WORD start;
+  int block, errors = 0, i;
+
+  sm = (mem == MPIO_INTERNAL_MEM ? &m->internal : &m->external);
+  block = mpio_block_get_blocksize(m, mem);
+
+  for (i = 0; names[i]; i++)
+    if (emutest_put(m, mem, names[i], block * 2 + 100, i))
+      {
+	printf("  put of %s failed\n", names[i]);
+	return 1;
+      }
+
+  for (i = 0; names[i]; i++)
+    {
+      snprintf(name, sizeof(name), "%s", names[i]);
+      p = mpio_file_exists(m, mem, name);
+      if ((!p) || (sm->cdir->cache_num < 0))
+	{
+	  printf("  %s not found in the dentry cache\n", name);
+	  errors++;
+	  continue;
+	}
+      dentry = (mpio_dir_entry_t *)(p + mpio_dentry_get_size(m, mem, p)
+				    - DIR_ENTRY_SIZE);
+      start  = dentry->start[1] * 0x100 + dentry->start[0];
+
+      f = mpio_dentry_get_startcluster(m, mem, p);
+      /* the same dentry parsed again without the cache */
+      mpio_directory_cache_invalidate(sm->cdir);
+      g = mpio_dentry_get_startcluster(m, mem, p);
+
+      if ((!f) || (!g) ||
+	  ((mem == MPIO_INTERNAL_MEM) && (f->i_index != (start & 0xff))) ||
+	  ((mem == MPIO_EXTERNAL_MEM) && (f->entry != start)) ||
+	  (f->entry != g->entry) || (f->hw_address != g->hw_address))
+	{
+	  printf("  %s: start cluster differs from the dentry\n", name);
+	  errors++;
+	}
+      free(f);
+      free(g);
+
+      errors += (emutest_check(m, mem, name, block * 2 + 100, i) != 0);
+    }
+
+  return errors;
+}
+
+typedef int (*emutest_t)(mpio_t *, mpio_mem_t);
+
+static struct {
+  const char *name;
+  emutest_t   test;
+} emutest_tests[] = {
+  { "fragment", emutest_fragment },
+  { "dentry",   emutest_dentry },
+  { NULL,       NULL }
+};
+
+int
+main(int argc, char *argv[])
+{
+  char image[256];
+  mpio_t *m;
+  mpio_mem_t mem;
+  int t, k, errors, failed = 0;
+
+  if (argc > 1)
+    {
+      snprintf(image, sizeof(image), "%s", argv[1]);
+    } else {
+      snprintf(image, sizeof(image), "/tmp/emutest-%d.img", (int)getpid());
+    }
+  setenv("MPIO_EMULATOR", image, 1);
+
+  for (t = 0; emutest_tests[t].name; t++)
+    {
+      unlink(image);
+      m = mpio_init(NULL);
+      if (!m)
+	{
+	  printf("could not open the emulator image %s\n", image);
+	  return 1;
+	}
+
+      for (k = 0; k < 2; k++)
+	{
+	  mem = (k ? MPIO_EXTERNAL_MEM : MPIO_INTERNAL_MEM);
+	  mpio_memory_format(m, mem, NULL);
+	  errors = (*emutest_tests[t].test)(m, mem);
+	  failed += (errors != 0);
+	  printf("%-9s %-8s %s\n", emutest_tests[t].name, emutest_mems[k],
+		 (errors ? "FAILED" : "ok"));
+	}
+
+      mpio_close(m);
+    }
+  unlink(image);
+
+  return (failed != 0);
+}